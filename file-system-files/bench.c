@@ -0,0 +1,614 @@
+// In-process benchmark: runs libhfs against freshly formatted disk images,
+// without FUSE or the kernel, so results only measure hfs itself.
+// usage: ./bench [-r 0,1,1v] [-w workloads] [-d disks] [-m disk MB] [-B block size]
+//                [-n files] [-s file MB] [-D depth] [-e entries] [-T threads] [-i io backend]
+//                [-p read policy] [-k mkfs] [-t dir]
+// Prints one JSON object per line for every (RAID mode, workload) pair on stdout,
+// and fails if the mirrors differ once the volume is closed.
+// Anything hfs prints itself goes to stderr.
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "stdint.h"
+#include "unistd.h"
+#include "fcntl.h"
+#include "limits.h"
+#include "time.h"
+#include "errno.h"
+#include "pthread.h"
+#include "getopt.h"
+#include "hfs.h"
+#include "libhfs.h"
+#include "fixture.h"
+
+#define MAX_DISKS 16
+#define SUCCESS 0
+#define FAIL -1
+
+#define BENCH_CHUNK   (128 * 1024) /* Bytes per sequential read/write call, FUSE's default max_write */
+#define BENCH_SMALL   (4096)       /* Bytes per small file */
+#define BENCH_READDIR (50)         /* Passes over the big directory */
+#define BENCH_ALLOCS  (1000)       /* Single-block allocations per fill level */
+#define ALLOC_FILES   (10)         /* Files interleaved over the volume by the alloc workload */
+#define ALLOC_CHUNKS  (256)        /* Pieces each of them gets, which keeps their extent trees small */
+#define STRESS_FILES  (16)         /* Files each stress thread works on */
+#define STRESS_LEN    (1000)       /* Stress file k holds 200 + k * STRESS_LEN bytes once written */
+#define COMPARE_CHUNK (1 << 20)    /* Bytes compared at a time by the mirror check */
+
+static const char *workloads = "create,small,seq,stat,readdir,copy,alloc,stress";
+static int bench_disks = 2;
+static long disk_mb = 256;
+static int bench_block_size = BLOCK_SIZE;
+static int num_files = 2000;
+static int file_mb = 64;
+static int depth = 32;
+static int num_entries = 5000;
+static int num_threads = 8;
+static const char *mkfs_path = "./mkfs";
+static const char *work_dir = "/tmp";
+static struct hfs_options opts;
+// The volume being measured, and its mode for the result lines
+static struct hfs_volume *vol;
+static const char *cur_mode;
+static uint64_t *samples;
+static size_t num_samples;
+
+static void die(const char *what, const char *path, int rc) {
+    fprintf(stderr, "bench: %s %s failed: %d\n", what, path, rc);
+    exit(1);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static double sample_us(double fraction) {
+    size_t i = (size_t)(num_samples * fraction);
+    return (i < num_samples ? samples[i] : samples[num_samples - 1]) / 1000.0;
+}
+
+// Emit the result line for the num_samples operations timed since start
+static void report(const char *name, uint64_t start, size_t bytes) {
+    double seconds = (now_ns() - start) / 1e9;
+    struct hfs_volume_info info;
+    hfs_volume_info(vol, &info);
+    qsort(samples, num_samples, sizeof(uint64_t), cmp_u64);
+    printf("{\"workload\":\"%s\",\"raid\":\"%s\",\"disks\":%d,\"block_size\":%d,\"io\":\"%s\","
+           "\"ops\":%zu,\"seconds\":%.6f,\"ops_per_sec\":%.1f,\"mb_per_sec\":%.1f,"
+           "\"p50_us\":%.2f,\"p90_us\":%.2f,\"p99_us\":%.2f,\"max_us\":%.2f}\n",
+           name, cur_mode, info.num_disks, (int)info.block_size, info.io, num_samples, seconds, num_samples / seconds,
+           bytes / seconds / (1024 * 1024), sample_us(0.5), sample_us(0.9), sample_us(0.99), sample_us(1.0));
+    fflush(stdout);
+    num_samples = 0;
+}
+
+// Time one operation into samples; it must return expect
+#define TIMED(expect, call, path) do {                     \
+        uint64_t t0 = now_ns();                         \
+        int rc_ = (call);                                  \
+        samples[num_samples++] = now_ns() - t0;         \
+        if (rc_ != (expect)) die(#call, path, rc_);        \
+    } while (0)
+
+/*
+  Workloads. Each builds what it needs under its own directory without
+  timing it, then times every call of the operation being measured.
+  Data is written in a pattern unique to each file and chunk and checked
+  when read back; the time spent making and checking it is left out.
+*/
+
+// Fill buf with bytes that depend on seed and position. Returns the time taken.
+static uint64_t pattern(char *buf, size_t len, uint64_t seed) {
+    uint64_t t0 = now_ns();
+    uint64_t x = seed * 0x9E3779B97F4A7C15ULL + 1;
+    for (size_t i = 0; i < len; i += sizeof(x)) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        memcpy(buf + i, &x, len - i < sizeof(x) ? len - i : sizeof(x));
+    }
+    return now_ns() - t0;
+}
+
+// Die unless buf holds pattern(seed), using expect as scratch. Returns the time taken.
+static uint64_t verify(const char *buf, char *expect, size_t len, uint64_t seed, const char *path) {
+    uint64_t t0 = now_ns();
+    pattern(expect, len, seed);
+    if (memcmp(buf, expect, len) != 0) die("verify", path, FAIL);
+    return now_ns() - t0;
+}
+
+// Create storm: mknod num_files files in one directory
+static void bench_create(void) {
+    char path[64];
+    if (hfs_mkdir(vol, "/create", 0755) != SUCCESS) die("mkdir", "/create", FAIL);
+    uint64_t start = now_ns();
+    for (int i = 0; i < num_files; i++) {
+        snprintf(path, sizeof(path), "/create/f%d", i);
+        TIMED(SUCCESS, hfs_mknod(vol, path, S_IFREG | 0644, 0), path);
+    }
+    report("create", start, 0);
+}
+
+// Write then read back a 4 KiB file each
+static void bench_small(void) {
+    char path[64];
+    char *buf = malloc(BENCH_SMALL);
+    char *expect = malloc(BENCH_SMALL);
+    if (hfs_mkdir(vol, "/small", 0755) != SUCCESS) die("mkdir", "/small", FAIL);
+    for (int i = 0; i < num_files; i++) {
+        snprintf(path, sizeof(path), "/small/f%d", i);
+        if (hfs_mknod(vol, path, S_IFREG | 0644, 0) != SUCCESS) die("mknod", path, FAIL);
+    }
+
+    uint64_t start = now_ns();
+    for (int i = 0; i < num_files; i++) {
+        snprintf(path, sizeof(path), "/small/f%d", i);
+        start += pattern(buf, BENCH_SMALL, i);
+        TIMED(BENCH_SMALL, hfs_write(vol, path, buf, BENCH_SMALL, 0), path);
+    }
+    report("small_write", start, (size_t)num_files * BENCH_SMALL);
+
+    start = now_ns();
+    for (int i = 0; i < num_files; i++) {
+        snprintf(path, sizeof(path), "/small/f%d", i);
+        TIMED(BENCH_SMALL, hfs_read(vol, path, buf, BENCH_SMALL, 0), path);
+        start += verify(buf, expect, BENCH_SMALL, i, path);
+    }
+    report("small_read", start, (size_t)num_files * BENCH_SMALL);
+    free(buf);
+    free(expect);
+}
+
+// Large sequential write then read of one file, through an open hfs_file
+static void bench_seq(void) {
+    const char *path = "/seq";
+    char *buf = malloc(BENCH_CHUNK);
+    char *expect = malloc(BENCH_CHUNK);
+    if (hfs_mknod(vol, path, S_IFREG | 0644, 0) != SUCCESS) die("mknod", path, FAIL);
+    hfs_ino_t ino = hfs_open(vol, path);
+    if (ino < 0) die("open", path, ino);
+    struct hfs_file *f;
+    int rc = hfs_file_open(vol, ino, &f);
+    if (rc < 0) die("open", path, rc);
+    size_t total = (size_t)file_mb * 1024 * 1024;
+
+    uint64_t start = now_ns();
+    for (size_t off = 0; off < total; off += BENCH_CHUNK) {
+        start += pattern(buf, BENCH_CHUNK, off / BENCH_CHUNK);
+        TIMED(BENCH_CHUNK, hfs_file_write(vol, f, buf, BENCH_CHUNK, off), path);
+    }
+    report("seq_write", start, total);
+
+    start = now_ns();
+    for (size_t off = 0; off < total; off += BENCH_CHUNK) {
+        TIMED(BENCH_CHUNK, hfs_file_read(vol, f, buf, BENCH_CHUNK, off), path);
+        start += verify(buf, expect, BENCH_CHUNK, off / BENCH_CHUNK, path);
+    }
+    report("seq_read", start, total);
+    hfs_file_close(vol, f);
+    free(buf);
+    free(expect);
+}
+
+// getattr of a file depth directories down
+static void bench_stat(void) {
+    char path[PATH_MAX] = "/deep";
+    struct stat st;
+    if (hfs_mkdir(vol, path, 0755) != SUCCESS) die("mkdir", path, FAIL);
+    for (int i = 0; i < depth; i++) {
+        size_t len = strlen(path);
+        snprintf(path + len, sizeof(path) - len, "/d%d", i);
+        if (hfs_mkdir(vol, path, 0755) != SUCCESS) die("mkdir", path, FAIL);
+    }
+    strcat(path, "/f");
+    if (hfs_mknod(vol, path, S_IFREG | 0644, 0) != SUCCESS) die("mknod", path, FAIL);
+
+    uint64_t start = now_ns();
+    for (int i = 0; i < num_files; i++) {
+        TIMED(SUCCESS, hfs_stat(vol, path, &st), path);
+    }
+    report("deep_stat", start, 0);
+}
+
+static int count_entry(void *buf, const char *name, const struct stat *st, off_t off) {
+    (*(int *)buf)++;
+    return 0;
+}
+
+// readdir of a directory with num_entries entries
+static void bench_readdir(void) {
+    char path[64];
+    if (hfs_mkdir(vol, "/big", 0755) != SUCCESS) die("mkdir", "/big", FAIL);
+    for (int i = 0; i < num_entries; i++) {
+        snprintf(path, sizeof(path), "/big/entry-%d", i);
+        if (hfs_mknod(vol, path, S_IFREG | 0644, 0) != SUCCESS) die("mknod", path, FAIL);
+    }
+
+    uint64_t start = now_ns();
+    for (int i = 0; i < BENCH_READDIR; i++) {
+        int seen = 0;
+        TIMED(SUCCESS, hfs_readdir(vol, "/big", count_entry, &seen), "/big");
+        if (seen != num_entries + 2) die("readdir count", "/big", seen);
+    }
+    report("readdir", start, 0);
+}
+
+static struct hfs_file *open_file(const char *path) {
+    if (hfs_mknod(vol, path, S_IFREG | 0644, 0) != SUCCESS) die("mknod", path, FAIL);
+    hfs_ino_t ino = hfs_open(vol, path);
+    if (ino < 0) die("open", path, ino);
+    struct hfs_file *f;
+    int rc = hfs_file_open(vol, ino, &f);
+    if (rc < 0) die("open", path, rc);
+    return f;
+}
+
+// One chunk the way a copy through FUSE goes: read into a buffer, write it out
+static int copy_chunk(struct hfs_file *src, struct hfs_file *dst, char *buf, off_t off) {
+    int rc = hfs_file_read(vol, src, buf, BENCH_CHUNK, off);
+    return rc < 0 ? rc : hfs_file_write(vol, dst, buf, rc, off);
+}
+
+// Copy a file_mb MB file a chunk at a time, through a buffer and then with hfs_file_copy_range
+static void bench_copy(void) {
+    char *buf = malloc(BENCH_CHUNK);
+    memset(buf, 'c', BENCH_CHUNK);
+    struct hfs_file *src = open_file("/copy_src");
+    struct hfs_file *rw = open_file("/copy_rw");
+    struct hfs_file *shared = open_file("/copy_range");
+    size_t total = (size_t)file_mb * 1024 * 1024;
+    for (size_t off = 0; off < total; off += BENCH_CHUNK) {
+        if (hfs_file_write(vol, src, buf, BENCH_CHUNK, off) != BENCH_CHUNK) die("write", "/copy_src", FAIL);
+    }
+
+    uint64_t start = now_ns();
+    for (size_t off = 0; off < total; off += BENCH_CHUNK) {
+        TIMED(BENCH_CHUNK, copy_chunk(src, rw, buf, off), "/copy_rw");
+    }
+    report("copy_rw", start, total);
+
+    start = now_ns();
+    for (size_t off = 0; off < total; off += BENCH_CHUNK) {
+        TIMED(BENCH_CHUNK, (int)hfs_file_copy_range(vol, src, off, shared, off, BENCH_CHUNK), "/copy_range");
+    }
+    report("copy_range", start, total);
+
+    hfs_file_close(vol, src);
+    hfs_file_close(vol, rw);
+    hfs_file_close(vol, shared);
+    // Give the space back to later workloads
+    hfs_unlink(vol, "/copy_src");
+    hfs_unlink(vol, "/copy_rw");
+    hfs_unlink(vol, "/copy_range");
+    free(buf);
+}
+
+/*
+  Allocation rate against fill level. ALLOC_FILES files take turns at
+  ALLOC_CHUNKS pieces each until little space is left, so each holds an
+  even share of the volume spread across all of it. Removing them one at a
+  time then steps the fill level down, each time leaving free space
+  scattered in runs across the volume rather than in one piece after the
+  allocation hint. At each level BENCH_ALLOCS one-block fallocates go to a
+  probe file, which is removed again before the next level. Levels below
+  what earlier workloads left behind are not reached.
+*/
+static void bench_alloc(void) {
+    struct hfs_volume_info info;
+    hfs_volume_info(vol, &info);
+    // Leave room for the files' extent trees and the probe
+    size_t spare = info.total_blocks / 50 + 2 * BENCH_ALLOCS;
+    size_t chunks = info.free_blocks > spare ? ALLOC_FILES * ALLOC_CHUNKS : 0;
+    off_t chunk = chunks ? (off_t)((info.free_blocks - spare) / chunks) * info.block_size : 0;
+    if (chunk == 0) chunks = 0;
+
+    char path[64];
+    struct hfs_file *fill[ALLOC_FILES];
+    if (hfs_mkdir(vol, "/alloc", 0755) != SUCCESS) die("mkdir", "/alloc", FAIL);
+    for (int i = 0; i < ALLOC_FILES; i++) {
+        snprintf(path, sizeof(path), "/alloc/fill%d", i);
+        fill[i] = open_file(path);
+    }
+    for (size_t c = 0; c < chunks; c++) {
+        off_t off = (off_t)(c / ALLOC_FILES) * chunk;
+        int rc = hfs_file_fallocate(vol, fill[c % ALLOC_FILES], 0, off, chunk);
+        if (rc != SUCCESS) die("fallocate", "/alloc/fill", rc);
+    }
+    for (int i = 0; i < ALLOC_FILES; i++) {
+        hfs_file_close(vol, fill[i]);
+    }
+
+    for (int removed = 0; removed <= ALLOC_FILES; removed++) {
+        // Commit the removal first, so its blocks are free in the label and the timings don't wait for it
+        if (hfs_fsync(vol, "/alloc") != SUCCESS) die("fsync", "/alloc", FAIL);
+        hfs_volume_info(vol, &info);
+        char name[32];
+        snprintf(name, sizeof(name), "alloc_%d", (int)(100 * (info.total_blocks - info.free_blocks) / info.total_blocks));
+
+        struct hfs_file *probe = open_file("/alloc/probe");
+        uint64_t start = now_ns();
+        for (int i = 0; i < BENCH_ALLOCS; i++) {
+            TIMED(SUCCESS, hfs_file_fallocate(vol, probe, 0, (off_t)i * info.block_size, info.block_size), "/alloc/probe");
+        }
+        report(name, start, 0);
+        hfs_file_close(vol, probe);
+        if (hfs_unlink(vol, "/alloc/probe") != SUCCESS) die("unlink", "/alloc/probe", FAIL);
+
+        if (removed < ALLOC_FILES) {
+            snprintf(path, sizeof(path), "/alloc/fill%d", ALLOC_FILES - 1 - removed);
+            if (hfs_unlink(vol, path) != SUCCESS) die("unlink", path, FAIL);
+        }
+    }
+    hfs_rmdir(vol, "/alloc");
+}
+
+/*
+  Multi-threaded stress: each of num_threads threads makes num_files random
+  creates, writes, reads and unlinks of its own STRESS_FILES files, all in
+  one directory, so they contend on the directory and the allocator but
+  never on a file. Each thread knows what its files should hold, so every
+  result and every byte read back is checked: a create of a file that exists
+  must fail with EEXIST, a write, read or unlink of one that does not with
+  ENOENT, and a read must return the whole last pattern written, or nothing
+  if the file was created since. Each operation's latency goes
+  to the thread's own share of samples. Whether the mirrors still agree is
+  checked once the volume is closed (see compare_mirrors).
+*/
+struct stress_file {
+    bool exists;
+    bool written;
+    uint64_t seed; // of the pattern last written
+};
+
+static void *stress_thread(void *arg) {
+    int t = (int)(intptr_t)arg;
+    unsigned int rng = t + 1;
+    struct stress_file files[STRESS_FILES] = {{0}};
+    size_t max = 200 + (STRESS_FILES - 1) * STRESS_LEN;
+    char *buf = malloc(max);
+    char *expect = malloc(max);
+    uint64_t *lat = samples + (size_t)t * num_files;
+    char path[64];
+
+    for (int i = 0; i < num_files; i++) {
+        int k = rand_r(&rng) % STRESS_FILES;
+        struct stress_file *f = &files[k];
+        size_t len = 200 + k * STRESS_LEN;
+        snprintf(path, sizeof(path), "/stress/t%d-f%d", t, k);
+
+        uint64_t t0 = now_ns();
+        int rc, want;
+        switch (rand_r(&rng) % 4) {
+            case 0:
+                rc = hfs_mknod(vol, path, S_IFREG | 0644, 0);
+                want = f->exists ? -EEXIST : SUCCESS;
+                if (!f->exists) *f = (struct stress_file){true, false, 0};
+                break;
+            case 1:
+                if (f->exists) pattern(buf, len, ((uint64_t)t << 32) | i);
+                rc = hfs_write(vol, path, buf, len, 0);
+                want = f->exists ? (int)len : -ENOENT;
+                if (f->exists) {
+                    f->written = true;
+                    f->seed = ((uint64_t)t << 32) | i;
+                }
+                break;
+            case 2:
+                rc = hfs_read(vol, path, buf, max, 0);
+                want = !f->exists ? -ENOENT : f->written ? (int)len : 0;
+                if (rc == want && want > 0) verify(buf, expect, len, f->seed, path);
+                break;
+            default:
+                rc = hfs_unlink(vol, path);
+                want = f->exists ? SUCCESS : -ENOENT;
+                f->exists = false;
+                break;
+        }
+        lat[i] = now_ns() - t0;
+        if (rc != want) die("stress", path, rc);
+    }
+    free(buf);
+    free(expect);
+    return NULL;
+}
+
+static void bench_stress(void) {
+    char path[64];
+    pthread_t threads[num_threads];
+    if (hfs_mkdir(vol, "/stress", 0755) != SUCCESS) die("mkdir", "/stress", FAIL);
+
+    uint64_t start = now_ns();
+    for (int t = 0; t < num_threads; t++) {
+        if (pthread_create(&threads[t], NULL, stress_thread, (void *)(intptr_t)t) != 0) die("pthread_create", "/stress", FAIL);
+    }
+    for (int t = 0; t < num_threads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    num_samples = (size_t)num_threads * num_files;
+    report("stress", start, 0);
+
+    for (int t = 0; t < num_threads; t++) {
+        for (int k = 0; k < STRESS_FILES; k++) {
+            snprintf(path, sizeof(path), "/stress/t%d-f%d", t, k);
+            hfs_unlink(vol, path);
+        }
+    }
+    hfs_rmdir(vol, "/stress");
+}
+
+static const struct {
+    const char *name;
+    void (*run)(void);
+} bench_workloads[] = {
+    {"create",  bench_create},
+    {"small",   bench_small},
+    {"seq",     bench_seq},
+    {"stat",    bench_stat},
+    {"readdir", bench_readdir},
+    {"copy",    bench_copy},
+    {"alloc",   bench_alloc},
+    {"stress",  bench_stress},
+};
+
+// Whether name is in the comma-separated list
+static bool listed(const char *list, const char *name) {
+    size_t len = strlen(name);
+    for (const char *p = list; p != NULL; p = strchr(p, ',')) {
+        if (*p == ',') p++;
+        if (strncmp(p, name, len) == 0 && (p[len] == ',' || p[len] == '\0')) return true;
+    }
+    return false;
+}
+
+/*
+  After the workloads, check that every disk holds the same bytes as disk 0
+  wherever the volume keeps a copy on each: everything after the super block
+  (whose disk_index differs) up to the data blocks, and in RAID 1 and 1v the
+  data blocks too. RAID 0 stripes the data blocks, so each disk holds
+  different ones there. The volume must be closed, so everything is written
+  back, and the journal has copied the committed metadata to every disk.
+*/
+static int compare_mirrors(char *paths[]) {
+    int fds[MAX_DISKS];
+    for (int i = 0; i < bench_disks; i++) {
+        fds[i] = open(paths[i], O_RDONLY);
+        if (fds[i] < 0) die("open", paths[i], -errno);
+    }
+    struct hfs_sb sb;
+    if (pread(fds[0], &sb, sizeof(sb), 0) != sizeof(sb)) die("read", paths[0], FAIL);
+    off_t end = sb.d_blocks_ptr;
+    if (sb.mode != 0) end += (off_t)sb.num_data_blocks * (sb.block_size ? sb.block_size : BLOCK_SIZE);
+
+    int rc = SUCCESS;
+    char *first = malloc(COMPARE_CHUNK);
+    char *other = malloc(COMPARE_CHUNK);
+    for (off_t off = sizeof(sb); off < end && rc == SUCCESS; off += COMPARE_CHUNK) {
+        size_t len = end - off < COMPARE_CHUNK ? end - off : COMPARE_CHUNK;
+        if (pread(fds[0], first, len, off) != (ssize_t)len) die("read", paths[0], FAIL);
+        for (int i = 1; i < bench_disks && rc == SUCCESS; i++) {
+            if (pread(fds[i], other, len, off) != (ssize_t)len) die("read", paths[i], FAIL);
+            if (memcmp(first, other, len) != 0) {
+                size_t at = 0;
+                while (first[at] == other[at]) at++;
+                fprintf(stderr, "bench: RAID %s disk %d differs from disk 0 at byte %ld\n", cur_mode, i, (long)(off + at));
+                rc = FAIL;
+            }
+        }
+    }
+    free(first);
+    free(other);
+    for (int i = 0; i < bench_disks; i++) {
+        close(fds[i]);
+    }
+    return rc;
+}
+
+// Format, open, run the selected workloads on and remove one volume in mode
+static int bench_mode(const char *mode) {
+    char *paths[MAX_DISKS];
+    off_t size = (off_t)disk_mb * 1024 * 1024;
+    for (int i = 0; i < bench_disks; i++) {
+        paths[i] = malloc(PATH_MAX);
+        snprintf(paths[i], PATH_MAX, "%s/hfs-bench-%d-disk%d", work_dir, (int)getpid(), i);
+        int fd = open(paths[i], O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || ftruncate(fd, size) != 0) {
+            fprintf(stderr, "bench: cannot create %s\n", paths[i]);
+            return FAIL;
+        }
+        close(fd);
+    }
+
+    // Enough inodes for every workload, and blocks for the rest of the images
+    long inodes = 2L * num_files + num_entries + depth + (long)num_threads * STRESS_FILES + 64;
+    long blocks = fixture_blocks(mode, bench_disks, size, inodes, bench_block_size);
+
+    int rc = fixture_mkfs(mkfs_path, mode, paths, bench_disks, inodes, blocks, bench_block_size);
+    if (rc != SUCCESS) {
+        fprintf(stderr, "bench: %s failed for RAID %s\n", mkfs_path, mode);
+    } else {
+        rc = hfs_volume_open(paths, bench_disks, &opts, &vol);
+    }
+    if (rc == SUCCESS) {
+        cur_mode = mode;
+        for (size_t w = 0; w < sizeof(bench_workloads) / sizeof(bench_workloads[0]); w++) {
+            if (listed(workloads, bench_workloads[w].name)) {
+                bench_workloads[w].run();
+            }
+        }
+        hfs_volume_close(vol);
+        rc = compare_mirrors(paths);
+    }
+
+    for (int i = 0; i < bench_disks; i++) {
+        unlink(paths[i]);
+        free(paths[i]);
+    }
+    return rc;
+}
+
+int main(int argc, char *argv[]) {
+    const char *modes = "0,1,1v";
+    int opt;
+    while ((opt = getopt(argc, argv, "r:w:d:m:B:n:s:D:e:T:i:p:k:t:")) != -1) {
+        switch (opt) {
+            case 'r': modes = optarg; break;
+            case 'w': workloads = optarg; break;
+            case 'd': bench_disks = atoi(optarg); break;
+            case 'm': disk_mb = atol(optarg); break;
+            case 'B': bench_block_size = atoi(optarg); break;
+            case 'n': num_files = atoi(optarg); break;
+            case 's': file_mb = atoi(optarg); break;
+            case 'D': depth = atoi(optarg); break;
+            case 'e': num_entries = atoi(optarg); break;
+            case 'T': num_threads = atoi(optarg); break;
+            case 'i': opts.io = optarg; break;
+            case 'p': opts.read_policy = optarg; break;
+            case 'k': mkfs_path = optarg; break;
+            case 't': work_dir = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-r 0,1,1v] [-w create,small,seq,stat,readdir,copy,alloc,stress] [-d disks] [-m disk MB]\n"
+                                "       [-B block size] [-n files] [-s file MB] [-D depth] [-e entries] [-T threads] [-i mmap|pread|uring]\n"
+                                "       [-p rr|lor|locality] [-k mkfs] [-t dir]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (bench_disks < 2 || bench_disks > MAX_DISKS || num_files < 1 || file_mb < 1 || depth < 0 || num_entries < 1 || num_threads < 1) {
+        fprintf(stderr, "bench: need 2 to %d disks and positive counts\n", MAX_DISKS);
+        return 1;
+    }
+
+    size_t max = (size_t)file_mb * 1024 * 1024 / BENCH_CHUNK;
+    if ((size_t)num_files > max) max = num_files;
+    if (BENCH_READDIR > max) max = BENCH_READDIR;
+    if (BENCH_ALLOCS > max) max = BENCH_ALLOCS;
+    if ((size_t)num_threads * num_files > max) max = (size_t)num_threads * num_files;
+    samples = malloc(max * sizeof(uint64_t));
+    if (samples == NULL) {
+        fprintf(stderr, "bench: out of memory\n");
+        return 1;
+    }
+
+    int rc = SUCCESS;
+    for (const char *p = modes; p != NULL && rc == SUCCESS; p = strchr(p, ',')) {
+        if (*p == ',') p++;
+        char mode[4];
+        size_t len = strcspn(p, ",");
+        if (len == 0 || len >= sizeof(mode)) {
+            fprintf(stderr, "bench: bad RAID mode list %s\n", modes);
+            return 1;
+        }
+        memcpy(mode, p, len);
+        mode[len] = '\0';
+        rc = bench_mode(mode);
+    }
+    free(samples);
+    return rc == SUCCESS ? 0 : 1;
+}
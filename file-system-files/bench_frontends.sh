@@ -0,0 +1,69 @@
+#!/bin/bash
+# Compare the path-based front end (hfs) with the low-level one (hfs_ll) on the same workloads.
+# usage: ./bench_frontends.sh [files] [depth] [disk MB]
+# Builds hfs, hfs_ll and mkfs first (make). Disk images and the mount point go in a temp dir.
+# Each front end gets freshly formatted RAID 1 images and runs with direct I/O, so
+# data requests reach hfs rather than the page cache.
+
+FILES=${1:-2000}
+DEPTH=${2:-16}
+DISK_MB=${3:-64}
+STATS=2000
+
+make -s hfs hfs_ll mkfs || exit 1
+WORK=$(mktemp -d)
+trap 'fusermount -u "$WORK/mnt" 2>/dev/null; wait; rm -rf "$WORK"' EXIT
+mkdir "$WORK/mnt"
+MNT="$WORK/mnt"
+
+# Seconds taken by a command, to the millisecond
+elapsed() {
+    local start=$(date +%s.%N)
+    "$@" > /dev/null 2>&1
+    awk -v s="$start" -v e="$(date +%s.%N)" 'BEGIN {printf "%.3f", e - s}'
+}
+
+create_files() {
+    for i in $(seq 1 "$FILES"); do : > "$MNT/many/f$i"; done
+}
+
+stat_deep() {
+    for i in $(seq 1 "$STATS"); do stat "$DEEP/leaf" > /dev/null; done
+}
+
+run() {
+    local name=$1 flag=$2
+    dd if=/dev/zero of="$WORK/disk1" bs=1M count=$DISK_MB status=none
+    dd if=/dev/zero of="$WORK/disk2" bs=1M count=$DISK_MB status=none
+    ./mkfs -r 1 -d "$WORK/disk1" -d "$WORK/disk2" -i $(( FILES + DEPTH + 64 )) -b $(( (DISK_MB - 4) * 2048 )) > /dev/null || exit 1
+    # -f keeps the front end in the foreground, in the background of this script, so it can be waited for
+    ./$name "$WORK/disk1" "$WORK/disk2" $flag -f "$MNT" > /dev/null &
+    local pid=$!
+    until mountpoint -q "$MNT"; do
+        kill -0 $pid 2>/dev/null || exit 1
+        sleep 0.1
+    done
+
+    mkdir "$MNT/many"
+    DEEP="$MNT"
+    for d in $(seq 1 "$DEPTH"); do DEEP="$DEEP/d$d"; mkdir "$DEEP"; done
+    : > "$DEEP/leaf"
+
+    # dd's summary line ends with the rate, e.g. "... s, 81.2 MB/s"
+    local w=$(dd if=/dev/zero of="$MNT/f" bs=4k count=4096 2>&1 | tail -1 | awk '{print $(NF-1), $NF}')
+    local r=$(dd if="$MNT/f" of=/dev/null bs=4k 2>&1 | tail -1 | awk '{print $(NF-1), $NF}')
+    local c=$(elapsed create_files)
+    local l=$(elapsed ls -l "$MNT/many")
+    local s=$(elapsed stat_deep)
+    printf "%-7s %12s %12s %10s %10s %10s\n" "$name" "$w" "$r" "$c" "$l" "$s"
+
+    # fusermount returns before the front end has closed the volume; wait for it before the images go
+    fusermount -u "$MNT"
+    wait $pid
+    rm -f "$WORK/disk1" "$WORK/disk2"
+}
+
+echo "$FILES files, stat $STATS times at depth $DEPTH; times in seconds"
+printf "%-7s %12s %12s %10s %10s %10s\n" "" "4k write" "4k read" "create" "ls -l" "deep stat"
+run hfs "-o direct_io"
+run hfs_ll "--direct-io"
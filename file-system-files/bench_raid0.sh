@@ -0,0 +1,43 @@
+#!/bin/bash
+# Sequential write/read throughput of a RAID 0 volume as disks are added.
+# usage: ./bench_raid0.sh [max disks] [file MB] [stripe unit bytes]
+# Builds hfs and mkfs first (make). Disk images and the mount point go in a temp dir.
+
+MAX_DISKS=${1:-4}
+FILE_MB=${2:-48}
+STRIPE=${3:-65536}
+DISK_MB=$(( FILE_MB + 16 ))
+
+make -s || exit 1
+WORK=$(mktemp -d)
+trap 'fusermount -u "$WORK/mnt" 2>/dev/null; wait; rm -rf "$WORK"' EXIT
+mkdir "$WORK/mnt"
+
+echo "disks  write MB/s  read MB/s"
+for n in $(seq 2 "$MAX_DISKS"); do
+    DISKS=()
+    for d in $(seq 1 "$n"); do
+        dd if=/dev/zero of="$WORK/disk$d" bs=1M count=$DISK_MB status=none
+        DISKS+=("$WORK/disk$d")
+    done
+    # 4 MiB of each disk for the super block, bitmaps, inodes and journal, plus 4 bytes of checksum per block on every disk
+    ./mkfs -r 0 $(printf -- "-d %s " "${DISKS[@]}") -i 64 -b $(( (DISK_MB - 4 - DISK_MB * n / 1024) * 256 )) -B 4096 -s "$STRIPE" || exit 1
+    # direct_io so reads reach hfs instead of the page cache. -f keeps hfs in the foreground,
+    # in the background of this script, so it can be waited for after the unmount
+    ./hfs "${DISKS[@]}" -f -o direct_io "$WORK/mnt" > /dev/null &
+    HFS_PID=$!
+    until mountpoint -q "$WORK/mnt"; do
+        kill -0 $HFS_PID 2>/dev/null || exit 1
+        sleep 0.1
+    done
+
+    # dd's summary line ends with the rate, e.g. "... s, 812 MB/s"
+    W=$(dd if=/dev/zero of="$WORK/mnt/f" bs=1M count=$FILE_MB 2>&1 | tail -1 | awk '{print $(NF-1), $NF}')
+    R=$(dd if="$WORK/mnt/f" of=/dev/null bs=1M 2>&1 | tail -1 | awk '{print $(NF-1), $NF}')
+    printf "%5d  %10s  %9s\n" "$n" "$W" "$R"
+
+    # fusermount returns before hfs has closed the volume; wait for it before the images go
+    fusermount -u "$WORK/mnt"
+    wait $HFS_PID
+    rm -f "${DISKS[@]}"
+done
@@ -0,0 +1,84 @@
+#!/bin/bash
+# Read throughput of RAID 1v (verified mirror) against plain RAID 1, then a
+# corruption check: damage one mirror of a 1v volume and make sure reads
+# still return the right data and the bad copy gets repaired.
+# usage: ./bench_raid1v.sh [disks] [file MB]
+# Builds hfs and mkfs first (make). Disk images and the mount point go in a temp dir.
+
+NUM_DISKS=${1:-3}
+FILE_MB=${2:-48}
+DISK_MB=$(( FILE_MB + 16 ))
+
+make -s || exit 1
+WORK=$(mktemp -d)
+trap 'fusermount -u "$WORK/mnt" 2>/dev/null; wait; rm -rf "$WORK"' EXIT
+mkdir "$WORK/mnt"
+
+DISKS=()
+for d in $(seq 1 "$NUM_DISKS"); do
+    DISKS+=("$WORK/disk$d")
+done
+
+format() {
+    for disk in "${DISKS[@]}"; do
+        dd if=/dev/zero of="$disk" bs=1M count=$DISK_MB status=none
+    done
+    # 4 MiB for the super block, bitmaps, inodes and journal, and the checksums (4 bytes per block) on top
+    ./mkfs -r "$1" $(printf -- "-d %s " "${DISKS[@]}") -i 64 -b $(( (DISK_MB - 4 - DISK_MB / 1024) * 256 )) -B 4096 || exit 1
+}
+
+# direct_io so reads reach hfs instead of the page cache. -f keeps hfs in the
+# foreground, in the background of this script, so unmount_hfs can wait for it:
+# fusermount returns before hfs has closed the volume and written it back.
+mount_hfs() {
+    ./hfs "${DISKS[@]}" -f -o direct_io "$WORK/mnt" > /dev/null &
+    HFS_PID=$!
+    until mountpoint -q "$WORK/mnt"; do
+        kill -0 $HFS_PID 2>/dev/null || exit 1
+        sleep 0.1
+    done
+}
+
+unmount_hfs() {
+    fusermount -u "$WORK/mnt"
+    wait $HFS_PID
+}
+
+echo "mode  read MB/s"
+for mode in 1 1v; do
+    format $mode
+    mount_hfs
+    dd if=/dev/zero of="$WORK/mnt/f" bs=1M count=$FILE_MB status=none
+    # dd's summary line ends with the rate, e.g. "... s, 812 MB/s"
+    R=$(dd if="$WORK/mnt/f" of=/dev/null bs=1M 2>&1 | tail -1 | awk '{print $(NF-1), $NF}')
+    printf "%4s  %9s\n" "$mode" "$R"
+    unmount_hfs
+done
+
+# Corruption check: every 1v read compares all mirrors, so the damage is found whichever
+# mirror the read would pick. A marker in the file makes its data easy to find on disk.
+format 1v
+mount_hfs
+{ printf 'HFS1VMARK'; head -c 100000 /dev/urandom; } > "$WORK/expected"
+cp "$WORK/expected" "$WORK/mnt/f"
+unmount_hfs
+
+OFFSET=$(grep -obaF HFS1VMARK "${DISKS[1]}" | head -1 | cut -d: -f1)
+if [ -z "$OFFSET" ]; then
+    echo "corruption check: marker not found"
+    exit 1
+fi
+printf 'XXXXXXXX' | dd of="${DISKS[1]}" bs=1 seek=$(( OFFSET + 4096 )) conv=notrunc status=none
+
+mount_hfs
+cmp -s "$WORK/expected" "$WORK/mnt/f" && READ_OK=1
+unmount_hfs
+
+# After the repair the mirrors hold the same file data again (a fresh volume lays the file out contiguously)
+DIFFS=$(cmp -l -i "$OFFSET" -n "$(stat -c %s "$WORK/expected")" "${DISKS[0]}" "${DISKS[1]}" | wc -l)
+if [ -n "$READ_OK" ] && [ "$DIFFS" -eq 0 ]; then
+    echo "corruption check: passed"
+else
+    echo "corruption check: FAILED (data ok: ${READ_OK:-0}, differing bytes: $DIFFS)"
+    exit 1
+fi
@@ -0,0 +1,294 @@
+// Crash test: runs a multi-threaded workload on libhfs in a child process,
+// kills it with SIGKILL at a random moment, then opens the volume again,
+// which recovers it from the journal, and checks every file the workload
+// wrote. Whatever was in the page cache when the child died reaches the
+// images, so anything hfs changed in place without committing shows up.
+// usage: ./crashtest [-r 0,1,1v] [-d disks] [-m disk MB] [-B block size] [-n rounds]
+//                    [-T threads] [-f files per thread] [-w max ms] [-s seed] [-k mkfs] [-t dir]
+// Fails on the first file that is neither empty nor exactly one of the
+// contents written to it.
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "stdint.h"
+#include "stdbool.h"
+#include "unistd.h"
+#include "fcntl.h"
+#include "limits.h"
+#include "time.h"
+#include "errno.h"
+#include "signal.h"
+#include "pthread.h"
+#include "getopt.h"
+#include "sys/wait.h"
+#include "hfs.h"
+#include "libhfs.h"
+#include "fixture.h"
+
+#define MAX_DISKS 16
+#define SUCCESS 0
+#define FAIL -1
+
+#define CRASH_MAX_LEN (12000) /* Longest content, so files range from inline to a few dozen blocks */
+
+static const char *modes = "0,1,1v";
+static int crash_disks = 2;
+static long disk_mb = 64;
+static int crash_block_size = BLOCK_SIZE;
+static int num_rounds = 20;
+static int num_threads = 8;
+static int files_per_thread = 64;
+static int max_ms = 200;
+static unsigned int seed;       // printed, so a failing run can be repeated with -s
+static unsigned int delay_rng;  // picks when each crash happens
+static const char *mkfs_path = "./mkfs";
+static const char *work_dir = "/tmp";
+static struct hfs_volume *vol;
+static const char *cur_mode;
+
+static void die(const char *what, const char *path, int rc) {
+    fprintf(stderr, "crashtest: RAID %s (seed %u): %s %s failed: %d\n", cur_mode, seed, what, path, rc);
+    exit(1);
+}
+
+/*
+  Contents. File n's content for generation gen starts with a line naming
+  both, so a file read back says which write it should match, followed by
+  filler that depends on both and a length picked by gen.
+*/
+static size_t content(char *buf, int n, unsigned int gen) {
+    size_t len = snprintf(buf, CRASH_MAX_LEN, "content %d gen %u\n", n, gen);
+    size_t total = len + (gen * 7919u) % (CRASH_MAX_LEN - 64);
+    for (size_t i = len; i < total; i++) {
+        buf[i] = 'a' + (n + gen + i) % 26;
+    }
+    return total;
+}
+
+static void file_path(char *path, size_t size, int n) {
+    snprintf(path, size, "/crash/f%d", n);
+}
+
+// Write file n from scratch: one truncate and one write, so it is empty or whole at every commit
+static int rewrite(int n, unsigned int gen, char *buf) {
+    char path[64];
+    file_path(path, sizeof(path), n);
+    size_t len = content(buf, n, gen);
+
+    int rc = hfs_mknod(vol, path, S_IFREG | 0644, 0);
+    if (rc != SUCCESS && rc != -EEXIST) return rc;
+    rc = hfs_truncate(vol, path, 0);
+    if (rc != SUCCESS) return rc;
+    rc = hfs_write(vol, path, buf, len, 0);
+    return rc == (int)len ? SUCCESS : (rc < 0 ? rc : -EIO);
+}
+
+/*
+  The workload. Each thread owns files_per_thread files, all in /crash, and
+  rewrites or unlinks one of them at random until the process is killed.
+  Generations carry the round, so no content repeats across rounds.
+*/
+struct worker {
+    int thread;
+    unsigned int round;
+};
+
+static void *worker_main(void *arg) {
+    struct worker *w = arg;
+    unsigned int rng = seed ^ (w->round * 131 + w->thread);
+    char *buf = malloc(CRASH_MAX_LEN);
+    char path[64];
+    if (buf == NULL) die("malloc", "", -ENOMEM);
+
+    for (unsigned int i = 0; ; i++) {
+        int n = w->thread * files_per_thread + rand_r(&rng) % files_per_thread;
+        int rc;
+        if (rand_r(&rng) % 4 == 0) {
+            file_path(path, sizeof(path), n);
+            rc = hfs_unlink(vol, path);
+            if (rc == -ENOENT) rc = SUCCESS;
+        } else {
+            file_path(path, sizeof(path), n);
+            rc = rewrite(n, (w->round << 20) | (i & 0xfffff), buf);
+        }
+        if (rc != SUCCESS) die("workload", path, rc);
+    }
+    return NULL;
+}
+
+// The child: open, run the workload and wait to be killed
+static void run_child(char *paths[], unsigned int round) {
+    int rc = hfs_volume_open(paths, crash_disks, NULL, &vol);
+    if (rc != SUCCESS) die("open", paths[0], rc);
+    rc = hfs_mkdir(vol, "/crash", 0755);
+    if (rc != SUCCESS && rc != -EEXIST) die("mkdir", "/crash", rc);
+
+    pthread_t threads[num_threads];
+    struct worker workers[num_threads];
+    for (int t = 0; t < num_threads; t++) {
+        workers[t] = (struct worker){t, round};
+        if (pthread_create(&threads[t], NULL, worker_main, &workers[t]) != 0) die("pthread_create", "", FAIL);
+    }
+    for (int t = 0; t < num_threads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    _exit(0);
+}
+
+static int note_file(void *ctx, const char *name, const struct stat *st, off_t offset) {
+    bool *present = ctx;
+    int n;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) return 0;
+    if (sscanf(name, "f%d", &n) != 1 || n < 0 || n >= num_threads * files_per_thread || present[n]) {
+        die("unexpected entry", name, FAIL);
+    }
+    present[n] = true;
+    return 0;
+}
+
+// Read file n back; it must be empty or match the generation it names
+static void check_file(int n, char *buf, char *expect) {
+    char path[64];
+    file_path(path, sizeof(path), n);
+    int rc = hfs_read(vol, path, buf, CRASH_MAX_LEN + 1, 0);
+    if (rc < 0) die("read", path, rc);
+    if (rc == 0) return;
+
+    int named;
+    unsigned int gen;
+    if (sscanf(buf, "content %d gen %u\n", &named, &gen) != 2 || named != n) die("content header", path, rc);
+    size_t len = content(expect, n, gen);
+    if ((size_t)rc != len) die("content length", path, rc);
+    if (memcmp(buf, expect, len) != 0) die("content", path, rc);
+}
+
+/*
+  After a crash: check what survived, then rewrite every file and check
+  them all again, which fails if recovery left two files sharing a block
+  or a block both allocated and free.
+*/
+static void check_volume(char *paths[], unsigned int round) {
+    int rc = hfs_volume_open(paths, crash_disks, NULL, &vol);
+    if (rc != SUCCESS) die("reopen", paths[0], rc);
+
+    int num_files = num_threads * files_per_thread;
+    bool *present = calloc(num_files, sizeof(bool));
+    char *buf = malloc(CRASH_MAX_LEN + 1);
+    char *expect = malloc(CRASH_MAX_LEN);
+    if (present == NULL || buf == NULL || expect == NULL) die("malloc", "", -ENOMEM);
+
+    rc = hfs_readdir(vol, "/crash", note_file, present);
+    if (rc != SUCCESS && rc != -ENOENT) die("readdir", "/crash", rc);
+    for (int n = 0; n < num_files; n++) {
+        if (present[n]) check_file(n, buf, expect);
+    }
+
+    if (rc == -ENOENT && (rc = hfs_mkdir(vol, "/crash", 0755)) != SUCCESS) die("mkdir", "/crash", rc);
+    for (int n = 0; n < num_files; n++) {
+        rc = rewrite(n, (round << 20) | 0xfffff, expect);
+        if (rc != SUCCESS) die("rewrite", "/crash", rc);
+    }
+    for (int n = 0; n < num_files; n++) {
+        check_file(n, buf, expect);
+    }
+
+    hfs_volume_close(vol);
+    free(present);
+    free(buf);
+    free(expect);
+}
+
+// Format a volume in mode and crash it num_rounds times
+static int crash_mode(const char *mode) {
+    char *paths[MAX_DISKS];
+    off_t size = (off_t)disk_mb * 1024 * 1024;
+    for (int i = 0; i < crash_disks; i++) {
+        paths[i] = malloc(PATH_MAX);
+        snprintf(paths[i], PATH_MAX, "%s/hfs-crash-%d-disk%d", work_dir, (int)getpid(), i);
+        int fd = open(paths[i], O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || ftruncate(fd, size) != 0) {
+            fprintf(stderr, "crashtest: cannot create %s\n", paths[i]);
+            return FAIL;
+        }
+        close(fd);
+    }
+
+    // Sized like bench's volumes
+    long inodes = (long)num_threads * files_per_thread + 64;
+    long blocks = fixture_blocks(mode, crash_disks, size, inodes, crash_block_size);
+
+    cur_mode = mode;
+    int rc = fixture_mkfs(mkfs_path, mode, paths, crash_disks, inodes, blocks, crash_block_size);
+    if (rc != SUCCESS) {
+        fprintf(stderr, "crashtest: %s failed for RAID %s\n", mkfs_path, mode);
+    }
+    for (int round = 0; rc == SUCCESS && round < num_rounds; round++) {
+        pid_t pid = fork();
+        if (pid < 0) die("fork", "", -errno);
+        if (pid == 0) run_child(paths, round + 1);
+
+        struct timespec delay = {0, (long)(1 + rand_r(&delay_rng) % max_ms) * 1000000L};
+        delay.tv_sec = delay.tv_nsec / 1000000000L;
+        delay.tv_nsec %= 1000000000L;
+        nanosleep(&delay, NULL);
+        kill(pid, SIGKILL);
+
+        int status;
+        waitpid(pid, &status, 0);
+        if (!WIFSIGNALED(status) || WTERMSIG(status) != SIGKILL) {
+            fprintf(stderr, "crashtest: RAID %s (seed %u): the workload stopped on its own\n", mode, seed);
+            rc = FAIL;
+            break;
+        }
+        check_volume(paths, round + 1);
+    }
+    if (rc == SUCCESS) {
+        printf("crashtest: RAID %s passed %d crashes\n", mode, num_rounds);
+        fflush(stdout);
+    }
+
+    for (int i = 0; i < crash_disks; i++) {
+        unlink(paths[i]);
+        free(paths[i]);
+    }
+    return rc;
+}
+
+int main(int argc, char *argv[]) {
+    seed = (unsigned int)time(NULL) ^ (unsigned int)getpid();
+    int opt;
+    while ((opt = getopt(argc, argv, "r:d:m:B:n:T:f:w:s:k:t:")) != -1) {
+        switch (opt) {
+            case 'r': modes = optarg; break;
+            case 'd': crash_disks = atoi(optarg); break;
+            case 'm': disk_mb = atol(optarg); break;
+            case 'B': crash_block_size = atoi(optarg); break;
+            case 'n': num_rounds = atoi(optarg); break;
+            case 'T': num_threads = atoi(optarg); break;
+            case 'f': files_per_thread = atoi(optarg); break;
+            case 'w': max_ms = atoi(optarg); break;
+            case 's': seed = strtoul(optarg, NULL, 10); break;
+            case 'k': mkfs_path = optarg; break;
+            case 't': work_dir = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-r 0,1,1v] [-d disks] [-m disk MB] [-B block size] [-n rounds]\n"
+                                "       [-T threads] [-f files per thread] [-w max ms] [-s seed] [-k mkfs] [-t dir]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (crash_disks < 2 || crash_disks > MAX_DISKS || num_rounds < 1 || num_threads < 1 || files_per_thread < 1 || max_ms < 1) {
+        fprintf(stderr, "%s: bad arguments\n", argv[0]);
+        return 1;
+    }
+    delay_rng = seed;
+    printf("crashtest: seed %u\n", seed);
+    fflush(stdout);
+
+    int rc = SUCCESS;
+    char *list = strdup(modes);
+    for (char *mode = strtok(list, ","); mode != NULL && rc == SUCCESS; mode = strtok(NULL, ",")) {
+        rc = crash_mode(mode);
+    }
+    free(list);
+    return rc == SUCCESS ? 0 : 1;
+}
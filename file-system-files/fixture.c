@@ -0,0 +1,74 @@
+// Volume setup shared by bench and crashtest, see fixture.h.
+#include "stdio.h"
+#include "string.h"
+#include "stdint.h"
+#include "unistd.h"
+#include "sys/wait.h"
+#include "hfs.h"
+#include "fixture.h"
+
+#define MAX_DISKS 16
+#define SUCCESS 0
+#define FAIL -1
+
+#define MKFS_ROUND (32) /* mkfs rounds -i and -b up to a multiple of this */
+
+static long gcd(long a, long b) {
+    while (b != 0) {
+        long r = a % b;
+        a = b;
+        b = r;
+    }
+    return a;
+}
+
+/*
+  Blocks fill what is left after the metadata, in whole stripe units. mkfs
+  rounds the count it is given up to a multiple of MKFS_ROUND, so round down
+  to a multiple of both, or the rounded-up volume would not fit.
+*/
+long fixture_blocks(const char *mode, int disks, off_t size, long inodes, int block_size) {
+    inodes = (inodes + MKFS_ROUND - 1) / MKFS_ROUND * MKFS_ROUND;
+    long meta = 2 * JOURNAL_SIZE + inodes * INODE_SIZE + 2 * block_size;
+    // RAID 0 counts blocks per disk, but every disk holds checksums and bitmap bits for all of them
+    long copies = strcmp(mode, "0") == 0 ? disks : 1;
+    long blocks = (size - meta) / (block_size + copies * ((long)sizeof(uint32_t) + 1));
+    long unit = STRIPE_UNIT > block_size ? STRIPE_UNIT / block_size : 1;
+    unit = unit / gcd(unit, MKFS_ROUND) * MKFS_ROUND;
+    return blocks / unit * unit;
+}
+
+int fixture_mkfs(const char *mkfs_path, const char *mode, char *paths[], int disks, long inodes, long blocks, int block_size) {
+    char inode_arg[32], block_arg[32], bs_arg[32];
+    snprintf(inode_arg, sizeof(inode_arg), "%ld", inodes);
+    snprintf(block_arg, sizeof(block_arg), "%ld", blocks);
+    snprintf(bs_arg, sizeof(bs_arg), "%d", block_size);
+
+    char *args[16 + 2 * MAX_DISKS];
+    int n = 0;
+    args[n++] = (char *)mkfs_path;
+    args[n++] = "-r";
+    args[n++] = (char *)mode;
+    for (int i = 0; i < disks; i++) {
+        args[n++] = "-d";
+        args[n++] = paths[i];
+    }
+    args[n++] = "-i";
+    args[n++] = inode_arg;
+    args[n++] = "-b";
+    args[n++] = block_arg;
+    args[n++] = "-B";
+    args[n++] = bs_arg;
+    args[n] = NULL;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // bench's stdout is for results
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+        execv(mkfs_path, args);
+        _exit(127);
+    }
+    int status;
+    if (pid < 0 || waitpid(pid, &status, 0) < 0) return FAIL;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? SUCCESS : FAIL;
+}
@@ -0,0 +1,17 @@
+#ifndef FIXTURE_H
+#define FIXTURE_H
+
+#include "sys/types.h"
+
+/*
+  Fresh volumes for bench and crashtest: both format sparse images with
+  ./mkfs before every RAID mode they run, sized to fill the images.
+*/
+
+// Data blocks that fill images of size bytes once mkfs has laid out inodes and the metadata
+long fixture_blocks(const char *mode, int disks, off_t size, long inodes, int block_size);
+
+// Format the images in paths with mkfs_path for mode; mkfs's output goes to stderr
+int fixture_mkfs(const char *mkfs_path, const char *mode, char *paths[], int disks, long inodes, long blocks, int block_size);
+
+#endif
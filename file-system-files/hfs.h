@@ -1,7 +1,13 @@
 #include <time.h>
+#include <stdint.h>
 #include <sys/stat.h>
 
-#define BLOCK_SIZE (512)
+#define BLOCK_SIZE (512)    /* Default block size, and the only one before it was set by mkfs */
+#define MIN_BLOCK_SIZE (512)
+#define MAX_BLOCK_SIZE (65536)
+#define INODE_SIZE (512)    /* Bytes per inode slot unless mkfs packed the table */
+#define MIN_INODE_SIZE (128) /* sizeof(struct hfs_inode), two cache lines */
+#define STRIPE_UNIT (65536)   /* Default RAID 0 stripe unit in bytes */
 #define MAX_NAME   (28)
 
 #define D_BLOCK    (6)
@@ -13,13 +19,13 @@
   `mkfs` writes the superblock to offset 0 of the disk image. 
   The disk image will have this format:
 
-          d_bitmap_ptr       d_blocks_ptr
-               v                  v
-+----+---------+---------+--------+--------------------------+
-| SB | IBITMAP | DBITMAP | INODES |       DATA BLOCKS        |
-+----+---------+---------+--------+--------------------------+
-0    ^                   ^
-i_bitmap_ptr        i_blocks_ptr
+          d_bitmap_ptr                        d_blocks_ptr
+               v                                    v
++----+---------+---------+--------+-------+---------+-----------------+
+| SB | IBITMAP | DBITMAP | INODES | CSUMS | JOURNAL |   DATA BLOCKS   |
++----+---------+---------+--------+-------+---------+-----------------+
+0    ^                   ^        ^       ^
+i_bitmap_ptr        i_blocks_ptr  csum_ptr journal_ptr
 
 */
 
@@ -35,8 +41,37 @@ struct hfs_sb {
     int mode;
     int num_disks;
     int disk_index;
+    uint32_t block_size;  /* Bytes per data block, 0 means BLOCK_SIZE */
+    uint32_t inode_size;  /* Bytes per inode slot, 0 means INODE_SIZE */
+    uint32_t stripe_unit; /* RAID 0 blocks per stripe unit, 0 means 1 with a data bitmap covering only num_data_blocks */
+    off_t csum_ptr;       /* CRC32C of each data block, 0 when the image has none */
+    off_t journal_ptr;    /* Metadata journal, 0 when the image has none */
+    size_t journal_size;  /* Bytes, including the header block */
 };
 
+/*
+  Regular files map data with extents: runs of contiguous blocks. Up to
+  HFS_ROOT_EXTENTS live in the inode. Beyond that the inode holds index
+  entries pointing at tree blocks. Every tree block starts with a struct
+  hfs_extent_node in its first extent-sized slot, followed by index entries
+  (depth > 0, pblk is the child block) or extents (depth 0), sorted by lblk.
+*/
+#define HFS_EXTENT_MAGIC (0x48455854) /* "HEXT" */
+
+struct hfs_extent {
+    uint32_t lblk;   /* First file block covered */
+    uint32_t len;    /* Number of blocks, unused in index entries */
+    int64_t  pblk;   /* First data block, or child tree block */
+};
+
+struct hfs_extent_node {
+    uint32_t magic;
+    uint16_t count;
+    uint16_t depth;
+};
+
+#define HFS_ROOT_EXTENTS (N_BLOCKS * sizeof(off_t) / sizeof(struct hfs_extent))
+
 // Inode
 struct hfs_inode {
     int     num;      /* Inode number */
@@ -50,15 +85,77 @@ struct hfs_inode {
     time_t mtim;      /* Time of last modification */
     time_t ctim;      /* Time of last status change */
 
-    off_t blocks[N_BLOCKS]; /* Index */
+    union {
+        off_t blocks[N_BLOCKS];                     /* Index */
+        struct hfs_extent extents[HFS_ROOT_EXTENTS]; /* Extent tree root, with HFS_INODE_EXTENTS */
+    };
+    int      flags;      /* HFS_INODE_* */
+    uint16_t ext_count;  /* Entries used in extents[] */
+    uint16_t ext_depth;  /* 0 when extents[] are the file's extents, else levels of tree blocks below */
+} __attribute__((aligned(64)));
+
+// Packed slots hold exactly one inode, so the struct must not grow past them
+_Static_assert(sizeof(struct hfs_inode) == MIN_INODE_SIZE, "struct hfs_inode must fill a packed slot");
+
+/*
+  Metadata journal. The first block of the region at journal_ptr holds the
+  header; the records of the last committed group follow it, each a struct
+  hfs_journal_record and then len bytes of data padded to 8.
+*/
+#define HFS_JOURNAL_MAGIC (0x484a524e) /* "HJRN" */
+#define HFS_JOURNAL_CLEAN (0)
+#define HFS_JOURNAL_DIRTY (1)
+#define JOURNAL_SIZE      (1 << 20)    /* Default journal size in bytes */
+
+struct hfs_journal_header {
+    uint32_t magic;
+    uint32_t state;   /* HFS_JOURNAL_DIRTY while mounted */
+    uint64_t seq;     /* Sequence number of the group in the journal, 0 when empty */
+    uint64_t bytes;   /* Length of the records */
+    uint32_t count;   /* Number of records */
+    uint32_t crc;     /* CRC32C of the records */
+};
+
+struct hfs_journal_record {
+    uint32_t disk;    /* Disk the range was changed on */
+    uint32_t len;
+    uint64_t offset;  /* Byte offset on that disk */
 };
 
+// Inode flags
+#define HFS_INODE_DIR_INDEX (1 << 0) /* Directory is an index tree rooted at blocks[0], not flat dentry blocks */
+#define HFS_INODE_EXTENTS   (1 << 1) /* File data is mapped by extents[] instead of blocks[] */
+#define HFS_INODE_INLINE    (1 << 2) /* File bytes or dentries are stored in the inode slot after the struct */
+#define HFS_INODE_SHARED    (1 << 3) /* File may share data blocks with others; on the root directory, some file on the volume may */
+
 // Directory entry
 struct hfs_dentry {
     char name[MAX_NAME];
     int num;
 };
 
+/*
+  Indexed directories are a B+tree keyed by a 32-bit hash of the entry name.
+  Every tree block starts with a struct hfs_dir_node in its first dentry-sized
+  slot. Leaves (depth 0) hold struct hfs_dentry in the remaining slots, index
+  nodes hold struct hfs_dir_link sorted by hash. A link covers every hash from
+  its own up to the next link's.
+*/
+#define HFS_DIR_MAGIC (0x48444952) /* "HDIR" */
+
+struct hfs_dir_node {
+    uint32_t magic;
+    uint16_t count;   /* Entries in use */
+    uint16_t depth;   /* 0 for leaves */
+};
+
+struct hfs_dir_link {
+    uint32_t hash;    /* Lowest hash stored under block */
+    uint32_t unused;
+    off_t    block;
+};
+
+// Only found in images with 512-byte blocks
 struct hfs_ind_block {
     off_t blocks[BLOCK_SIZE / sizeof(off_t)];
 };
@@ -0,0 +1,508 @@
+#define FUSE_USE_VERSION 30
+
+#include "stdio.h"
+#include "unistd.h"
+#include "stdlib.h"
+#include "string.h"
+#include "stdint.h"
+#include "stdatomic.h"
+#include "errno.h"
+#include "fcntl.h"
+#include "time.h"
+#include "fuse_lowlevel.h"
+#include "libhfs.h"
+
+/*
+  FUSE low-level front end. The kernel names files by node id rather than
+  by path, so every callback goes straight to the file's libhfs handle and
+  nothing is resolved twice. Usage and options are the same as hfs, plus
+  --direct-io to bypass the kernel page cache and --timeout=SECONDS.
+
+  A node id is the handle plus one, which makes the root FUSE_ROOT_ID.
+  Handles carry the inode's generation, so a node id the kernel still holds
+  for a removed file fails with ESTALE rather than reaching whatever reuses
+  the inode. That also means nothing has to be pinned while the kernel
+  remembers a node, and forget has nothing to do.
+*/
+
+#define SUCCESS 0
+#define FAIL -1
+
+/*
+  Kernel caching. Every change to names, attributes and data reaches hfs
+  as a request from the kernel, which updates its own caches to match, so
+  the kernel may keep names (including ones that don't exist) and
+  attributes for cache_timeout seconds and file pages across opens.
+  Writes come in pieces of up to MAX_WRITE bytes rather than a page each.
+  The one thing that changes without a request is the stats file (below).
+*/
+#define CACHE_TIMEOUT (1.0)
+#define MAX_WRITE (128 * 1024)
+
+static struct hfs_volume *volume;
+static struct fuse_chan *chan;
+static bool direct_io;
+static double cache_timeout = CACHE_TIMEOUT;
+
+static hfs_ino_t to_handle(fuse_ino_t ino) {
+    return (hfs_ino_t)ino - 1;
+}
+
+static fuse_ino_t to_node(hfs_ino_t handle) {
+    return (fuse_ino_t)handle + 1;
+}
+
+// Reply to a lookup or create of handle (or its error)
+static void reply_entry(fuse_req_t req, hfs_ino_t handle, struct stat *st) {
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    if (handle < 0) {
+        fuse_reply_err(req, -handle);
+        return;
+    }
+    e.ino = to_node(handle);
+    e.generation = handle >> 32;
+    e.attr = *st;
+    e.attr.st_ino = e.ino;
+    e.entry_timeout = cache_timeout;
+    e.attr_timeout = cache_timeout;
+    fuse_reply_entry(req, &e);
+}
+
+// Only a lookup may answer with node id 0, which caches the name as missing;
+// the kernel turns one from a create into EIO
+static void reply_lookup(fuse_req_t req, hfs_ino_t handle, struct stat *st) {
+    if (handle == -ENOENT) {
+        struct fuse_entry_param e;
+        memset(&e, 0, sizeof(e));
+        e.entry_timeout = cache_timeout;
+        fuse_reply_entry(req, &e);
+        return;
+    }
+    reply_entry(req, handle, st);
+}
+
+// Open files keep a struct hfs_file in fi->fh
+static struct hfs_file *open_file(struct fuse_file_info *fi) {
+    return (struct hfs_file *)(uintptr_t)fi->fh;
+}
+
+/*
+  Latency statistics, as in hfs: a virtual read-only file at the root that
+  each open sees a snapshot of. Reads bypass the page cache, and the size
+  the kernel caches is only a hint, but stat and ls should show the size of
+  the latest snapshot: each open records its length for getattr, which
+  never renders one itself, and tells the kernel to drop the cached
+  attributes. STATS_HANDLE can't name an inode (there are fewer than 2^32 - 1).
+*/
+#define STATS_NAME ".hfs_stats"
+#define STATS_HANDLE ((hfs_ino_t)0xffffffff)
+
+static _Atomic size_t stats_size; // 0 until something renders the file
+
+static bool is_stats_entry(fuse_ino_t parent, const char *name) {
+    return to_handle(parent) == HFS_ROOT_INO && strcmp(name, STATS_NAME) == 0;
+}
+
+static size_t stats_length(void) {
+    size_t len = atomic_load(&stats_size);
+    if (len == 0) {
+        char *text;
+        len = hfs_stats_render(&text);
+        free(text);
+        atomic_store(&stats_size, len);
+    }
+    return len;
+}
+
+static void stats_attr(struct stat *st) {
+    memset(st, 0, sizeof(struct stat));
+    st->st_ino = to_node(STATS_HANDLE);
+    st->st_mode = S_IFREG | 0444;
+    st->st_nlink = 1;
+    st->st_size = stats_length();
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+    st->st_atime = st->st_mtime = st->st_ctime = time(NULL);
+}
+
+static void stats_open(fuse_req_t req, struct fuse_file_info *fi) {
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+        fuse_reply_err(req, EACCES);
+        return;
+    }
+    char *text;
+    size_t len = hfs_stats_render(&text);
+    if (text == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    atomic_store(&stats_size, len);
+    // Attributes only (negative offset), so no pages are touched while the open is in flight
+    fuse_lowlevel_notify_inval_inode(chan, to_node(STATS_HANDLE), -1, 0);
+    fi->fh = (uintptr_t)text;
+    fi->direct_io = 1;
+    fuse_reply_open(req, fi);
+}
+
+static void stats_read(fuse_req_t req, size_t size, off_t off, struct fuse_file_info *fi) {
+    const char *text = (const char *)(uintptr_t)fi->fh;
+    size_t len = strlen(text);
+    if ((size_t)off >= len) {
+        fuse_reply_buf(req, NULL, 0);
+        return;
+    }
+    fuse_reply_buf(req, text + off, len - off < size ? len - off : size);
+}
+
+static void hfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    struct stat st;
+    if (is_stats_entry(parent, name)) {
+        stats_attr(&st);
+        reply_entry(req, STATS_HANDLE, &st);
+        return;
+    }
+    reply_lookup(req, hfs_lookup(volume, to_handle(parent), name, &st), &st);
+}
+
+// Node ids hold no reference (see above)
+static void hfs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+    fuse_reply_none(req);
+}
+
+static void hfs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    struct stat st;
+    if (to_handle(ino) == STATS_HANDLE) {
+        stats_attr(&st);
+        fuse_reply_attr(req, &st, cache_timeout);
+        return;
+    }
+    int rc = hfs_fstat(volume, to_handle(ino), &st);
+    if (rc < 0) {
+        fuse_reply_err(req, -rc);
+        return;
+    }
+    st.st_ino = ino;
+    fuse_reply_attr(req, &st, cache_timeout);
+}
+
+// Only the size can change. The times a truncate sends along are set by the truncate itself.
+#define SETATTR_TRUNCATE (FUSE_SET_ATTR_SIZE | FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME | \
+                          FUSE_SET_ATTR_ATIME_NOW | FUSE_SET_ATTR_MTIME_NOW)
+
+static void hfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi) {
+    if (!(to_set & FUSE_SET_ATTR_SIZE) || (to_set & ~SETATTR_TRUNCATE)) {
+        fuse_reply_err(req, ENOSYS);
+        return;
+    }
+    if (to_handle(ino) == STATS_HANDLE) {
+        fuse_reply_err(req, EACCES);
+        return;
+    }
+    int rc = fi ? hfs_file_truncate(volume, open_file(fi), attr->st_size)
+                : hfs_truncate_ino(volume, to_handle(ino), attr->st_size);
+    if (rc < 0) {
+        fuse_reply_err(req, -rc);
+        return;
+    }
+    hfs_ll_getattr(req, ino, fi);
+}
+
+static void hfs_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev) {
+    struct stat st;
+    if (is_stats_entry(parent, name)) {
+        fuse_reply_err(req, EEXIST);
+        return;
+    }
+    reply_entry(req, hfs_mknodat(volume, to_handle(parent), name, mode, rdev, &st), &st);
+}
+
+static void hfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+    struct stat st;
+    if (is_stats_entry(parent, name)) {
+        fuse_reply_err(req, EEXIST);
+        return;
+    }
+    reply_entry(req, hfs_mkdirat(volume, to_handle(parent), name, mode, &st), &st);
+}
+
+static void hfs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    if (is_stats_entry(parent, name)) {
+        fuse_reply_err(req, EACCES);
+        return;
+    }
+    fuse_reply_err(req, -hfs_unlinkat(volume, to_handle(parent), name));
+}
+
+static void hfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    if (is_stats_entry(parent, name)) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+    fuse_reply_err(req, -hfs_rmdirat(volume, to_handle(parent), name));
+}
+
+static void hfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    if (to_handle(ino) == STATS_HANDLE) {
+        stats_open(req, fi);
+        return;
+    }
+    struct hfs_file *f;
+    int rc = hfs_file_open(volume, to_handle(ino), &f);
+    if (rc < 0) {
+        fuse_reply_err(req, -rc);
+        return;
+    }
+    fi->fh = (uintptr_t)f;
+    fi->direct_io = direct_io;
+    fi->keep_cache = !direct_io;
+    fuse_reply_open(req, fi);
+}
+
+static void hfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+    if (to_handle(ino) == STATS_HANDLE) {
+        stats_read(req, size, off, fi);
+        return;
+    }
+    char *buf = malloc(size);
+    if (buf == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    int rc = hfs_file_read(volume, open_file(fi), buf, size, off);
+    if (rc < 0) {
+        fuse_reply_err(req, -rc);
+    } else {
+        fuse_reply_buf(req, buf, rc);
+    }
+    free(buf);
+}
+
+static void hfs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi) {
+    int rc = hfs_file_write(volume, open_file(fi), buf, size, off);
+    if (rc < 0) {
+        fuse_reply_err(req, -rc);
+    } else {
+        fuse_reply_write(req, rc);
+    }
+}
+
+static void hfs_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
+    if (to_handle(ino) == STATS_HANDLE) {
+        fuse_reply_err(req, EACCES);
+        return;
+    }
+    fuse_reply_err(req, -hfs_file_fallocate(volume, open_file(fi), mode, offset, length));
+}
+
+static void hfs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    fuse_reply_err(req, SUCCESS);
+}
+
+// Last close
+static void hfs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    if (to_handle(ino) == STATS_HANDLE) {
+        free((char *)(uintptr_t)fi->fh);
+        fuse_reply_err(req, SUCCESS);
+        return;
+    }
+    hfs_file_close(volume, open_file(fi));
+    fuse_reply_err(req, SUCCESS);
+}
+
+static void hfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+    if (to_handle(ino) == STATS_HANDLE) {
+        fuse_reply_err(req, SUCCESS);
+        return;
+    }
+    fuse_reply_err(req, -hfs_file_fsync(volume, open_file(fi)));
+}
+
+static void hfs_ll_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+    fuse_reply_err(req, -hfs_fsync_ino(volume, to_handle(ino)));
+}
+
+/*
+  opendir lists the whole directory into a buffer of fuse_add_direntry()
+  records kept in fi->fh, and readdir replies with slices of it, so a
+  listing stays consistent however many readdir calls it takes.
+*/
+struct dir_listing {
+    fuse_req_t req;
+    char *buf;
+    size_t size;
+    bool failed;   /* Ran out of memory part way */
+};
+
+static int fill_listing(void *ctx, const char *name, const struct stat *st, off_t offset) {
+    struct dir_listing *dl = ctx;
+    struct stat entry;
+    memset(&entry, 0, sizeof(entry));
+    // ".." doesn't come with a handle; any nonzero number keeps it from looking deleted
+    entry.st_ino = st ? to_node(st->st_ino) : FUSE_ROOT_ID;
+
+    size_t len = fuse_add_direntry(dl->req, NULL, 0, name, NULL, 0);
+    char *grown = realloc(dl->buf, dl->size + len);
+    if (grown == NULL) {
+        dl->failed = true;
+        return 1;
+    }
+    dl->buf = grown;
+    // Each record's offset is where the next one starts
+    fuse_add_direntry(dl->req, dl->buf + dl->size, len, name, &entry, dl->size + len);
+    dl->size += len;
+    return 0;
+}
+
+static void hfs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    struct dir_listing *dl = calloc(1, sizeof(struct dir_listing));
+    if (dl == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    dl->req = req;
+    int rc = hfs_readdir_ino(volume, to_handle(ino), fill_listing, dl);
+    if (rc == 0 && dl->failed) rc = -ENOMEM;
+    if (rc < 0) {
+        free(dl->buf);
+        free(dl);
+        fuse_reply_err(req, -rc);
+        return;
+    }
+    fi->fh = (uintptr_t)dl;
+    fuse_reply_open(req, fi);
+}
+
+static void hfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+    struct dir_listing *dl = (struct dir_listing *)(uintptr_t)fi->fh;
+    if ((size_t)off >= dl->size) {
+        fuse_reply_buf(req, NULL, 0);
+        return;
+    }
+    size_t n = dl->size - off < size ? dl->size - off : size;
+    fuse_reply_buf(req, dl->buf + off, n);
+}
+
+static void hfs_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    struct dir_listing *dl = (struct dir_listing *)(uintptr_t)fi->fh;
+    free(dl->buf);
+    free(dl);
+    fuse_reply_err(req, SUCCESS);
+}
+
+// Runs in the mounted (possibly daemonized) process, so background threads start here
+static void hfs_ll_init(void *userdata, struct fuse_conn_info *conn) {
+    if (conn->capable & FUSE_CAP_BIG_WRITES) {
+        conn->want |= FUSE_CAP_BIG_WRITES;
+        conn->max_write = MAX_WRITE;
+    }
+#ifdef FUSE_CAP_WRITEBACK_CACHE
+    // Let the kernel gather small writes in its page cache
+    if (!direct_io && (conn->capable & FUSE_CAP_WRITEBACK_CACHE)) conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+#endif
+    hfs_volume_start(volume);
+}
+
+static void hfs_ll_destroy(void *userdata) {
+    hfs_volume_stop(volume);
+}
+
+static struct fuse_lowlevel_ops ll_ops = {
+    .init       = hfs_ll_init,
+    .destroy    = hfs_ll_destroy,
+    .lookup     = hfs_ll_lookup,
+    .forget     = hfs_ll_forget,
+    .getattr    = hfs_ll_getattr,
+    .setattr    = hfs_ll_setattr,
+    .mknod      = hfs_ll_mknod,
+    .mkdir      = hfs_ll_mkdir,
+    .unlink     = hfs_ll_unlink,
+    .rmdir      = hfs_ll_rmdir,
+    .open       = hfs_ll_open,
+    .read       = hfs_ll_read,
+    .write      = hfs_ll_write,
+    .fallocate  = hfs_ll_fallocate,
+    .flush      = hfs_ll_flush,
+    .release    = hfs_ll_release,
+    .fsync      = hfs_ll_fsync,
+    .opendir    = hfs_ll_opendir,
+    .readdir    = hfs_ll_readdir,
+    .releasedir = hfs_ll_releasedir,
+    .fsyncdir   = hfs_ll_fsyncdir,
+};
+
+int main(int argc, char *argv[]) {
+    int num_disks = 0;
+    while (num_disks + 1 < argc && access(argv[num_disks + 1], F_OK) == 0)
+    {
+        num_disks++;
+    }
+
+    if (num_disks < 1) {
+        fprintf(stderr, "Need at least 1 disks\n");
+        return FAIL;
+    }
+
+    int f_argc = argc - num_disks;
+    char **f_argv = argv + num_disks;
+    // Threads started before FUSE daemonizes would not survive the fork
+    struct hfs_options opts = { .defer_start = true };
+
+    // Pull out our own options before FUSE sees them
+    if (hfs_options_parse(&f_argc, f_argv, &opts) != SUCCESS) {
+        return FAIL;
+    }
+    int kept = 1;
+    for (int i = 1; i < f_argc; i++) {
+        if (strcmp(f_argv[i], "--direct-io") == 0) {
+            direct_io = true;
+        } else if (strncmp(f_argv[i], "--timeout=", 10) == 0) {
+            cache_timeout = atof(f_argv[i] + 10);
+            if (cache_timeout < 0) {
+                fprintf(stderr, "Bad timeout %s\n", f_argv[i] + 10);
+                return FAIL;
+            }
+        } else {
+            f_argv[kept++] = f_argv[i];
+        }
+    }
+    f_argc = kept;
+
+    struct fuse_args args = FUSE_ARGS_INIT(f_argc, f_argv);
+    char *mountpoint;
+    int multithreaded, foreground;
+    if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) == -1 || mountpoint == NULL) {
+        fprintf(stderr, "usage: %s disk... [options] mountpoint\n", argv[0]);
+        return FAIL;
+    }
+
+    if (hfs_volume_open(argv + 1, num_disks, &opts, &volume) != SUCCESS) {
+        return FAIL;
+    }
+
+    int rc = FAIL;
+    struct fuse_chan *ch = chan = fuse_mount(mountpoint, &args);
+    if (ch != NULL) {
+        struct fuse_session *se = fuse_lowlevel_new(&args, &ll_ops, sizeof(ll_ops), NULL);
+        if (se != NULL) {
+            if (fuse_set_signal_handlers(se) == 0) {
+                fuse_session_add_chan(se, ch);
+                fuse_daemonize(foreground);
+                rc = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+                fuse_remove_signal_handlers(se);
+                fuse_session_remove_chan(ch);
+            }
+            fuse_session_destroy(se);
+        }
+        fuse_unmount(mountpoint, ch);
+    }
+    free(mountpoint);
+    fuse_opt_free_args(&args);
+    printf("Returned from fuse\n");
+
+    // Nothing to do if destroy already ran; covers the session failing before init
+    hfs_volume_stop(volume);
+    hfs_volume_report(volume, stdout);
+    hfs_volume_close(volume);
+    return rc == 0 ? SUCCESS : FAIL;
+}
@@ -0,0 +1,5364 @@
+#define _GNU_SOURCE // sync_file_range
+
+#include "stdio.h"
+#include "unistd.h"
+#include "stdlib.h"
+#include "string.h"
+#include "fcntl.h"
+#include "sys/stat.h"
+#include "sys/types.h"
+#include "sys/mman.h"
+#include "time.h"
+#include "getopt.h"
+#include "errno.h"
+#if defined(__linux__)
+#include "sys/syscall.h"
+#if defined(__NR_io_uring_setup)
+#include "linux/io_uring.h"
+#define HAVE_IO_URING
+#endif
+#endif
+// linux/fs.h, pulled in by io_uring.h, has a BLOCK_SIZE of its own
+#undef BLOCK_SIZE
+#include "hfs.h"
+#include "libhfs.h"
+#include "trace.h"
+#include "stdbool.h"
+#include "pthread.h"
+#include "stdatomic.h"
+#include "limits.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include "immintrin.h"
+#endif
+
+#define MAX_PATH_NAME 264
+#define MAX_DISKS 16
+#define SUCCESS 0
+#define FAIL -1
+
+/*
+  Volumes
+
+  Everything about an open volume lives in its struct hfs_volume, and every
+  function that works on a volume takes it first, so a process can have
+  several open at once. Tracing, the latency statistics and each thread's
+  io_uring ring are shared by all of them.
+*/
+
+// Which mirror serves a read in modes 1 and 1v (--read-policy=rr|lor|locality)
+enum read_policy {
+    READ_ROUND_ROBIN,       // rr: each read goes to the next mirror
+    READ_LEAST_OUTSTANDING, // lor: the mirror with the fewest reads in flight
+    READ_LOCALITY,          // locality: by stripe unit of the block, so nearby blocks come from the same mirror
+};
+
+// Per-disk read counters, printed at unmount
+struct disk_stats {
+    atomic_ulong reads;
+    atomic_ulong read_bytes;
+    atomic_int outstanding;
+};
+
+// Inode or data bitmap, see the bitmap allocator
+struct bitmap_alloc {
+    off_t offset;              /* Bitmap offset within each disk */
+    size_t bits;
+    size_t hint;               /* Next-fit starting bit */
+    size_t free;
+    unsigned int *group_free;  /* Free bits per group */
+};
+
+// A disk's ranges written outside the journal, see writeback
+struct dirty_range {
+    off_t offset;
+    size_t len;
+    int owner;           // inode, or DIRTY_SHARED
+    long dirtied_ms;     // when the range first became dirty
+};
+
+struct dirty_list {
+    pthread_mutex_t lock;
+    pthread_mutex_t flush_lock; // held from taking ranges off the list until they are flushed
+    struct dirty_range *ranges;
+    size_t count;
+    size_t cap;
+};
+
+// Dentry cache slot, see the dentry cache
+#ifndef DCACHE_SLOTS
+#define DCACHE_SLOTS 4096
+#endif
+#define DCACHE_STRIPES 64
+
+struct dcache_entry {
+    int parent;
+    int child;
+    bool valid;
+    char name[MAX_NAME];
+};
+
+struct hfs_volume {
+    char **disks;
+    struct hfs_sb *superblock;
+    int num_disks;
+    int *fileDescs;
+    size_t *diskSizes; // each image is mapped whole, for metadata and the mmap backend
+    size_t block_size;
+    size_t inode_size;
+    size_t stripe_unit;       // blocks per stripe unit, RAID 0 only
+    size_t total_data_blocks; // blocks addressable across the whole volume
+    bool started;             // journal committer and writeback flusher running
+
+    // Locking (lock order: journal_lock -> tree_lock -> inode_locks[i] -> alloc_lock)
+    // Held for read by every metadata change, for write by a commit. A waiting commit goes ahead of new
+    // changes, or a busy volume would starve it (and the blocks it frees); no thread takes it twice.
+    pthread_rwlock_t journal_lock;
+    pthread_rwlock_t tree_lock;  // namespace: held for write by mknod/mkdir/unlink/rmdir
+    pthread_rwlock_t *inode_locks; // one per inode, guards size/blocks/data of that inode
+    uint32_t *inode_gens;        // per inode, bumped when it is freed (see make_handle)
+    uint32_t *inode_map_gens;    // per inode, bumped when blocks are taken from it (see struct hfs_file)
+    pthread_mutex_t alloc_lock;  // inode and data bitmaps on every disk
+
+    // Private (copy-on-write) mappings of each disk, used for RAID 0 metadata blocks while the journal runs
+    char *stage_maps[MAX_DISKS];
+
+    // Reads and checksums
+    enum read_policy read_policy;
+    atomic_uint read_next;
+    struct disk_stats disk_stats[MAX_DISKS];
+    uint32_t *csum_table;         // NULL for images without checksums
+    atomic_ulong verify_repairs;  // bad copies rewritten from a good one
+    atomic_ulong verify_failures; // reads that found no good copy
+    const struct io_backend *io_backend;
+    unsigned int queue_depth;     // io_uring entries for threads that set up their ring on this volume
+
+    // Allocation, guarded by alloc_lock
+    struct bitmap_alloc inode_alloc;
+    struct bitmap_alloc data_alloc;
+    uint32_t **block_refs;
+    size_t shared_blocks;         /* Blocks with more than one owner */
+    atomic_bool volume_shared;    /* The root directory has HFS_INODE_SHARED */
+
+    // Metadata journal
+    bool journal_enabled;
+    struct journal_range *journal_ranges; // logged since the last commit, guarded by journal_mutex
+    size_t journal_count;
+    size_t journal_cap;
+    struct journal_free *journal_frees;  // blocks released since the last commit, same (step 0)
+    size_t journal_free_count;
+    size_t journal_free_cap;
+    size_t journal_free_blocks;           // blocks in journal_frees
+    bool journal_free_short;              // they outnumber the free blocks, so commit early
+    size_t journal_pending;               // bytes logged, for the early commit threshold
+    uint64_t journal_seq;
+    pthread_mutex_t journal_mutex;
+    pthread_cond_t journal_cond;
+    pthread_t journal_thread;
+    bool journal_running;
+    bool journal_stop;
+    unsigned long journal_commits;
+    atomic_int journal_error;     // -EIO once changes went in place without a commit, reported by the next sync
+
+    // Writeback
+    struct dirty_list dirty_lists[MAX_DISKS];
+    pthread_mutex_t writeback_mutex;
+    pthread_cond_t writeback_cond;
+    pthread_t writeback_thread;
+    bool writeback_running;
+    bool writeback_stop;
+    atomic_ulong fsync_flushes;   // ranges flushed for fsync
+    atomic_ulong expired_flushes; // ranges flushed by the flusher or at unmount
+
+    // Dentry cache
+    struct dcache_entry dcache[DCACHE_SLOTS];
+    pthread_mutex_t dcache_locks[DCACHE_STRIPES];
+    unsigned long dcache_hits;
+    unsigned long dcache_misses;
+};
+
+static void lock_inode(struct hfs_volume *vol, int inode_idx, bool write) {
+    if (write) {
+        pthread_rwlock_wrlock(&vol->inode_locks[inode_idx]);
+    } else {
+        pthread_rwlock_rdlock(&vol->inode_locks[inode_idx]);
+    }
+}
+
+static void unlock_inode(struct hfs_volume *vol, int inode_idx) {
+    pthread_rwlock_unlock(&vol->inode_locks[inode_idx]);
+}
+
+/*
+  Tracing
+
+  Built with -DHFS_TRACE (make does this unless RELEASE=1), TRACE() appends a
+  binary record to the calling thread's ring when its level is enabled
+  (hfs_options.trace, --trace= for hfs). Writing a record takes no lock: each
+  ring has one writer. A ring is claimed by a thread on its first record and
+  handed to another thread when its owner exits, so records survive until
+  trace_dump() writes every ring to the trace file when the last open volume
+  is closed; tracedump turns the file into text. The level, the file and the
+  rings belong to the process, not to a volume: the options of the latest
+  hfs_volume_open() that passes them apply to all.
+  Without HFS_TRACE, trace_level is the constant 0 and TRACE() compiles away.
+*/
+#define TRACE_RING_RECORDS (4096) // per thread
+
+// TRACE(level, event, string or NULL, up to three integers)
+#define TRACE(...) TRACE_(__VA_ARGS__, 0, 0, 0, 0)
+#define TRACE_(level, event, str, a, b, c, ...) \
+    do { \
+        if (HFS_TRACE_##level <= trace_level) { \
+            trace_emit(HFS_TRACE_##level, TRACE_EV_##event, (str), (a), (b), (c)); \
+        } \
+    } while (0)
+
+#ifdef HFS_TRACE
+struct trace_ring {
+    struct trace_ring *next;   // every ring made, newest first
+    atomic_bool in_use;
+    uint32_t tid;
+    _Atomic uint64_t head;     // records written so far
+    struct hfs_trace_record records[TRACE_RING_RECORDS];
+};
+
+static int trace_level;
+static char trace_path[PATH_MAX] = "hfs.trace";
+static struct trace_ring *_Atomic trace_rings;
+static pthread_key_t trace_key;
+static bool trace_key_ok;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static __thread struct trace_ring *trace_ring;
+static atomic_int trace_volumes; // open volumes; the last to close dumps
+
+static void trace_release(void *arg) {
+    struct trace_ring *ring = arg;
+    atomic_store(&ring->in_use, false);
+}
+
+static struct trace_ring *trace_claim(void) {
+    struct trace_ring *ring;
+    for (ring = atomic_load(&trace_rings); ring != NULL; ring = ring->next) {
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&ring->in_use, &expected, true)) break;
+    }
+    if (ring == NULL) {
+        ring = calloc(1, sizeof(struct trace_ring));
+        if (ring == NULL) return NULL;
+        atomic_init(&ring->in_use, true);
+        ring->next = atomic_load(&trace_rings);
+        while (!atomic_compare_exchange_weak(&trace_rings, &ring->next, ring));
+    }
+    ring->tid = syscall(SYS_gettid);
+    pthread_setspecific(trace_key, ring);
+    return ring;
+}
+
+static void trace_emit(int level, int event, const char *str, int64_t a, int64_t b, int64_t c) {
+    if (trace_ring == NULL) {
+        trace_ring = trace_claim();
+        if (trace_ring == NULL) return;
+    }
+    uint64_t head = atomic_load_explicit(&trace_ring->head, memory_order_relaxed);
+    struct hfs_trace_record *rec = &trace_ring->records[head % TRACE_RING_RECORDS];
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    rec->ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+    rec->tid = trace_ring->tid;
+    rec->event = event;
+    rec->level = level;
+    rec->args[0] = a;
+    rec->args[1] = b;
+    rec->args[2] = c;
+    rec->str[0] = '\0';
+    if (str != NULL) {
+        // Keep the end of a long path, it says more than the start
+        size_t len = strlen(str);
+        const char *from = len < HFS_TRACE_STR ? str : str + len - (HFS_TRACE_STR - 1);
+        memcpy(rec->str, from, strlen(from) + 1);
+    }
+    atomic_store_explicit(&trace_ring->head, head + 1, memory_order_release);
+}
+
+static int parse_trace_level(const char *name) {
+    const char *names[] = {"off", "error", "info", "debug"};
+    for (int level = 0; level <= HFS_TRACE_DEBUG; level++) {
+        if (strcmp(name, names[level]) == 0) {
+            trace_level = level;
+            return SUCCESS;
+        }
+    }
+    return FAIL;
+}
+
+static int set_trace_path(const char *path) {
+    // FUSE changes to / when it daemonizes, so pin a relative path to where we started
+    if (path[0] == '/') {
+        snprintf(trace_path, sizeof(trace_path), "%s", path);
+        return SUCCESS;
+    }
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) return FAIL;
+    if (snprintf(trace_path, sizeof(trace_path), "%s/%s", cwd, path) >= (int)sizeof(trace_path)) return FAIL;
+    return SUCCESS;
+}
+
+// Rings outlive a volume, so the key that hands them back is made once per process
+static void trace_key_create(void) {
+    trace_key_ok = pthread_key_create(&trace_key, trace_release) == 0;
+}
+
+static int trace_init(void) {
+    if (trace_level == 0) return SUCCESS;
+    if (trace_path[0] != '/' && set_trace_path(trace_path) != SUCCESS) return FAIL;
+    pthread_once(&trace_once, trace_key_create);
+    return trace_key_ok ? SUCCESS : FAIL;
+}
+
+// Write every ring to trace_path, each oldest record first. Called when the last volume closes.
+static void trace_dump(void) {
+    if (trace_level == 0) return;
+    FILE *out = fopen(trace_path, "wb");
+    if (out == NULL) {
+        fprintf(stderr, "trace: cannot write %s\n", trace_path);
+        return;
+    }
+
+    struct hfs_trace_header header = {HFS_TRACE_MAGIC, HFS_TRACE_VERSION, sizeof(struct hfs_trace_record), TRACE_EV_COUNT, 0};
+    for (struct trace_ring *ring = atomic_load(&trace_rings); ring != NULL; ring = ring->next) {
+        uint64_t head = atomic_load(&ring->head);
+        header.count += head < TRACE_RING_RECORDS ? head : TRACE_RING_RECORDS;
+    }
+    fwrite(&header, sizeof(header), 1, out);
+    for (struct trace_ring *ring = atomic_load(&trace_rings); ring != NULL; ring = ring->next) {
+        uint64_t head = atomic_load(&ring->head);
+        uint64_t first = head < TRACE_RING_RECORDS ? 0 : head - TRACE_RING_RECORDS;
+        for (uint64_t i = first; i < head; i++) {
+            fwrite(&ring->records[i % TRACE_RING_RECORDS], sizeof(struct hfs_trace_record), 1, out);
+        }
+    }
+    fclose(out);
+    fprintf(stderr, "trace: %lu records written to %s\n", (unsigned long)header.count, trace_path);
+}
+#else
+#define trace_level 0
+
+static inline void trace_emit(int level, int event, const char *str, int64_t a, int64_t b, int64_t c) {
+}
+#endif
+
+/*
+  Latency statistics
+
+  Every operation and a few internal stages record how long they took in
+  a histogram of log-spaced buckets: STATS_SUB_BUCKETS per power of two of
+  nanoseconds, so any value is within 25% of its bucket's bounds. Counters
+  live in per-thread shards with a single writer each, claimed like trace
+  rings, and are only summed by hfs_stats_render(), which hfs serves as the
+  virtual file /.hfs_stats. Like the trace rings, the shards belong to the
+  process, so with several volumes open the totals cover all of them.
+*/
+#define STATS_SUB_BITS (2)
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+#define STATS_BUCKETS (64 * STATS_SUB_BUCKETS)
+
+#define HFS_STATS(X) \
+    X(GETATTR, "getattr") \
+    X(LOOKUP, "lookup") \
+    X(MKNOD, "mknod") \
+    X(MKDIR, "mkdir") \
+    X(UNLINK, "unlink") \
+    X(RMDIR, "rmdir") \
+    X(READ, "read") \
+    X(WRITE, "write") \
+    X(READDIR, "readdir") \
+    X(FSYNC, "fsync") \
+    X(TRUNCATE, "truncate") \
+    X(FALLOCATE, "fallocate") \
+    X(COPY_RANGE, "copy_file_range") \
+    X(FIND_INODE, "find_inode") \
+    X(ALLOC_DATA, "allocate_data") \
+    X(DISK_IO, "disk_io") \
+    X(JOURNAL_COMMIT, "journal_commit")
+
+#define STATS_ENUM(name, label) STAT_##name,
+enum stat_point { HFS_STATS(STATS_ENUM) STAT_COUNT };
+#undef STATS_ENUM
+
+#define STATS_LABEL(name, label) label,
+static const char *stat_labels[] = { HFS_STATS(STATS_LABEL) };
+#undef STATS_LABEL
+
+struct stats_shard {
+    struct stats_shard *next;   // every shard made, newest first
+    atomic_bool in_use;
+    atomic_ulong count[STAT_COUNT];
+    atomic_ulong total_ns[STAT_COUNT];
+    atomic_ulong max_ns[STAT_COUNT];
+    atomic_ulong buckets[STAT_COUNT][STATS_BUCKETS];
+};
+
+static struct stats_shard *_Atomic stats_shards;
+static pthread_key_t stats_key;
+static __thread struct stats_shard *stats_shard;
+
+static void stats_release(void *arg) {
+    struct stats_shard *shard = arg;
+    atomic_store(&shard->in_use, false);
+}
+
+static struct stats_shard *stats_claim(void) {
+    struct stats_shard *shard;
+    for (shard = atomic_load(&stats_shards); shard != NULL; shard = shard->next) {
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&shard->in_use, &expected, true)) break;
+    }
+    if (shard == NULL) {
+        shard = calloc(1, sizeof(struct stats_shard));
+        if (shard == NULL) return NULL;
+        atomic_init(&shard->in_use, true);
+        shard->next = atomic_load(&stats_shards);
+        while (!atomic_compare_exchange_weak(&stats_shards, &shard->next, shard));
+    }
+    pthread_setspecific(stats_key, shard);
+    return shard;
+}
+
+static uint64_t stats_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static int stats_bucket(uint64_t ns) {
+    if (ns < STATS_SUB_BUCKETS) return ns;
+    int msb = 63 - __builtin_clzll(ns);
+    return (msb - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS + ((ns >> (msb - STATS_SUB_BITS)) & (STATS_SUB_BUCKETS - 1));
+}
+
+// Smallest value that lands in bucket
+static uint64_t stats_bucket_floor(int bucket) {
+    if (bucket < STATS_SUB_BUCKETS) return bucket;
+    int msb = bucket / STATS_SUB_BUCKETS + STATS_SUB_BITS - 1;
+    return (uint64_t)(STATS_SUB_BUCKETS + bucket % STATS_SUB_BUCKETS) << (msb - STATS_SUB_BITS);
+}
+
+// Only this thread writes its shard, so plain loads and stores are enough
+static void stats_add(atomic_ulong *counter, unsigned long value) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+// Record a stage that started at start (from stats_now())
+static void stats_end(enum stat_point point, uint64_t start) {
+    uint64_t ns = stats_now() - start;
+    if (stats_shard == NULL) {
+        stats_shard = stats_claim();
+        if (stats_shard == NULL) return;
+    }
+    stats_add(&stats_shard->count[point], 1);
+    stats_add(&stats_shard->total_ns[point], ns);
+    stats_add(&stats_shard->buckets[point][stats_bucket(ns)], 1);
+    if (ns > atomic_load_explicit(&stats_shard->max_ns[point], memory_order_relaxed)) {
+        atomic_store_explicit(&stats_shard->max_ns[point], ns, memory_order_relaxed);
+    }
+}
+
+static void stats_init(void) {
+    pthread_key_create(&stats_key, stats_release);
+}
+
+// Value below which fraction of the samples in buckets fall: the top of the bucket holding it, but no more than max
+static uint64_t stats_percentile(const unsigned long *buckets, unsigned long count, unsigned long max, double fraction) {
+    unsigned long want = (unsigned long)(count * fraction);
+    unsigned long seen = 0;
+    for (int b = 0; b < STATS_BUCKETS - 1; b++) {
+        seen += buckets[b];
+        if (seen > want) return stats_bucket_floor(b + 1) < max ? stats_bucket_floor(b + 1) : max;
+    }
+    return max;
+}
+
+// Render the current totals as text into a malloc'd buffer; returns its length
+static size_t stats_render(char **out) {
+    size_t len = 0;
+    *out = NULL;
+    FILE *f = open_memstream(out, &len);
+    if (f == NULL) return 0;
+
+    fprintf(f, "# %-14s %10s %12s %10s %10s %10s %10s %10s\n", "stage", "count", "total_us", "mean_ns", "p50_ns", "p90_ns", "p99_ns", "max_ns");
+    static unsigned long buckets[STAT_COUNT][STATS_BUCKETS];
+    static pthread_mutex_t render_lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_lock(&render_lock);
+    memset(buckets, 0, sizeof(buckets));
+    unsigned long count[STAT_COUNT] = {0}, total[STAT_COUNT] = {0}, max[STAT_COUNT] = {0};
+    for (struct stats_shard *shard = atomic_load(&stats_shards); shard != NULL; shard = shard->next) {
+        for (int s = 0; s < STAT_COUNT; s++) {
+            count[s] += atomic_load_explicit(&shard->count[s], memory_order_relaxed);
+            total[s] += atomic_load_explicit(&shard->total_ns[s], memory_order_relaxed);
+            unsigned long shard_max = atomic_load_explicit(&shard->max_ns[s], memory_order_relaxed);
+            if (shard_max > max[s]) max[s] = shard_max;
+            for (int b = 0; b < STATS_BUCKETS; b++) {
+                buckets[s][b] += atomic_load_explicit(&shard->buckets[s][b], memory_order_relaxed);
+            }
+        }
+    }
+
+    for (int s = 0; s < STAT_COUNT; s++) {
+        fprintf(f, "%-16s %10lu %12lu %10lu %10lu %10lu %10lu %10lu\n", stat_labels[s], count[s], total[s] / 1000,
+                count[s] ? total[s] / count[s] : 0,
+                (unsigned long)stats_percentile(buckets[s], count[s], max[s], 0.5),
+                (unsigned long)stats_percentile(buckets[s], count[s], max[s], 0.9),
+                (unsigned long)stats_percentile(buckets[s], count[s], max[s], 0.99), max[s]);
+    }
+
+    // Raw histograms: lower bound of each non-empty bucket in ns and its count
+    fprintf(f, "# histograms: stage floor_ns:count ...\n");
+    for (int s = 0; s < STAT_COUNT; s++) {
+        if (count[s] == 0) continue;
+        fprintf(f, "%s", stat_labels[s]);
+        for (int b = 0; b < STATS_BUCKETS; b++) {
+            if (buckets[s][b]) fprintf(f, " %lu:%lu", (unsigned long)stats_bucket_floor(b), buckets[s][b]);
+        }
+        fprintf(f, "\n");
+    }
+    pthread_mutex_unlock(&render_lock);
+
+    fclose(f);
+    return len;
+}
+
+void split_path(const char *path, char *parent_path, char *new_name) {
+    const char *last_slash = strrchr(path, '/');
+    if (!last_slash || last_slash == path) {
+        strcpy(parent_path, "/");
+        strcpy(new_name, last_slash ? last_slash + 1 : path);
+    }
+    else{
+        size_t parent_len = last_slash - path;
+        strncpy(parent_path, path, parent_len);
+        parent_path[parent_len] = '\0';
+        strcpy(new_name, last_slash + 1);
+    }
+}
+
+char* get_inode_block_addr(struct hfs_volume *vol, int disk_idx, int inode_idx) {
+    return (char *) (vol->disks[disk_idx]) + (vol->superblock->i_blocks_ptr) + (inode_idx * vol->inode_size);
+}
+
+struct hfs_inode* get_inode(struct hfs_volume *vol, off_t index) {
+    if (index < 0 || index >= vol->superblock->num_inodes) {
+        TRACE(INFO, GET_INODE_RANGE, NULL, index);
+        return NULL;
+    }
+
+    char* inode_offset = (char*) vol->disks[0] + vol->superblock->i_blocks_ptr; 
+
+    return (struct hfs_inode*)((char*)inode_offset + index * vol->inode_size);
+}
+
+// Copy a range that was just modified through disks[0] to the same offset on every other disk, right away.
+// RAID 0 keeps a single copy of everything in the data region, so only the head is copied.
+static void mirror_now(struct hfs_volume *vol, void *addr, size_t len) {
+    if (vol->superblock->mode == 0 &&
+        ((char *)addr < vol->disks[0] || (char *)addr >= vol->disks[0] + vol->superblock->d_blocks_ptr)) {
+        return;
+    }
+
+    off_t offset = (char *)addr - vol->disks[0];
+    for (int disk = 1; disk < vol->superblock->num_disks; disk++) {
+        memcpy(vol->disks[disk] + offset, addr, len);
+    }
+}
+
+static bool journal_record(struct hfs_volume *vol, void *addr, size_t len);
+static char *stage_home(struct hfs_volume *vol, void *addr, size_t len);
+#define DIRTY_SHARED (-1) // owner of dirty metadata ranges, which every fsync flushes
+static void dirty_mark_range(struct hfs_volume *vol, int owner, void *addr, size_t len);
+static void dirty_mark_data(struct hfs_volume *vol, int owner, off_t block_num, size_t offset, size_t len);
+
+// Publish a metadata change made through disks[0] (or, for RAID 0 metadata blocks, meta_block()).
+// With a journal the range is logged and reaches the mirrors when its group commits; without one
+// it is copied now and left for writeback.
+static void sync_mirrors(struct hfs_volume *vol, void *addr, size_t len) {
+    if (!journal_record(vol, addr, len)) {
+        addr = stage_home(vol, addr, len);
+        mirror_now(vol, addr, len);
+        dirty_mark_range(vol, DIRTY_SHARED, addr, len);
+    }
+}
+
+/*
+  Block addressing
+
+  Data block numbers are global. In RAID 0 the data region is striped: runs
+  of stripe_unit blocks go to the disks in turn, so block b is in stripe unit
+  b / stripe_unit, which lives on disk (unit % num_disks). The mirrored modes
+  keep block b at the same place on every disk. block_locate() is the only
+  place that translation is done; file data, directory blocks and extent tree
+  blocks all go through it.
+*/
+#define PARALLEL_IO_MIN (256 * 1024) // requests this big copy each disk's share on its own thread
+
+
+// Disk holding block_num, and its block number within that disk's data region in *local
+static int block_locate(struct hfs_volume *vol, off_t block_num, off_t *local) {
+    if (vol->superblock->mode != 0) {
+        *local = block_num;
+        return 0;
+    }
+
+    off_t unit = block_num / vol->stripe_unit;
+    *local = (unit / vol->num_disks) * vol->stripe_unit + block_num % vol->stripe_unit;
+    return unit % vol->num_disks;
+}
+
+static char *block_addr(struct hfs_volume *vol, int disk, off_t local) {
+    return vol->disks[disk] + vol->superblock->d_blocks_ptr + local * vol->block_size;
+}
+
+// Metadata blocks (directory and extent tree blocks); mirrored modes keep their copies with sync_mirrors().
+// RAID 0 ones are changed in stage_maps until their group commits, see the metadata journal.
+static char *meta_block(struct hfs_volume *vol, off_t block_num) {
+    off_t local;
+    int disk = block_locate(vol, block_num, &local);
+    if (vol->stage_maps[disk] != NULL) {
+        return vol->stage_maps[disk] + vol->superblock->d_blocks_ptr + local * vol->block_size;
+    }
+    return block_addr(vol, disk, local);
+}
+
+static int parse_read_policy(struct hfs_volume *vol, const char *name) {
+    if (strcmp(name, "rr") == 0) {
+        vol->read_policy = READ_ROUND_ROBIN;
+    } else if (strcmp(name, "lor") == 0) {
+        vol->read_policy = READ_LEAST_OUTSTANDING;
+    } else if (strcmp(name, "locality") == 0) {
+        vol->read_policy = READ_LOCALITY;
+    } else {
+        return FAIL;
+    }
+    return SUCCESS;
+}
+
+// Mirror to read block_num from
+static int pick_mirror(struct hfs_volume *vol, off_t block_num) {
+    switch (vol->read_policy) {
+    case READ_ROUND_ROBIN:
+        return atomic_fetch_add(&vol->read_next, 1) % vol->num_disks;
+    case READ_LOCALITY:
+        return (block_num / vol->stripe_unit) % vol->num_disks;
+    case READ_LEAST_OUTSTANDING:
+    default: {
+        // Start from a rotating disk so ties don't all land on disks[0]
+        int start = atomic_fetch_add(&vol->read_next, 1) % vol->num_disks;
+        int best = start;
+        for (int i = 1; i < vol->num_disks; i++) {
+            int disk = (start + i) % vol->num_disks;
+            if (atomic_load(&vol->disk_stats[disk].outstanding) < atomic_load(&vol->disk_stats[best].outstanding)) {
+                best = disk;
+            }
+        }
+        return best;
+    }
+    }
+}
+
+/*
+  Checksums
+
+  Images from mkfs have a CRC32C for every data block in the region at
+  csum_ptr, in the mirrored head of each disk. data_write refreshes the
+  checksums of the blocks it touched; every block a read touches is checked
+  on the disk it is read from. A bad mirror copy is replaced by a good one
+  from another mirror; with no good copy (and always in RAID 0) the read
+  fails with EIO. RAID 1v reads compare the mirrors instead and only turn
+  to the checksums when the comparison can't pick a copy (see below).
+  Directory and extent tree blocks are not checksummed.
+*/
+
+static uint32_t crc32c_table[256];
+
+static uint32_t crc32c_soft(uint32_t crc, const char *buf, size_t len) {
+    const unsigned char *p = (const unsigned char *)buf;
+    while (len-- > 0) {
+        crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const char *buf, size_t len) {
+    uint64_t crc64 = crc;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, buf + i, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = (uint32_t)crc64;
+    for (; i < len; i++) {
+        crc = _mm_crc32_u8(crc, (unsigned char)buf[i]);
+    }
+    return crc;
+}
+#endif
+
+// Chosen once per process by crc32c_init()
+static uint32_t (*crc32c_update)(uint32_t crc, const char *buf, size_t len) = crc32c_soft;
+
+static uint32_t crc32c(const char *buf, size_t len) {
+    return ~crc32c_update(~0U, buf, len);
+}
+
+static void crc32c_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1));
+        }
+        crc32c_table[i] = crc;
+    }
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c_update = crc32c_sse42;
+    }
+#endif
+}
+
+static void csum_init(struct hfs_volume *vol) {
+    vol->csum_table = vol->superblock->csum_ptr ? (uint32_t *)(vol->disks[0] + vol->superblock->csum_ptr) : NULL;
+}
+
+// Recompute the checksums of the blocks covering [offset, offset + len) of block_num after a write
+static void csum_update(struct hfs_volume *vol, off_t block_num, size_t offset, size_t len) {
+    off_t first = block_num + offset / vol->block_size;
+    off_t last = block_num + (offset + len - 1) / vol->block_size;
+    for (off_t b = first; b <= last; b++) {
+        off_t local;
+        int disk = block_locate(vol, b, &local);
+        vol->csum_table[b] = crc32c(block_addr(vol, disk, local), vol->block_size);
+    }
+    // Checksums follow the data, which is not journaled, so they go to every disk right away
+    mirror_now(vol, &vol->csum_table[first], (last - first + 1) * sizeof(uint32_t));
+    dirty_mark_range(vol, DIRTY_SHARED, &vol->csum_table[first], (last - first + 1) * sizeof(uint32_t));
+}
+
+// Check block_num's copy on disk, repairing it from another mirror if that one is good
+static int csum_verify(struct hfs_volume *vol, off_t block_num, int disk) {
+    off_t local;
+    block_locate(vol, block_num, &local);
+    uint32_t want = vol->csum_table[block_num];
+    char *addr = block_addr(vol, disk, local);
+    if (crc32c(addr, vol->block_size) == want) return SUCCESS;
+
+    if (vol->superblock->mode != 0) {
+        for (int i = 0; i < vol->num_disks; i++) {
+            if (i == disk || crc32c(block_addr(vol, i, local), vol->block_size) != want) continue;
+
+            fprintf(stderr, "checksum: repairing block %ld on disk %d from disk %d\n", (long)block_num, disk, i);
+            memcpy(addr, block_addr(vol, i, local), vol->block_size);
+            atomic_fetch_add(&vol->verify_repairs, 1);
+            return SUCCESS;
+        }
+    }
+
+    fprintf(stderr, "checksum: block %ld has no good copy\n", (long)block_num);
+    atomic_fetch_add(&vol->verify_failures, 1);
+    return -EIO;
+}
+
+/*
+  I/O backends
+
+  File data moves between FUSE's buffers and the disks through one of these,
+  picked at mount with --io=mmap|pread|uring. mmap copies to and from the
+  mapping of each image, pread uses pread/pwrite on the image's descriptor,
+  and uring queues requests on a per-thread io_uring so every disk's share of
+  a data_io() is in flight at once, up to --queue-depth=N. The head of each
+  disk, directory and extent tree blocks, checksum checks and RAID 1v
+  comparison still go through the mapping; Linux's page cache keeps that
+  coherent with the other two.
+*/
+#define ZERO_CHUNK (65536)         // zero writes go out this much at a time
+#define QUEUE_DEPTH (64)           // default io_uring entries per thread
+#define MAX_QUEUE_DEPTH (4096)
+
+// One contiguous piece of a disk
+struct io_req {
+    int disk;
+    off_t offset;      // bytes from the start of the disk
+    char *buf;         // NULL writes zeroes
+    size_t len;
+    bool write;
+};
+
+struct io_backend {
+    const char *name;
+    int (*init)(struct hfs_volume *vol);                                    // FAIL when it can't run here
+    int (*submit)(struct hfs_volume *vol, struct io_req *reqs, int count);  // returns once all are done, 0 or the first -errno
+};
+
+static const char zero_chunk[ZERO_CHUNK];
+
+static int mmap_submit(struct hfs_volume *vol, struct io_req *reqs, int count) {
+    for (int i = 0; i < count; i++) {
+        char *addr = vol->disks[reqs[i].disk] + reqs[i].offset;
+        if (!reqs[i].write) {
+            memcpy(reqs[i].buf, addr, reqs[i].len);
+        } else if (reqs[i].buf) {
+            memcpy(addr, reqs[i].buf, reqs[i].len);
+        } else {
+            memset(addr, 0, reqs[i].len);
+        }
+    }
+    return SUCCESS;
+}
+
+// Carry out one request with pread/pwrite, retrying short transfers
+static int io_req_sync(struct hfs_volume *vol, struct io_req *req) {
+    size_t pos = 0;
+    while (pos < req->len) {
+        size_t len = req->len - pos;
+        ssize_t n;
+        if (!req->write) {
+            n = pread(vol->fileDescs[req->disk], req->buf + pos, len, req->offset + pos);
+        } else if (req->buf) {
+            n = pwrite(vol->fileDescs[req->disk], req->buf + pos, len, req->offset + pos);
+        } else {
+            n = pwrite(vol->fileDescs[req->disk], zero_chunk, len < ZERO_CHUNK ? len : ZERO_CHUNK, req->offset + pos);
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            fprintf(stderr, "io: disk %d at offset %ld: %s\n", req->disk, (long)(req->offset + pos), n < 0 ? strerror(errno) : "past end of disk");
+            return n < 0 ? -errno : -EIO;
+        }
+        pos += n;
+    }
+    return SUCCESS;
+}
+
+static int io_no_init(struct hfs_volume *vol) {
+    return SUCCESS;
+}
+
+static int pread_submit(struct hfs_volume *vol, struct io_req *reqs, int count) {
+    for (int i = 0; i < count; i++) {
+        int rc = io_req_sync(vol, &reqs[i]);
+        if (rc < 0) return rc;
+    }
+    return SUCCESS;
+}
+
+#if defined(HAVE_IO_URING)
+// A ring set up with the raw system calls; each FUSE thread gets its own
+struct uring {
+    int fd;
+    unsigned int entries;
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *ring;
+    size_t ring_size;
+    size_t sqes_size;
+};
+
+static pthread_key_t uring_key; // rings serve whichever volumes the thread works on
+static bool uring_key_ok;
+
+static void uring_free(void *arg) {
+    struct uring *ring = arg;
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->ring, ring->ring_size);
+    close(ring->fd);
+    free(ring);
+}
+
+static struct uring *uring_setup(struct hfs_volume *vol) {
+    struct io_uring_params params = {0};
+    int fd = syscall(__NR_io_uring_setup, vol->queue_depth, &params);
+    if (fd < 0) return NULL;
+    // Every kernel with the opcodes used here maps both rings at once
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(fd);
+        return NULL;
+    }
+
+    struct uring *ring = calloc(1, sizeof(struct uring));
+    if (ring == NULL) {
+        close(fd);
+        return NULL;
+    }
+    ring->fd = fd;
+    ring->entries = params.sq_entries;
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->ring = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring->ring == MAP_FAILED) {
+        close(fd);
+        free(ring);
+        return NULL;
+    }
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        munmap(ring->ring, ring->ring_size);
+        close(fd);
+        free(ring);
+        return NULL;
+    }
+
+    char *base = ring->ring;
+    ring->sq_head = (unsigned int *)(base + params.sq_off.head);
+    ring->sq_tail = (unsigned int *)(base + params.sq_off.tail);
+    ring->sq_mask = (unsigned int *)(base + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)(base + params.sq_off.array);
+    ring->cq_head = (unsigned int *)(base + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)(base + params.cq_off.tail);
+    ring->cq_mask = (unsigned int *)(base + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(base + params.cq_off.cqes);
+    return ring;
+}
+
+static struct uring *uring_get(struct hfs_volume *vol) {
+    struct uring *ring = pthread_getspecific(uring_key);
+    if (ring == NULL) {
+        ring = uring_setup(vol);
+        if (ring != NULL) pthread_setspecific(uring_key, ring);
+    }
+    return ring;
+}
+
+static int uring_init(struct hfs_volume *vol) {
+    if (!uring_key_ok) return FAIL;
+    // Make sure the kernel allows io_uring before committing to it
+    return uring_get(vol) ? SUCCESS : FAIL;
+}
+
+static int uring_submit(struct hfs_volume *vol, struct io_req *reqs, int count) {
+    struct uring *ring = uring_get(vol);
+    if (ring == NULL) return pread_submit(vol, reqs, count);
+
+    int rc = SUCCESS;
+    int next = 0;      // first request not yet queued
+    int in_flight = 0;
+    while (next < count || in_flight > 0) {
+        unsigned int tail = *ring->sq_tail;
+        unsigned int queued = 0;
+        for (; next < count && in_flight + queued < ring->entries; next++) {
+            struct io_req *req = &reqs[next];
+            // Zeroes come from a small shared buffer, so those go through pwrite
+            if ((req->write && !req->buf) || req->len > UINT32_MAX) {
+                int sync_rc = io_req_sync(vol, req);
+                if (rc == SUCCESS) rc = sync_rc;
+                continue;
+            }
+            unsigned int slot = tail & *ring->sq_mask;
+            struct io_uring_sqe *sqe = &ring->sqes[slot];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = req->write ? IORING_OP_WRITE : IORING_OP_READ;
+            sqe->fd = vol->fileDescs[req->disk];
+            sqe->off = req->offset;
+            sqe->addr = (uint64_t)(uintptr_t)req->buf;
+            sqe->len = req->len;
+            sqe->user_data = next;
+            ring->sq_array[slot] = slot;
+            tail++;
+            queued++;
+        }
+        __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+        in_flight += queued;
+        if (in_flight == 0) continue;
+
+        int entered;
+        do {
+            unsigned int unsubmitted = tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+            entered = syscall(__NR_io_uring_enter, ring->fd, unsubmitted, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        } while (entered < 0 && errno == EINTR);
+        if (entered < 0) {
+            // The ring's state is unknown now; drop it and let the next call set up a new one
+            rc = -errno;
+            fprintf(stderr, "io: io_uring_enter: %s\n", strerror(errno));
+            pthread_setspecific(uring_key, NULL);
+            uring_free(ring);
+            return rc;
+        }
+
+        unsigned int head = *ring->cq_head;
+        while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            struct io_req *req = &reqs[cqe->user_data];
+            if (cqe->res < 0) {
+                fprintf(stderr, "io: disk %d at offset %ld: %s\n", req->disk, (long)req->offset, strerror(-cqe->res));
+                if (rc == SUCCESS) rc = cqe->res;
+            } else if ((size_t)cqe->res < req->len) {
+                // Short transfer: finish the rest here
+                struct io_req rest = *req;
+                rest.offset += cqe->res;
+                rest.buf += cqe->res;
+                rest.len -= cqe->res;
+                int sync_rc = io_req_sync(vol, &rest);
+                if (rc == SUCCESS) rc = sync_rc;
+            }
+            head++;
+            in_flight--;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return rc;
+}
+#endif
+
+static const struct io_backend io_backends[] = {
+    {"mmap", io_no_init, mmap_submit},
+    {"pread", io_no_init, pread_submit},
+#if defined(HAVE_IO_URING)
+    {"uring", uring_init, uring_submit},
+#endif
+};
+
+static int parse_io_backend(struct hfs_volume *vol, const char *name) {
+    for (size_t i = 0; i < sizeof(io_backends) / sizeof(io_backends[0]); i++) {
+        if (strcmp(name, io_backends[i].name) == 0) {
+            vol->io_backend = &io_backends[i];
+            return SUCCESS;
+        }
+    }
+    return FAIL;
+}
+
+// One disk's share of a data copy
+struct disk_io {
+    struct hfs_volume *vol;
+    int disk;
+    off_t block_num;     // first block of the range
+    size_t offset;       // byte offset into it
+    char *rbuf;          // destination when reading
+    const char *wbuf;    // source when writing, NULL writes zeroes
+    size_t len;
+    bool write;
+    struct io_req *reqs; // filled by disk_io_plan()
+    int num_reqs;
+    int rc;              // -EIO when a read found no good copy, or the backend's error
+};
+
+// Turn the parts of the range that live on io->disk into requests, checking checksums of what will be read
+static void disk_io_plan(struct hfs_volume *vol, struct disk_io *io) {
+    // A RAID 0 stripe unit is contiguous on its disk and a mirror's range is contiguous
+    size_t pos = 0;
+    while (pos < io->len) {
+        size_t byte = io->offset + pos;
+        off_t block_num = io->block_num + byte / vol->block_size;
+        size_t chunk = io->len - pos;
+        if (vol->superblock->mode == 0) {
+            size_t unit_offset = (block_num % vol->stripe_unit) * vol->block_size + byte % vol->block_size;
+            if (chunk > vol->stripe_unit * vol->block_size - unit_offset) {
+                chunk = vol->stripe_unit * vol->block_size - unit_offset;
+            }
+        }
+
+        off_t local;
+        if (block_locate(vol, block_num, &local) != io->disk && vol->superblock->mode == 0) {
+            pos += chunk;
+            continue;
+        }
+        if (vol->csum_table && !io->write) {
+            off_t last = io->block_num + (byte + chunk - 1) / vol->block_size;
+            for (off_t b = block_num; b <= last; b++) {
+                io->rc = csum_verify(vol, b, io->disk);
+                if (io->rc < 0) return;
+            }
+        }
+
+        struct io_req *req = &io->reqs[io->num_reqs++];
+        req->disk = io->disk;
+        req->offset = vol->superblock->d_blocks_ptr + local * vol->block_size + byte % vol->block_size;
+        req->buf = !io->write ? io->rbuf + pos : io->wbuf ? (char *)io->wbuf + pos : NULL;
+        req->len = chunk;
+        req->write = io->write;
+        pos += chunk;
+    }
+}
+
+static void disk_io_run(struct hfs_volume *vol, struct disk_io *io) {
+    disk_io_plan(vol, io);
+    if (io->rc < 0) return;
+
+    uint64_t start = stats_now();
+    if (io->write) {
+        io->rc = vol->io_backend->submit(vol, io->reqs, io->num_reqs);
+        stats_end(STAT_DISK_IO, start);
+        return;
+    }
+
+    struct disk_stats *stats = &vol->disk_stats[io->disk];
+    atomic_fetch_add(&stats->outstanding, 1);
+    io->rc = vol->io_backend->submit(vol, io->reqs, io->num_reqs);
+    atomic_fetch_sub(&stats->outstanding, 1);
+    stats_end(STAT_DISK_IO, start);
+    atomic_fetch_add(&stats->reads, 1);
+    atomic_fetch_add(&stats->read_bytes, io->len);
+}
+
+static void *disk_io_thread(void *arg) {
+    struct disk_io *io = arg;
+    disk_io_run(io->vol, io);
+    return NULL;
+}
+
+#if defined(HAVE_IO_URING)
+// Plan every disk's share, then hand all of it to the ring in one go.
+// reqs is the array the disks' slices were cut from.
+static void disk_io_run_all(struct hfs_volume *vol, struct disk_io *io, int count, struct io_req *reqs) {
+    int num_reqs = 0;
+    for (int i = 0; i < count; i++) {
+        disk_io_plan(vol, &io[i]);
+        if (io[i].rc < 0) return;
+        // Slices were sized for the worst case; close the gaps
+        memmove(reqs + num_reqs, io[i].reqs, io[i].num_reqs * sizeof(struct io_req));
+        io[i].reqs = reqs + num_reqs;
+        num_reqs += io[i].num_reqs;
+    }
+    for (int i = 0; i < count; i++) {
+        if (!io[i].write) atomic_fetch_add(&vol->disk_stats[io[i].disk].outstanding, 1);
+    }
+
+    uint64_t start = stats_now();
+    io[0].rc = vol->io_backend->submit(vol, reqs, num_reqs);
+    stats_end(STAT_DISK_IO, start);
+
+    for (int i = 0; i < count; i++) {
+        if (io[i].write) continue;
+        struct disk_stats *stats = &vol->disk_stats[io[i].disk];
+        atomic_fetch_sub(&stats->outstanding, 1);
+        atomic_fetch_add(&stats->reads, 1);
+        atomic_fetch_add(&stats->read_bytes, io[i].len);
+    }
+}
+#endif
+
+/*
+  RAID 1v verification
+
+  Every read compares the range on all mirrors. If they disagree, the copy
+  that a majority of mirrors agree on is returned and written over the
+  others. With no majority, which is every disagreement between two
+  mirrors, each block's checksum breaks the tie; on images without
+  checksums the read fails with EIO. Ranges are handled in
+  VERIFY_CHUNK pieces: mirror 0 is copied out, then every other mirror is
+  compared against that (now cached) copy with SSE2 or AVX2.
+*/
+#define VERIFY_CHUNK (4096)
+
+static bool range_equal_generic(const char *a, const char *b, size_t len) {
+    return memcmp(a, b, len) == 0;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static bool range_equal_sse2(const char *a, const char *b, size_t len) {
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        __m128i x0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(a + i)), _mm_loadu_si128((const __m128i *)(b + i)));
+        __m128i x1 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(a + i + 16)), _mm_loadu_si128((const __m128i *)(b + i + 16)));
+        __m128i x2 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(a + i + 32)), _mm_loadu_si128((const __m128i *)(b + i + 32)));
+        __m128i x3 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(a + i + 48)), _mm_loadu_si128((const __m128i *)(b + i + 48)));
+        __m128i any = _mm_or_si128(_mm_or_si128(x0, x1), _mm_or_si128(x2, x3));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128())) != 0xFFFF) return false;
+    }
+    return memcmp(a + i, b + i, len - i) == 0;
+}
+
+__attribute__((target("avx2")))
+static bool range_equal_avx2(const char *a, const char *b, size_t len) {
+    size_t i = 0;
+    for (; i + 128 <= len; i += 128) {
+        __m256i x0 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(a + i)), _mm256_loadu_si256((const __m256i *)(b + i)));
+        __m256i x1 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(a + i + 32)), _mm256_loadu_si256((const __m256i *)(b + i + 32)));
+        __m256i x2 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(a + i + 64)), _mm256_loadu_si256((const __m256i *)(b + i + 64)));
+        __m256i x3 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(a + i + 96)), _mm256_loadu_si256((const __m256i *)(b + i + 96)));
+        __m256i any = _mm256_or_si256(_mm256_or_si256(x0, x1), _mm256_or_si256(x2, x3));
+        if (!_mm256_testz_si256(any, any)) return false;
+    }
+    return range_equal_sse2(a + i, b + i, len - i);
+}
+#endif
+
+// Chosen at mount by verify_init()
+static bool (*range_equal)(const char *a, const char *b, size_t len) = range_equal_generic;
+
+static void verify_init(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        range_equal = range_equal_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        range_equal = range_equal_sse2;
+    }
+#endif
+}
+
+// No majority for len bytes at offset into block_num: keep each block's copies that match its checksum
+static int verify_tiebreak(struct hfs_volume *vol, off_t block_num, size_t offset, char *buf, size_t len) {
+    off_t first = block_num + offset / vol->block_size;
+    off_t last = block_num + (offset + len - 1) / vol->block_size;
+    for (off_t b = first; b <= last; b++) {
+        for (int i = 0; i < vol->num_disks; i++) {
+            int rc = csum_verify(vol, b, i);
+            if (rc < 0) return rc;
+        }
+    }
+    memcpy(buf, block_addr(vol, 0, block_num) + offset, len);
+    return SUCCESS;
+}
+
+// Mirrors disagree on copies[*][0, len), which start offset bytes into block_num:
+// vote, fill buf from the winner and repair the rest
+static int verify_resolve(struct hfs_volume *vol, off_t block_num, size_t offset, char **copies, char *buf, size_t len) {
+    for (int candidate = 0; candidate < vol->num_disks; candidate++) {
+        int votes = 0;
+        for (int i = 0; i < vol->num_disks; i++) {
+            if (i == candidate || range_equal(copies[candidate], copies[i], len)) {
+                votes++;
+            }
+        }
+        if (votes * 2 <= vol->num_disks) continue;
+
+        memcpy(buf, copies[candidate], len);
+        for (int i = 0; i < vol->num_disks; i++) {
+            if (i != candidate && !range_equal(copies[candidate], copies[i], len)) {
+                fprintf(stderr, "raid 1v: repairing disk %d at offset %ld\n", i, (long)(copies[i] - vol->disks[i]));
+                memcpy(copies[i], copies[candidate], len);
+            }
+        }
+        atomic_fetch_add(&vol->verify_repairs, 1);
+        return SUCCESS;
+    }
+
+    if (vol->csum_table) return verify_tiebreak(vol, block_num, offset, buf, len);
+    fprintf(stderr, "raid 1v: no majority at offset %ld\n", (long)(copies[0] - vol->disks[0]));
+    atomic_fetch_add(&vol->verify_failures, 1);
+    return -EIO;
+}
+
+// Read len bytes starting offset bytes into block_num, checked against every mirror
+static int verified_read(struct hfs_volume *vol, off_t block_num, size_t offset, char *buf, size_t len) {
+    char *copies[MAX_DISKS];
+    for (int i = 0; i < vol->num_disks; i++) {
+        copies[i] = block_addr(vol, i, block_num) + offset;
+        atomic_fetch_add(&vol->disk_stats[i].reads, 1);
+        atomic_fetch_add(&vol->disk_stats[i].read_bytes, len);
+    }
+
+    for (size_t pos = 0; pos < len; pos += VERIFY_CHUNK) {
+        size_t chunk = len - pos < VERIFY_CHUNK ? len - pos : VERIFY_CHUNK;
+        memcpy(buf + pos, copies[0] + pos, chunk);
+
+        bool agree = true;
+        for (int i = 1; i < vol->num_disks && agree; i++) {
+            agree = range_equal(buf + pos, copies[i] + pos, chunk);
+        }
+        if (agree) continue;
+
+        char *chunk_copies[MAX_DISKS];
+        for (int i = 0; i < vol->num_disks; i++) {
+            chunk_copies[i] = copies[i] + pos;
+        }
+        int rc = verify_resolve(vol, block_num, offset + pos, chunk_copies, buf + pos, chunk);
+        if (rc < 0) return rc;
+    }
+    return SUCCESS;
+}
+
+// Finish a data copy: refresh checksums after a write, report the first failure
+static int data_io_done(struct hfs_volume *vol, struct disk_io *io, int count, off_t block_num, size_t offset, size_t len, bool write) {
+    if (write && vol->csum_table) {
+        csum_update(vol, block_num, offset, len);
+    }
+    for (int i = 0; i < count; i++) {
+        if (io[i].rc < 0) return io[i].rc;
+    }
+    return SUCCESS;
+}
+
+#define INLINE_REQS (16) // requests data_io() keeps on the stack
+
+// Copy len bytes of file data starting offset bytes into block_num, to rbuf or from wbuf.
+// Every disk with a share of the range takes part; large requests run them concurrently.
+// Mirrored reads go to the mirror chosen by read_policy, or are split across all mirrors when large.
+// Reads fail with -EIO when checksums or RAID 1v's comparison find no good copy.
+static int data_io(struct hfs_volume *vol, off_t block_num, size_t offset, char *rbuf, const char *wbuf, size_t len, bool write) {
+    struct disk_io io[MAX_DISKS];
+    int count = 0;
+    if (len == 0) return SUCCESS;
+    if (vol->superblock->mode == 2 && !write) {
+        return verified_read(vol, block_num, offset, rbuf, len);
+    }
+
+    struct disk_io whole = {vol, 0, block_num, offset, rbuf, wbuf, len, write, NULL, 0, SUCCESS};
+    size_t reqs_per_disk = 1;
+
+    if (vol->superblock->mode == 0) {
+        off_t first_unit = (block_num + offset / vol->block_size) / vol->stripe_unit;
+        off_t last_unit = (block_num + (offset + len - 1) / vol->block_size) / vol->stripe_unit;
+        off_t units = last_unit - first_unit + 1;
+        for (int i = 0; i < vol->num_disks && i < units; i++) {
+            io[count] = whole;
+            io[count++].disk = (first_unit + i) % vol->num_disks;
+        }
+        reqs_per_disk = (units + vol->num_disks - 1) / vol->num_disks;
+    } else if (write) {
+        for (int i = 0; i < vol->num_disks; i++) {
+            io[count] = whole;
+            io[count++].disk = i;
+        }
+    } else if (len < PARALLEL_IO_MIN) {
+        io[count] = whole;
+        io[count++].disk = pick_mirror(vol, block_num);
+    } else {
+        // Large mirrored read: one contiguous piece from each mirror
+        int first = pick_mirror(vol, block_num);
+        size_t piece = ((len / vol->num_disks + vol->block_size - 1) / vol->block_size) * vol->block_size;
+        for (size_t pos = 0; pos < len; pos += piece) {
+            io[count] = whole;
+            io[count].disk = (first + count) % vol->num_disks;
+            io[count].offset = offset + pos;
+            io[count].rbuf = rbuf + pos;
+            io[count].len = pos + piece < len ? piece : len - pos;
+            count++;
+        }
+    }
+
+    struct io_req inline_reqs[INLINE_REQS];
+    struct io_req *reqs = inline_reqs;
+    if (reqs_per_disk * count > INLINE_REQS) {
+        reqs = malloc(reqs_per_disk * count * sizeof(struct io_req));
+        if (reqs == NULL) return -ENOMEM;
+    }
+    for (int i = 0; i < count; i++) {
+        io[i].reqs = reqs + i * reqs_per_disk;
+    }
+
+#if defined(HAVE_IO_URING)
+    if (vol->io_backend->submit == uring_submit) {
+        disk_io_run_all(vol, io, count, reqs);
+        if (reqs != inline_reqs) free(reqs);
+        return data_io_done(vol, io, count, block_num, offset, len, write);
+    }
+#endif
+
+    if (count == 1 || len < PARALLEL_IO_MIN) {
+        for (int i = 0; i < count; i++) {
+            disk_io_run(vol, &io[i]);
+        }
+    } else {
+        pthread_t threads[MAX_DISKS];
+        bool started[MAX_DISKS] = {false};
+        for (int i = 1; i < count; i++) {
+            started[i] = pthread_create(&threads[i], NULL, disk_io_thread, &io[i]) == 0;
+            if (!started[i]) {
+                disk_io_run(vol, &io[i]);
+            }
+        }
+        disk_io_run(vol, &io[0]);
+        for (int i = 1; i < count; i++) {
+            if (started[i]) {
+                pthread_join(threads[i], NULL);
+            }
+        }
+    }
+    if (reqs != inline_reqs) free(reqs);
+    return data_io_done(vol, io, count, block_num, offset, len, write);
+}
+
+/*
+  Bitmap allocator
+
+  Both bitmaps are kept identical on every disk; disks[0] is scanned and
+  changes are copied to the others. Scans go 64 bits at a time from a rotating
+  next-fit hint, and an in-memory free count per group of ALLOC_GROUP_BITS
+  bits lets a scan skip full regions without touching them. A request for
+  several bits looks for a free run that long within ALLOC_RUN_WINDOW bits
+  of the hint, where empty groups count whole, and takes the longest run it
+  saw when there is none. All of it is guarded by alloc_lock.
+*/
+#define ALLOC_GROUP_BITS  (4096)
+#define ALLOC_GROUP_WORDS (ALLOC_GROUP_BITS / 64)
+#define ALLOC_RUN_WINDOW  (16 * ALLOC_GROUP_BITS)
+
+
+static size_t bitmap_bytes(struct bitmap_alloc *ba) {
+    return (ba->bits + 7) / 8;
+}
+
+// Word w of the bitmap; bits past the end read as used
+static uint64_t bitmap_word(struct hfs_volume *vol, struct bitmap_alloc *ba, size_t w) {
+    uint64_t word = 0;
+    size_t byte = w * 8;
+    size_t len = bitmap_bytes(ba) - byte < 8 ? bitmap_bytes(ba) - byte : 8;
+    memcpy(&word, vol->disks[0] + ba->offset + byte, len);
+
+    size_t valid = ba->bits - w * 64;
+    if (valid < 64) {
+        word |= ~(uint64_t)0 << valid;
+    }
+    return word;
+}
+
+static void bitmap_store_word(struct hfs_volume *vol, struct bitmap_alloc *ba, size_t w, uint64_t word) {
+    size_t byte = w * 8;
+    size_t len = bitmap_bytes(ba) - byte < 8 ? bitmap_bytes(ba) - byte : 8;
+    memcpy(vol->disks[0] + ba->offset + byte, &word, len);
+}
+
+// Mark [start, start + len) used or free on every disk and keep the counters in step
+static void bitmap_mark(struct hfs_volume *vol, struct bitmap_alloc *ba, size_t start, size_t len, bool used) {
+    size_t end = start + len;
+    for (size_t bit = start; bit < end; ) {
+        size_t w = bit / 64;
+        size_t lo = bit % 64;
+        size_t n = (end - bit < 64 - lo) ? end - bit : 64 - lo;
+        uint64_t mask = (n == 64 ? ~(uint64_t)0 : (((uint64_t)1 << n) - 1)) << lo;
+
+        uint64_t word = bitmap_word(vol, ba, w);
+        uint64_t changed = used ? (mask & ~word) : (mask & word);
+        word = used ? (word | mask) : (word & ~mask);
+        bitmap_store_word(vol, ba, w, word);
+
+        int count = __builtin_popcountll(changed);
+        if (used) {
+            ba->free -= count;
+            ba->group_free[w / ALLOC_GROUP_WORDS] -= count;
+        } else {
+            ba->free += count;
+            ba->group_free[w / ALLOC_GROUP_WORDS] += count;
+        }
+        bit += n;
+    }
+
+    size_t first = start / 8;
+    sync_mirrors(vol, vol->disks[0] + ba->offset + first, (end + 7) / 8 - first);
+}
+
+// Merge the copies on every disk into one (RAID 0 used to set bits on a single disk) and build the counters
+static int bitmap_init(struct hfs_volume *vol, struct bitmap_alloc *ba, off_t offset, size_t bits) {
+    ba->offset = offset;
+    ba->bits = bits;
+    ba->hint = 0;
+    ba->free = 0;
+
+    size_t num_groups = (bits + ALLOC_GROUP_BITS - 1) / ALLOC_GROUP_BITS;
+    ba->group_free = calloc(num_groups, sizeof(unsigned int));
+    if (ba->group_free == NULL) return FAIL;
+
+    char *primary = vol->disks[0] + offset;
+    for (int disk = 1; disk < vol->superblock->num_disks; disk++) {
+        char *copy = vol->disks[disk] + offset;
+        for (size_t i = 0; i < bitmap_bytes(ba); i++) {
+            primary[i] |= copy[i];
+        }
+    }
+    sync_mirrors(vol, primary, bitmap_bytes(ba));
+
+    for (size_t w = 0; w < (bits + 63) / 64; w++) {
+        int count = 64 - __builtin_popcountll(bitmap_word(vol, ba, w));
+        ba->group_free[w / ALLOC_GROUP_WORDS] += count;
+        ba->free += count;
+    }
+    return SUCCESS;
+}
+
+// First free bit at or after the hint, wrapping around
+static long bitmap_find_free(struct hfs_volume *vol, struct bitmap_alloc *ba) {
+    if (ba->free == 0) return -ENOSPC;
+
+    size_t num_words = (ba->bits + 63) / 64;
+    size_t w = (ba->hint / 64) % num_words;
+    uint64_t below_hint = ((uint64_t)1 << (ba->hint % 64)) - 1;
+
+    for (size_t i = 0; i <= num_words; i++, w = (w + 1) % num_words) {
+        if (w % ALLOC_GROUP_WORDS == 0 && ba->group_free[w / ALLOC_GROUP_WORDS] == 0) {
+            size_t span = num_words - w < ALLOC_GROUP_WORDS ? num_words - w : ALLOC_GROUP_WORDS;
+            i += span - 1;
+            w += span - 1;
+            below_hint = 0;
+            continue;
+        }
+
+        uint64_t used = bitmap_word(vol, ba, w) | below_hint;
+        below_hint = 0;
+        if (~used) {
+            return w * 64 + __builtin_ctzll(~used);
+        }
+    }
+    return -ENOSPC;
+}
+
+// Free run starting at first, up to want bits long
+static size_t bitmap_run_at(struct hfs_volume *vol, struct bitmap_alloc *ba, size_t first, size_t want) {
+    size_t len = 0;
+    size_t bit = first;
+    while (len < want && bit < ba->bits) {
+        uint64_t used = bitmap_word(vol, ba, bit / 64) >> (bit % 64);
+        size_t avail = 64 - bit % 64;
+        size_t free_here = used ? __builtin_ctzll(used) : avail;
+        size_t take = free_here < want - len ? free_here : want - len;
+
+        len += take;
+        bit += take;
+        if (free_here < avail) break;
+    }
+    return len;
+}
+
+// First free run of want bits within ALLOC_RUN_WINDOW of the hint, else the longest one there (-1 when all are used)
+static long bitmap_find_run(struct hfs_volume *vol, struct bitmap_alloc *ba, size_t want, size_t *len) {
+    size_t num_words = (ba->bits + 63) / 64;
+    size_t window = ba->bits < ALLOC_RUN_WINDOW ? num_words : ALLOC_RUN_WINDOW / 64;
+    size_t w = (ba->hint / 64) % num_words;
+    size_t run_start = 0, run_len = 0;
+    long best = -1;
+    size_t best_len = 0;
+
+    for (size_t i = 0; i < window; ) {
+        // Runs don't wrap around the end of the bitmap
+        if (w == 0) run_len = 0;
+
+        size_t group = w / ALLOC_GROUP_WORDS;
+        size_t span = num_words - w < ALLOC_GROUP_WORDS ? num_words - w : ALLOC_GROUP_WORDS;
+        if (w % ALLOC_GROUP_WORDS == 0 && (ba->group_free[group] == 0 || ba->group_free[group] == span * 64)) {
+            if (ba->group_free[group] == 0) {
+                run_len = 0;
+            } else {
+                if (run_len == 0) run_start = w * 64;
+                run_len += ba->group_free[group];
+                if (run_len > best_len) {
+                    best = run_start;
+                    best_len = run_len;
+                }
+            }
+        } else {
+            span = 1;
+            uint64_t used = bitmap_word(vol, ba, w);
+            for (size_t pos = 0; pos < 64; ) {
+                uint64_t rest = used >> pos;
+                if (rest & 1) {
+                    // Skip the used bits; a run can start after them
+                    pos += ~rest ? __builtin_ctzll(~rest) : 64 - pos;
+                    run_len = 0;
+                    continue;
+                }
+                size_t n = rest ? __builtin_ctzll(rest) : 64 - pos;
+                if (run_len == 0) run_start = w * 64 + pos;
+                run_len += n;
+                pos += n;
+                if (run_len > best_len) {
+                    best = run_start;
+                    best_len = run_len;
+                }
+                if (run_len >= want) break;
+            }
+        }
+        if (best_len >= want) break;
+        i += span;
+        w = (w + span) % num_words;
+    }
+
+    *len = best_len < want ? best_len : want;
+    return best;
+}
+
+// Allocate up to want contiguous bits, returning the first and the run length in *got
+static long bitmap_alloc_run(struct hfs_volume *vol, struct bitmap_alloc *ba, size_t want, size_t *got) {
+    if (ba->free == 0) return -ENOSPC;
+
+    size_t len = 0;
+    long first = want > 1 ? bitmap_find_run(vol, ba, want, &len) : -1;
+    if (first < 0) {
+        // Nothing free near the hint (or a single bit): the first free bit anywhere
+        first = bitmap_find_free(vol, ba);
+        if (first < 0) return first;
+        len = bitmap_run_at(vol, ba, first, want);
+    }
+
+    bitmap_mark(vol, ba, first, len, true);
+    ba->hint = (first + len) % ba->bits;
+    *got = len;
+    return first;
+}
+
+// Allocate up to want contiguous data blocks. Returns the first block and the count in *got.
+static long allocate_data_blocks(struct hfs_volume *vol, size_t want, size_t *got) {
+    uint64_t start = stats_now();
+    pthread_mutex_lock(&vol->alloc_lock);
+    long block_num = bitmap_alloc_run(vol, &vol->data_alloc, want, got);
+    pthread_mutex_unlock(&vol->alloc_lock);
+    stats_end(STAT_ALLOC_DATA, start);
+    return block_num;
+}
+
+static long allocate_data_block(struct hfs_volume *vol) {
+    size_t got;
+    return allocate_data_blocks(vol, 1, &got);
+}
+
+static int allocate_inode(struct hfs_volume *vol) {
+    size_t got;
+    pthread_mutex_lock(&vol->alloc_lock);
+    long inode_idx = bitmap_alloc_run(vol, &vol->inode_alloc, 1, &got);
+    pthread_mutex_unlock(&vol->alloc_lock);
+    return inode_idx;
+}
+
+/*
+  Shared data blocks. hfs_file_copy_range() lets files map the same blocks
+  copy-on-write, and block_refs counts each block's owners beyond the first.
+  Counts live in one array per allocation group, made the first time a block
+  in the group is shared, so volumes without shared blocks pay nothing. They
+  are not stored on disk: files that may share blocks carry
+  HFS_INODE_SHARED, and the root directory carries it once any file does,
+  so mount can rebuild the counts from those files' extents. Guarded by
+  alloc_lock.
+*/
+
+// Caller holds alloc_lock
+static uint32_t block_extra_refs(struct hfs_volume *vol, off_t block_num) {
+    uint32_t *group = vol->block_refs[block_num / ALLOC_GROUP_BITS];
+    return group ? group[block_num % ALLOC_GROUP_BITS] : 0;
+}
+
+// Caller holds alloc_lock. Make sure every group of [block_num, block_num + count) has counts.
+static int block_refs_reserve(struct hfs_volume *vol, off_t block_num, size_t count) {
+    for (size_t g = block_num / ALLOC_GROUP_BITS; g <= (block_num + count - 1) / ALLOC_GROUP_BITS; g++) {
+        if (vol->block_refs[g]) continue;
+        vol->block_refs[g] = calloc(ALLOC_GROUP_BITS, sizeof(uint32_t));
+        if (vol->block_refs[g] == NULL) return -ENOMEM;
+    }
+    return SUCCESS;
+}
+
+// Caller holds alloc_lock. One more owner for each block of the run.
+static int share_data_blocks(struct hfs_volume *vol, off_t block_num, size_t count) {
+    int rc = block_refs_reserve(vol, block_num, count);
+    if (rc < 0) return rc;
+    for (off_t b = block_num; b < block_num + (off_t)count; b++) {
+        if (vol->block_refs[b / ALLOC_GROUP_BITS][b % ALLOC_GROUP_BITS]++ == 0) vol->shared_blocks++;
+    }
+    return SUCCESS;
+}
+
+// Caller holds alloc_lock. Drops one owner of each block; blocks no one else maps are freed.
+static void release_blocks_now(struct hfs_volume *vol, off_t block_num, size_t count) {
+    if (vol->shared_blocks == 0) {
+        bitmap_mark(vol, &vol->data_alloc, block_num, count, false);
+        return;
+    }
+
+    off_t end = block_num + count;
+    while (block_num < end) {
+        off_t run = block_num;
+        while (run < end && block_extra_refs(vol, run) == 0) run++;
+        if (run > block_num) {
+            bitmap_mark(vol, &vol->data_alloc, block_num, run - block_num, false);
+            block_num = run;
+            continue;
+        }
+        if (--vol->block_refs[block_num / ALLOC_GROUP_BITS][block_num % ALLOC_GROUP_BITS] == 0) vol->shared_blocks--;
+        block_num++;
+    }
+}
+
+static bool journal_defer_free(struct hfs_volume *vol, off_t block_num, size_t count);
+
+// Caller holds alloc_lock. With a journal the blocks are released by the commit of the change that
+// dropped them, so they are not reused while the committed metadata may still point at them.
+static void release_data_blocks(struct hfs_volume *vol, off_t block_num, size_t count) {
+    if (!journal_defer_free(vol, block_num, count)) {
+        release_blocks_now(vol, block_num, count);
+    }
+}
+
+// Caller holds alloc_lock
+static void release_data_block(struct hfs_volume *vol, off_t block_num) {
+    release_data_blocks(vol, block_num, 1);
+}
+
+// Caller holds alloc_lock
+static void release_inode(struct hfs_volume *vol, int inode_idx) {
+    bitmap_mark(vol, &vol->inode_alloc, inode_idx, 1, false);
+    vol->inode_gens[inode_idx]++;
+    char *slot = vol->disks[0] + vol->superblock->i_blocks_ptr + inode_idx * vol->inode_size;
+    memset(slot, 0, vol->inode_size);
+    sync_mirrors(vol, slot, vol->inode_size);
+}
+
+// Inline data: the bytes of an inode slot past struct hfs_inode. Small files
+// and directories (HFS_INODE_INLINE) keep their contents there instead of in
+// data blocks. Packed 128-byte slots have no room, so nothing is inlined.
+#define INLINE_CAP      (vol->inode_size - sizeof(struct hfs_inode))
+#define INLINE_DENTRIES ((int)(INLINE_CAP / sizeof(struct hfs_dentry)))
+
+static char *inline_data(struct hfs_inode *inode) {
+    return (char *)inode + sizeof(struct hfs_inode);
+}
+
+static struct hfs_dentry *inline_dentries(struct hfs_inode *inode) {
+    return (struct hfs_dentry *)inline_data(inode);
+}
+
+/*
+  Directories
+
+  Small directories keep the original flat format: blocks[] point at blocks
+  full of struct hfs_dentry. New directories start with their entries inline
+  and move them to a flat block when the slot fills. Once a flat directory needs a second block it is
+  converted to an index tree (HFS_INODE_DIR_INDEX), see hfs.h. Directory
+  blocks are metadata blocks, kept identical on every disk; changes are made
+  through disks[0] and copied out with sync_mirrors().
+*/
+#define DENTRIES_PER_BLOCK ((int)(vol->block_size / sizeof(struct hfs_dentry)))
+#define DIR_LEAF_CAP       (DENTRIES_PER_BLOCK - 1)
+#define DIR_NODE_CAP       ((int)((vol->block_size - sizeof(struct hfs_dentry)) / sizeof(struct hfs_dir_link)))
+#define DIR_MAX_DEPTH      (16)
+
+static unsigned int name_hash(const char *name) {
+    // FNV-1a
+    unsigned int hash = 2166136261u;
+    for (const char *c = name; *c; c++) {
+        hash ^= (unsigned char)*c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static struct hfs_dir_node *dir_node(struct hfs_volume *vol, off_t block_num) {
+    return (struct hfs_dir_node *)meta_block(vol, block_num);
+}
+
+static struct hfs_dentry *leaf_entries(struct hfs_dir_node *node) {
+    return (struct hfs_dentry *)node + 1;
+}
+
+static struct hfs_dir_link *node_links(struct hfs_dir_node *node) {
+    return (struct hfs_dir_link *)((char *)node + sizeof(struct hfs_dentry));
+}
+
+// Allocate a metadata block, zeroed on every disk
+static off_t alloc_meta_block(struct hfs_volume *vol) {
+    off_t block_num = allocate_data_block(vol);
+    if (block_num < 0) return block_num;
+
+    memset(meta_block(vol, block_num), 0, vol->block_size);
+    sync_mirrors(vol, meta_block(vol, block_num), vol->block_size);
+    return block_num;
+}
+
+// Index of the link in an index node that covers hash
+static int node_find_link(struct hfs_dir_node *node, unsigned int hash) {
+    struct hfs_dir_link *links = node_links(node);
+    int lo = 0, hi = node->count - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (links[mid].hash <= hash) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+static int dir_index_lookup(struct hfs_volume *vol, struct hfs_inode *dir_inode, const char *name) {
+    unsigned int hash = name_hash(name);
+    struct hfs_dir_node *node = dir_node(vol, dir_inode->blocks[0]);
+
+    while (node->depth > 0) {
+        node = dir_node(vol, node_links(node)[node_find_link(node, hash)].block);
+    }
+
+    struct hfs_dentry *entries = leaf_entries(node);
+    for (int i = 0; i < node->count; i++) {
+        if (strcmp(entries[i].name, name) == 0) {
+            return entries[i].num;
+        }
+    }
+    return -ENOENT;
+}
+
+static int dir_linear_lookup(struct hfs_volume *vol, struct hfs_inode *dir_inode, const char *name) {
+    if (dir_inode->flags & HFS_INODE_INLINE) {
+        struct hfs_dentry *entries = inline_dentries(dir_inode);
+        for (int i = 0; i < INLINE_DENTRIES; i++) {
+            if (entries[i].name[0] != '\0' && strcmp(entries[i].name, name) == 0) {
+                return entries[i].num;
+            }
+        }
+        return -ENOENT;
+    }
+
+    for (int block_index = 0; block_index < N_BLOCKS; block_index++) {
+        if (dir_inode->blocks[block_index] == -1) continue;
+
+        // Iterate over all entries in the current block
+        struct hfs_dentry *entries = (struct hfs_dentry *)meta_block(vol, dir_inode->blocks[block_index]);
+        for (int i = 0; i < DENTRIES_PER_BLOCK; i++) {
+            if (entries[i].name[0] == '\0') continue;
+
+            if (strcmp(entries[i].name, name) == 0) {
+                return entries[i].num;
+            }
+        }
+    }
+    return -ENOENT;
+}
+
+// Scan the directory dir_inode for name
+static int dir_lookup(struct hfs_volume *vol, struct hfs_inode *dir_inode, const char *name) {
+    if (dir_inode->flags & HFS_INODE_DIR_INDEX) {
+        return dir_index_lookup(vol, dir_inode, name);
+    }
+    return dir_linear_lookup(vol, dir_inode, name);
+}
+
+static int cmp_dentry_hash(const void *a, const void *b) {
+    unsigned int ha = name_hash(((const struct hfs_dentry *)a)->name);
+    unsigned int hb = name_hash(((const struct hfs_dentry *)b)->name);
+    return (ha > hb) - (ha < hb);
+}
+
+// Split point for count entries sorted by hash: first index of a run of equal hashes closest to the middle
+static int leaf_split_point(struct hfs_dentry *sorted, int count) {
+    for (int delta = 0; delta < count / 2; delta++) {
+        int right = count / 2 + delta;
+        int left = count / 2 - delta;
+        if (right < count && name_hash(sorted[right].name) != name_hash(sorted[right - 1].name)) return right;
+        if (left > 0 && name_hash(sorted[left].name) != name_hash(sorted[left - 1].name)) return left;
+    }
+    return -1;
+}
+
+/*
+  Insert entry into the index tree of dir_inode.
+
+  Walks down to the leaf covering the entry's hash. If the leaf is full it is
+  split and the new link is pushed up, splitting index nodes as needed. The
+  root always stays in blocks[0]: when it overflows its contents move to a new
+  block and it becomes an index node one level deeper. Every block a split
+  could need is allocated before anything is modified, so -ENOSPC leaves the
+  tree untouched.
+*/
+static int dir_index_insert(struct hfs_volume *vol, struct hfs_inode *dir_inode, struct hfs_dentry *entry) {
+    unsigned int hash = name_hash(entry->name);
+    off_t path[DIR_MAX_DEPTH + 1];
+    int depth = 0;
+
+    path[0] = dir_inode->blocks[0];
+    struct hfs_dir_node *node = dir_node(vol, path[0]);
+    while (node->depth > 0) {
+        path[depth + 1] = node_links(node)[node_find_link(node, hash)].block;
+        node = dir_node(vol, path[++depth]);
+    }
+
+    // Fast path: room in the leaf
+    if (node->count < DIR_LEAF_CAP) {
+        leaf_entries(node)[node->count] = *entry;
+        node->count++;
+        sync_mirrors(vol, node, vol->block_size);
+        return SUCCESS;
+    }
+
+    if (depth >= DIR_MAX_DEPTH) return -ENOSPC;
+
+    // Scratch space for the split, sized by the mounted block size
+    struct hfs_dentry *sorted = malloc((DIR_LEAF_CAP + 1) * sizeof(struct hfs_dentry));
+    struct hfs_dir_link *all = malloc((DIR_NODE_CAP + 1) * sizeof(struct hfs_dir_link));
+    if (sorted == NULL || all == NULL) {
+        free(sorted);
+        free(all);
+        return -ENOMEM;
+    }
+
+    // Reserve a block for the leaf's sibling and each full index node above it, plus one to push
+    // the root down when the split reaches it. Spares are journaled whole, so don't take extra.
+    int needed = 1;
+    int full = depth - 1;
+    while (full >= 0 && dir_node(vol, path[full])->count >= DIR_NODE_CAP) full--;
+    needed += depth - 1 - full;
+    if (full < 0) needed++;
+
+    off_t spare[DIR_MAX_DEPTH + 2];
+    int num_spare = 0;
+    for (int i = 0; i < needed; i++) {
+        off_t block_num = alloc_meta_block(vol);
+        if (block_num < 0) {
+            pthread_mutex_lock(&vol->alloc_lock);
+            while (num_spare > 0) release_data_block(vol, spare[--num_spare]);
+            pthread_mutex_unlock(&vol->alloc_lock);
+            free(sorted);
+            free(all);
+            return -ENOSPC;
+        }
+        spare[num_spare++] = block_num;
+    }
+
+    // Split the leaf
+    memcpy(sorted, leaf_entries(node), DIR_LEAF_CAP * sizeof(struct hfs_dentry));
+    sorted[DIR_LEAF_CAP] = *entry;
+    qsort(sorted, DIR_LEAF_CAP + 1, sizeof(struct hfs_dentry), cmp_dentry_hash);
+
+    int split = leaf_split_point(sorted, DIR_LEAF_CAP + 1);
+    if (split < 0) {
+        // Every name in the leaf has the same hash
+        pthread_mutex_lock(&vol->alloc_lock);
+        while (num_spare > 0) release_data_block(vol, spare[--num_spare]);
+        pthread_mutex_unlock(&vol->alloc_lock);
+        free(sorted);
+        free(all);
+        return -ENOSPC;
+    }
+
+    off_t new_block = spare[--num_spare];
+    struct hfs_dir_node *sibling = dir_node(vol, new_block);
+    sibling->magic = HFS_DIR_MAGIC;
+    sibling->depth = 0;
+    sibling->count = DIR_LEAF_CAP + 1 - split;
+    memcpy(leaf_entries(sibling), sorted + split, sibling->count * sizeof(struct hfs_dentry));
+    node->count = split;
+    memset(leaf_entries(node), 0, DIR_LEAF_CAP * sizeof(struct hfs_dentry));
+    memcpy(leaf_entries(node), sorted, split * sizeof(struct hfs_dentry));
+    sync_mirrors(vol, node, vol->block_size);
+    sync_mirrors(vol, sibling, vol->block_size);
+
+    struct hfs_dir_link link = { .hash = name_hash(sorted[split].name), .block = new_block };
+
+    // Push the new link up until some index node has room for it
+    int level = depth - 1;
+    for (; level >= 0; level--) {
+        node = dir_node(vol, path[level]);
+        struct hfs_dir_link *links = node_links(node);
+        int pos = node_find_link(node, link.hash) + 1;
+
+        if (node->count < DIR_NODE_CAP) {
+            memmove(&links[pos + 1], &links[pos], (node->count - pos) * sizeof(struct hfs_dir_link));
+            links[pos] = link;
+            node->count++;
+            sync_mirrors(vol, node, vol->block_size);
+            break;
+        }
+
+        memcpy(all, links, pos * sizeof(struct hfs_dir_link));
+        all[pos] = link;
+        memcpy(&all[pos + 1], &links[pos], (node->count - pos) * sizeof(struct hfs_dir_link));
+
+        int half = (DIR_NODE_CAP + 1) / 2;
+        new_block = spare[--num_spare];
+        sibling = dir_node(vol, new_block);
+        sibling->magic = HFS_DIR_MAGIC;
+        sibling->depth = node->depth;
+        sibling->count = DIR_NODE_CAP + 1 - half;
+        memcpy(node_links(sibling), &all[half], sibling->count * sizeof(struct hfs_dir_link));
+        node->count = half;
+        memset(links, 0, DIR_NODE_CAP * sizeof(struct hfs_dir_link));
+        memcpy(links, all, half * sizeof(struct hfs_dir_link));
+        sync_mirrors(vol, node, vol->block_size);
+        sync_mirrors(vol, sibling, vol->block_size);
+
+        link.hash = all[half].hash;
+        link.block = new_block;
+    }
+
+    // The root itself split: move its left half out and grow the tree by one level
+    if (level < 0) {
+        struct hfs_dir_node *root = dir_node(vol, path[0]);
+        off_t left_block = spare[--num_spare];
+        memcpy(meta_block(vol, left_block), root, vol->block_size);
+        sync_mirrors(vol, meta_block(vol, left_block), vol->block_size);
+
+        uint16_t old_depth = root->depth;
+        memset(root, 0, vol->block_size);
+        root->magic = HFS_DIR_MAGIC;
+        root->depth = old_depth + 1;
+        root->count = 2;
+        node_links(root)[0].hash = 0;
+        node_links(root)[0].block = left_block;
+        node_links(root)[1] = link;
+        sync_mirrors(vol, root, vol->block_size);
+    }
+
+    pthread_mutex_lock(&vol->alloc_lock);
+    while (num_spare > 0) release_data_block(vol, spare[--num_spare]);
+    pthread_mutex_unlock(&vol->alloc_lock);
+    free(sorted);
+    free(all);
+    return SUCCESS;
+}
+
+// Caller holds alloc_lock
+static void dir_index_release(struct hfs_volume *vol, off_t block_num) {
+    struct hfs_dir_node *node = dir_node(vol, block_num);
+    if (node->depth > 0) {
+        for (int i = 0; i < node->count; i++) {
+            dir_index_release(vol, node_links(node)[i].block);
+        }
+    }
+    release_data_block(vol, block_num);
+}
+
+// Rebuild a flat directory as an index tree. Entry count, size and nlinks are unchanged.
+static int dir_convert_to_index(struct hfs_volume *vol, struct hfs_inode *dir_inode) {
+    TRACE(INFO, DIR_TO_INDEX, NULL, dir_inode->num);
+    off_t old_blocks[N_BLOCKS];
+    memcpy(old_blocks, dir_inode->blocks, sizeof(old_blocks));
+
+    off_t root = alloc_meta_block(vol);
+    if (root < 0) return -ENOSPC;
+    dir_node(vol, root)->magic = HFS_DIR_MAGIC;
+    sync_mirrors(vol, dir_node(vol, root), sizeof(struct hfs_dir_node));
+
+    struct hfs_inode indexed = *dir_inode;
+    indexed.flags |= HFS_INODE_DIR_INDEX;
+    for (int i = 0; i < N_BLOCKS; i++) {
+        indexed.blocks[i] = -1;
+    }
+    indexed.blocks[0] = root;
+
+    for (int block_index = 0; block_index < N_BLOCKS; block_index++) {
+        if (old_blocks[block_index] == -1) continue;
+
+        struct hfs_dentry *entries = (struct hfs_dentry *)meta_block(vol, old_blocks[block_index]);
+        for (int i = 0; i < DENTRIES_PER_BLOCK; i++) {
+            if (entries[i].name[0] == '\0') continue;
+
+            if (dir_index_insert(vol, &indexed, &entries[i]) < 0) {
+                pthread_mutex_lock(&vol->alloc_lock);
+                dir_index_release(vol, root);
+                pthread_mutex_unlock(&vol->alloc_lock);
+                return -ENOSPC;
+            }
+        }
+    }
+
+    memcpy(dir_inode, &indexed, sizeof(struct hfs_inode));
+    sync_mirrors(vol, dir_inode, sizeof(struct hfs_inode));
+
+    pthread_mutex_lock(&vol->alloc_lock);
+    for (int block_index = 0; block_index < N_BLOCKS; block_index++) {
+        if (old_blocks[block_index] != -1) {
+            release_data_block(vol, old_blocks[block_index]);
+        }
+    }
+    pthread_mutex_unlock(&vol->alloc_lock);
+    return SUCCESS;
+}
+
+// Move an inline directory's entries out to its first flat block
+static int dir_spill_inline(struct hfs_volume *vol, struct hfs_inode *dir_inode) {
+    off_t block_num = alloc_meta_block(vol);
+    if (block_num < 0) return -ENOSPC;
+
+    struct hfs_dentry *entries = (struct hfs_dentry *)meta_block(vol, block_num);
+    memcpy(entries, inline_dentries(dir_inode), INLINE_DENTRIES * sizeof(struct hfs_dentry));
+    sync_mirrors(vol, entries, INLINE_DENTRIES * sizeof(struct hfs_dentry));
+
+    memset(inline_data(dir_inode), 0, INLINE_CAP);
+    dir_inode->flags &= ~HFS_INODE_INLINE;
+    dir_inode->blocks[0] = block_num;
+    sync_mirrors(vol, dir_inode, vol->inode_size);
+    return SUCCESS;
+}
+
+static int dir_linear_insert(struct hfs_volume *vol, struct hfs_inode *dir_inode, struct hfs_dentry *entry) {
+    if (dir_inode->flags & HFS_INODE_INLINE) {
+        struct hfs_dentry *entries = inline_dentries(dir_inode);
+        for (int i = 0; i < INLINE_DENTRIES; i++) {
+            if (entries[i].name[0] == '\0') {
+                entries[i] = *entry;
+                sync_mirrors(vol, &entries[i], sizeof(struct hfs_dentry));
+                return SUCCESS;
+            }
+        }
+
+        int rc = dir_spill_inline(vol, dir_inode);
+        if (rc < 0) return rc;
+    }
+
+    // First free dentry in an allocated block
+    for (int block_index = 0; block_index < N_BLOCKS; block_index++) {
+        if (dir_inode->blocks[block_index] == -1) continue;
+
+        struct hfs_dentry *entries = (struct hfs_dentry *)meta_block(vol, dir_inode->blocks[block_index]);
+        for (int i = 0; i < DENTRIES_PER_BLOCK; i++) {
+            if (entries[i].name[0] == '\0') {
+                entries[i] = *entry;
+                sync_mirrors(vol, &entries[i], sizeof(struct hfs_dentry));
+                return SUCCESS;
+            }
+        }
+    }
+
+    // Empty directory: its first block
+    if (dir_inode->blocks[0] == -1) {
+        off_t block_num = alloc_meta_block(vol);
+        if (block_num < 0) return -ENOSPC;
+
+        struct hfs_dentry *entries = (struct hfs_dentry *)meta_block(vol, block_num);
+        entries[0] = *entry;
+        sync_mirrors(vol, entries, sizeof(struct hfs_dentry));
+        dir_inode->blocks[0] = block_num;
+        sync_mirrors(vol, dir_inode, sizeof(struct hfs_inode));
+        return SUCCESS;
+    }
+
+    // Out of room in the flat format
+    int rc = dir_convert_to_index(vol, dir_inode);
+    if (rc < 0) return rc;
+    return dir_index_insert(vol, dir_inode, entry);
+}
+
+// Add name -> child_idx to directory dir_idx and account for it in the parent inode
+static int dir_add_entry(struct hfs_volume *vol, int dir_idx, const char *name, int child_idx) {
+    struct hfs_inode *dir_inode = get_inode(vol, dir_idx);
+
+    struct hfs_dentry entry = {0};
+    strncpy(entry.name, name, MAX_NAME - 1);
+    entry.num = child_idx;
+
+    int rc;
+    if (dir_inode->flags & HFS_INODE_DIR_INDEX) {
+        rc = dir_index_insert(vol, dir_inode, &entry);
+    } else {
+        rc = dir_linear_insert(vol, dir_inode, &entry);
+    }
+    if (rc < 0) return rc;
+
+    dir_inode->nlinks++;
+    dir_inode->size += sizeof(struct hfs_dentry);
+    dir_inode->mtim = dir_inode->ctim = time(NULL);
+    sync_mirrors(vol, dir_inode, sizeof(struct hfs_inode));
+    return SUCCESS;
+}
+
+// Remove name from directory dir_idx. Emptied blocks stay with the directory.
+static int dir_remove_entry(struct hfs_volume *vol, int dir_idx, const char *name) {
+    struct hfs_inode *dir_inode = get_inode(vol, dir_idx);
+    bool removed = false;
+
+    if (dir_inode->flags & HFS_INODE_DIR_INDEX) {
+        unsigned int hash = name_hash(name);
+        struct hfs_dir_node *node = dir_node(vol, dir_inode->blocks[0]);
+        while (node->depth > 0) {
+            node = dir_node(vol, node_links(node)[node_find_link(node, hash)].block);
+        }
+
+        struct hfs_dentry *entries = leaf_entries(node);
+        for (int i = 0; i < node->count; i++) {
+            if (strcmp(entries[i].name, name) == 0) {
+                // Keep leaves dense: move the last entry into the hole
+                entries[i] = entries[node->count - 1];
+                memset(&entries[node->count - 1], 0, sizeof(struct hfs_dentry));
+                node->count--;
+                sync_mirrors(vol, node, vol->block_size);
+                removed = true;
+                break;
+            }
+        }
+    } else if (dir_inode->flags & HFS_INODE_INLINE) {
+        struct hfs_dentry *entries = inline_dentries(dir_inode);
+        for (int i = 0; i < INLINE_DENTRIES; i++) {
+            if (entries[i].name[0] != '\0' && strcmp(entries[i].name, name) == 0) {
+                memset(&entries[i], 0, sizeof(struct hfs_dentry));
+                sync_mirrors(vol, &entries[i], sizeof(struct hfs_dentry));
+                removed = true;
+                break;
+            }
+        }
+    } else {
+        for (int block_index = 0; block_index < N_BLOCKS && !removed; block_index++) {
+            if (dir_inode->blocks[block_index] == -1) continue;
+
+            struct hfs_dentry *entries = (struct hfs_dentry *)meta_block(vol, dir_inode->blocks[block_index]);
+            for (int i = 0; i < DENTRIES_PER_BLOCK; i++) {
+                if (entries[i].name[0] != '\0' && strcmp(entries[i].name, name) == 0) {
+                    memset(&entries[i], 0, sizeof(struct hfs_dentry));
+                    sync_mirrors(vol, &entries[i], sizeof(struct hfs_dentry));
+                    removed = true;
+                    break;
+                }
+            }
+        }
+    }
+
+    if (!removed) return -ENOENT;
+
+    dir_inode->nlinks--;
+    dir_inode->size -= sizeof(struct hfs_dentry);
+    dir_inode->mtim = dir_inode->ctim = time(NULL);
+    sync_mirrors(vol, dir_inode, sizeof(struct hfs_inode));
+    return SUCCESS;
+}
+
+typedef int (*dir_visit_t)(struct hfs_volume *vol, void *ctx, struct hfs_dentry *entry);
+
+static int dir_index_iterate(struct hfs_volume *vol, off_t block_num, dir_visit_t visit, void *ctx) {
+    struct hfs_dir_node *node = dir_node(vol, block_num);
+    if (node->depth > 0) {
+        for (int i = 0; i < node->count; i++) {
+            int rc = dir_index_iterate(vol, node_links(node)[i].block, visit, ctx);
+            if (rc != 0) return rc;
+        }
+        return 0;
+    }
+
+    struct hfs_dentry *entries = leaf_entries(node);
+    for (int i = 0; i < node->count; i++) {
+        int rc = visit(vol, ctx, &entries[i]);
+        if (rc != 0) return rc;
+    }
+    return 0;
+}
+
+// Call visit for every entry in the directory until it returns non-zero
+static int dir_iterate(struct hfs_volume *vol, struct hfs_inode *dir_inode, dir_visit_t visit, void *ctx) {
+    if (dir_inode->flags & HFS_INODE_DIR_INDEX) {
+        return dir_index_iterate(vol, dir_inode->blocks[0], visit, ctx);
+    }
+    if (dir_inode->flags & HFS_INODE_INLINE) {
+        struct hfs_dentry *entries = inline_dentries(dir_inode);
+        for (int i = 0; i < INLINE_DENTRIES; i++) {
+            if (entries[i].name[0] == '\0') continue;
+
+            int rc = visit(vol, ctx, &entries[i]);
+            if (rc != 0) return rc;
+        }
+        return 0;
+    }
+
+    for (int block_index = 0; block_index < N_BLOCKS; block_index++) {
+        if (dir_inode->blocks[block_index] == -1) continue;
+
+        struct hfs_dentry *entries = (struct hfs_dentry *)meta_block(vol, dir_inode->blocks[block_index]);
+        for (int i = 0; i < DENTRIES_PER_BLOCK; i++) {
+            if (entries[i].name[0] == '\0') continue;
+
+            int rc = visit(vol, ctx, &entries[i]);
+            if (rc != 0) return rc;
+        }
+    }
+    return 0;
+}
+
+static int visit_not_empty(struct hfs_volume *vol, void *ctx, struct hfs_dentry *entry) {
+    return strcmp(entry->name, ".") != 0 && strcmp(entry->name, "..") != 0;
+}
+
+static bool dir_is_empty(struct hfs_volume *vol, struct hfs_inode *dir_inode) {
+    return dir_iterate(vol, dir_inode, visit_not_empty, NULL) == 0;
+}
+
+/*
+  File data and extents
+
+  Regular files created by this version map their data with extents (see
+  hfs.h). Files from older images still use blocks[] with a single indirect
+  block; they are read in place and converted to extents the first time a
+  write needs to allocate. Extent tree blocks are metadata blocks.
+*/
+#define EXTENT_NODE_CAP    ((int)(vol->block_size / sizeof(struct hfs_extent)) - 1)
+#define LEGACY_IND_ENTRIES (sizeof(struct hfs_ind_block) / sizeof(off_t))
+#define MAX_FILE_BLOCKS    ((off_t)UINT32_MAX)
+
+struct extent_list {
+    struct hfs_extent *ext;
+    int count;
+    int cap;
+};
+
+struct block_list {
+    off_t *blocks;
+    int count;
+    int cap;
+};
+
+static struct hfs_extent_node *extent_node(struct hfs_volume *vol, off_t block_num) {
+    return (struct hfs_extent_node *)meta_block(vol, block_num);
+}
+
+static struct hfs_extent *node_extents(struct hfs_extent_node *node) {
+    return (struct hfs_extent *)node + 1;
+}
+
+// Copy len bytes out of the file data that starts offset bytes into block_num. The range may cover several contiguous blocks.
+static int data_read(struct hfs_volume *vol, off_t block_num, size_t offset, char *buf, size_t len) {
+    return data_io(vol, block_num, offset, buf, NULL, len, false);
+}
+
+// Counterpart of data_read for inode_idx's data; a NULL buf writes zeroes
+static int data_write(struct hfs_volume *vol, int inode_idx, off_t block_num, size_t offset, const char *buf, size_t len) {
+    int rc = data_io(vol, block_num, offset, NULL, buf, len, true);
+    dirty_mark_data(vol, inode_idx, block_num, offset, len);
+    return rc;
+}
+
+static struct hfs_ind_block *legacy_ind_block(struct hfs_volume *vol, struct hfs_inode *inode) {
+    return (struct hfs_ind_block *)meta_block(vol, inode->blocks[IND_BLOCK]);
+}
+
+// blocks[] mapping of files written before extents
+static off_t legacy_map(struct hfs_volume *vol, struct hfs_inode *inode, off_t lblk) {
+    if (lblk < D_BLOCK) {
+        return inode->blocks[lblk];
+    }
+    if (lblk < D_BLOCK + LEGACY_IND_ENTRIES && inode->blocks[IND_BLOCK] != -1) {
+        return legacy_ind_block(vol, inode)->blocks[lblk - D_BLOCK];
+    }
+    return -1;
+}
+
+// Last entry whose lblk <= lblk, or -1
+static int extent_search(struct hfs_extent *ext, int count, off_t lblk) {
+    int lo = 0, hi = count - 1, found = -1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (ext[mid].lblk <= lblk) {
+            found = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return found;
+}
+
+/*
+  Map file block lblk to a data block, or -1 for a hole. *run is set to the
+  number of blocks from lblk on that continue the same way: contiguous data
+  blocks, or more hole.
+*/
+static off_t extent_map(struct hfs_volume *vol, struct hfs_inode *inode, off_t lblk, off_t *run) {
+    if (!(inode->flags & HFS_INODE_EXTENTS)) {
+        *run = 1;
+        return legacy_map(vol, inode, lblk);
+    }
+
+    struct hfs_extent *ext = inode->extents;
+    int count = inode->ext_count;
+    int depth = inode->ext_depth;
+    off_t bound = MAX_FILE_BLOCKS;
+
+    while (depth > 0) {
+        int i = extent_search(ext, count, lblk);
+        if (i < 0) i = 0;
+        if (i + 1 < count) bound = ext[i + 1].lblk;
+
+        struct hfs_extent_node *node = extent_node(vol, ext[i].pblk);
+        ext = node_extents(node);
+        count = node->count;
+        depth = node->depth;
+    }
+
+    int i = extent_search(ext, count, lblk);
+    if (i >= 0 && lblk < (off_t)ext[i].lblk + ext[i].len) {
+        *run = ext[i].lblk + ext[i].len - lblk;
+        return ext[i].pblk + (lblk - ext[i].lblk);
+    }
+
+    off_t next = (i + 1 < count) ? ext[i + 1].lblk : bound;
+    *run = next - lblk;
+    return -1;
+}
+
+static int block_list_push(struct block_list *list, off_t block_num) {
+    if (list->count == list->cap) {
+        int cap = list->cap ? list->cap * 2 : 16;
+        off_t *blocks = realloc(list->blocks, cap * sizeof(off_t));
+        if (blocks == NULL) return -ENOMEM;
+        list->blocks = blocks;
+        list->cap = cap;
+    }
+    list->blocks[list->count++] = block_num;
+    return SUCCESS;
+}
+
+// Insert e, keeping the list sorted and merging with neighbours that continue it
+static int extent_list_insert(struct extent_list *list, struct hfs_extent e) {
+    int pos = extent_search(list->ext, list->count, e.lblk) + 1;
+
+    if (pos > 0) {
+        struct hfs_extent *prev = &list->ext[pos - 1];
+        if (prev->lblk + prev->len == e.lblk && prev->pblk + prev->len == e.pblk && (uint64_t)prev->len + e.len <= UINT32_MAX) {
+            prev->len += e.len;
+            if (pos < list->count) {
+                struct hfs_extent *next = &list->ext[pos];
+                if (prev->lblk + prev->len == next->lblk && prev->pblk + prev->len == next->pblk && (uint64_t)prev->len + next->len <= UINT32_MAX) {
+                    prev->len += next->len;
+                    memmove(next, next + 1, (list->count - pos - 1) * sizeof(struct hfs_extent));
+                    list->count--;
+                }
+            }
+            return SUCCESS;
+        }
+    }
+    if (pos < list->count) {
+        struct hfs_extent *next = &list->ext[pos];
+        if (e.lblk + e.len == next->lblk && e.pblk + e.len == next->pblk && (uint64_t)e.len + next->len <= UINT32_MAX) {
+            next->lblk = e.lblk;
+            next->pblk = e.pblk;
+            next->len += e.len;
+            return SUCCESS;
+        }
+    }
+
+    if (list->count == list->cap) {
+        int cap = list->cap ? list->cap * 2 : 16;
+        struct hfs_extent *ext = realloc(list->ext, cap * sizeof(struct hfs_extent));
+        if (ext == NULL) return -ENOMEM;
+        list->ext = ext;
+        list->cap = cap;
+    }
+    memmove(&list->ext[pos + 1], &list->ext[pos], (list->count - pos) * sizeof(struct hfs_extent));
+    list->ext[pos] = e;
+    list->count++;
+    return SUCCESS;
+}
+
+static int extent_collect(struct hfs_volume *vol, struct hfs_extent *ext, int count, int depth, struct extent_list *list, struct block_list *tree) {
+    for (int i = 0; i < count; i++) {
+        if (depth == 0) {
+            int rc = extent_list_insert(list, ext[i]);
+            if (rc < 0) return rc;
+            continue;
+        }
+
+        struct hfs_extent_node *node = extent_node(vol, ext[i].pblk);
+        int rc = block_list_push(tree, ext[i].pblk);
+        if (rc < 0) return rc;
+        rc = extent_collect(vol, node_extents(node), node->count, node->depth, list, tree);
+        if (rc < 0) return rc;
+    }
+    return SUCCESS;
+}
+
+// Flatten the inode's mapping (extents or legacy blocks[]) into a sorted list plus the tree blocks that held it
+static int extent_load(struct hfs_volume *vol, struct hfs_inode *inode, struct extent_list *list, struct block_list *tree) {
+    if (inode->flags & HFS_INODE_EXTENTS) {
+        return extent_collect(vol, inode->extents, inode->ext_count, inode->ext_depth, list, tree);
+    }
+
+    int num_blocks = D_BLOCK + (inode->blocks[IND_BLOCK] != -1 ? LEGACY_IND_ENTRIES : 0);
+    for (int lblk = 0; lblk < num_blocks; lblk++) {
+        off_t block_num = legacy_map(vol, inode, lblk);
+        if (block_num == -1) continue;
+
+        struct hfs_extent e = { .lblk = lblk, .len = 1, .pblk = block_num };
+        int rc = extent_list_insert(list, e);
+        if (rc < 0) return rc;
+    }
+    if (inode->blocks[IND_BLOCK] != -1) {
+        return block_list_push(tree, inode->blocks[IND_BLOCK]);
+    }
+    return SUCCESS;
+}
+
+/*
+  Write list out as the inode's extent tree. Tree blocks in old_tree are
+  reused first; the rest are allocated before anything is written so that
+  -ENOSPC leaves the inode as it was. Unused old blocks are freed. The caller
+  syncs the inode.
+*/
+static int extent_store(struct hfs_volume *vol, struct hfs_inode *inode, struct extent_list *list, struct block_list *old_tree) {
+    int needed = 0;
+    int depth = 0;
+    for (int n = list->count; n > HFS_ROOT_EXTENTS; depth++) {
+        n = (n + EXTENT_NODE_CAP - 1) / EXTENT_NODE_CAP;
+        needed += n;
+    }
+
+    struct hfs_extent *level = list->ext;
+    struct hfs_extent *next_level = NULL;
+    int n = list->count;
+    int used = 0;
+    if (depth > 0) {
+        next_level = malloc(((n + EXTENT_NODE_CAP - 1) / EXTENT_NODE_CAP) * sizeof(struct hfs_extent));
+        if (next_level == NULL) return -ENOMEM;
+    }
+
+    // The blocks of the current tree come first; on failure only the ones added here go back
+    int reused = old_tree->count;
+    while (old_tree->count < needed) {
+        off_t block_num = alloc_meta_block(vol);
+        if (block_num < 0 || block_list_push(old_tree, block_num) < 0) {
+            pthread_mutex_lock(&vol->alloc_lock);
+            if (block_num >= 0) release_data_block(vol, block_num);
+            for (int i = reused; i < old_tree->count; i++) {
+                release_data_block(vol, old_tree->blocks[i]);
+            }
+            pthread_mutex_unlock(&vol->alloc_lock);
+            old_tree->count = reused;
+            free(next_level);
+            return -ENOSPC;
+        }
+    }
+
+    for (int d = 0; d < depth; d++) {
+        int num_nodes = (n + EXTENT_NODE_CAP - 1) / EXTENT_NODE_CAP;
+        for (int b = 0; b < num_nodes; b++) {
+            off_t block_num = old_tree->blocks[used++];
+            struct hfs_extent_node *node = extent_node(vol, block_num);
+            int first = b * EXTENT_NODE_CAP;
+            int count = n - first < EXTENT_NODE_CAP ? n - first : EXTENT_NODE_CAP;
+
+            memset(node, 0, vol->block_size);
+            node->magic = HFS_EXTENT_MAGIC;
+            node->depth = d;
+            node->count = count;
+            memcpy(node_extents(node), &level[first], count * sizeof(struct hfs_extent));
+            sync_mirrors(vol, node, vol->block_size);
+
+            struct hfs_extent link = { .lblk = level[first].lblk, .len = 0, .pblk = block_num };
+            next_level[b] = link;
+        }
+        // next_level has fewer entries than level, so compacting in place is safe from here on
+        level = next_level;
+        n = num_nodes;
+    }
+
+    memset(inode->extents, 0, sizeof(inode->extents));
+    memcpy(inode->extents, level, n * sizeof(struct hfs_extent));
+    inode->ext_count = n;
+    inode->ext_depth = depth;
+    inode->flags |= HFS_INODE_EXTENTS;
+    free(next_level);
+
+    if (used < old_tree->count) {
+        pthread_mutex_lock(&vol->alloc_lock);
+        for (int i = used; i < old_tree->count; i++) {
+            release_data_block(vol, old_tree->blocks[i]);
+        }
+        pthread_mutex_unlock(&vol->alloc_lock);
+    }
+    return SUCCESS;
+}
+
+/*
+  Make sure every block in [first, first + count) is mapped, allocating
+  each hole from the first free run near the hint that covers it, or the
+  longest one there. New blocks are
+  zeroed except where skip_offset/skip_len (the bytes about to be written)
+  cover them. All or nothing: on failure new blocks are handed back.
+*/
+static int extent_fill_holes(struct hfs_volume *vol, struct hfs_inode *inode, off_t first, off_t count, off_t skip_offset, size_t skip_len) {
+    bool has_hole = false;
+    for (off_t lblk = first; lblk < first + count; ) {
+        off_t run;
+        if (extent_map(vol, inode, lblk, &run) < 0) {
+            has_hole = true;
+            break;
+        }
+        lblk += run;
+    }
+    if (!has_hole) return SUCCESS;
+
+    struct extent_list list = {0};
+    struct block_list tree = {0};
+    struct extent_list added = {0};
+    int rc = extent_load(vol, inode, &list, &tree);
+
+    for (off_t lblk = first; rc == SUCCESS && lblk < first + count; ) {
+        off_t run;
+        if (extent_map(vol, inode, lblk, &run) >= 0) {
+            lblk += run;
+            continue;
+        }
+        if (run > first + count - lblk) run = first + count - lblk;
+
+        size_t got;
+        long block_num = allocate_data_blocks(vol, run, &got);
+        if (block_num < 0) {
+            rc = -ENOSPC;
+            break;
+        }
+
+        struct hfs_extent e = { .lblk = lblk, .len = got, .pblk = block_num };
+        rc = extent_list_insert(&added, e);
+        if (rc == SUCCESS) rc = extent_list_insert(&list, e);
+
+        // Zero whatever part of the new blocks the caller won't overwrite
+        off_t start = lblk * vol->block_size;
+        off_t end = (lblk + got) * vol->block_size;
+        off_t skip_end = skip_offset + skip_len;
+        if (rc == SUCCESS && start < skip_offset) {
+            rc = data_write(vol, inode->num, block_num, 0, NULL, (skip_offset < end ? skip_offset : end) - start);
+        }
+        if (rc == SUCCESS && end > skip_end) {
+            off_t zero_from = skip_end > start ? skip_end : start;
+            rc = data_write(vol, inode->num, block_num, zero_from - start, NULL, end - zero_from);
+        }
+        lblk += got;
+    }
+
+    if (rc == SUCCESS) {
+        rc = extent_store(vol, inode, &list, &tree);
+    }
+    if (rc != SUCCESS) {
+        pthread_mutex_lock(&vol->alloc_lock);
+        for (int i = 0; i < added.count; i++) {
+            release_data_blocks(vol, added.ext[i].pblk, added.ext[i].len);
+        }
+        pthread_mutex_unlock(&vol->alloc_lock);
+    }
+
+    free(list.ext);
+    free(tree.blocks);
+    free(added.ext);
+    return rc;
+}
+
+// Append the parts of list outside [first, first + count) to kept and the parts inside to cut (may be NULL)
+static int extent_list_cut(struct extent_list *list, off_t first, off_t count, struct extent_list *kept, struct extent_list *cut) {
+    off_t end = first + count;
+    int rc = SUCCESS;
+    for (int i = 0; rc == SUCCESS && i < list->count; i++) {
+        struct hfs_extent e = list->ext[i];
+        off_t e_end = (off_t)e.lblk + e.len;
+        if (e_end <= first || e.lblk >= end) {
+            rc = extent_list_insert(kept, e);
+            continue;
+        }
+
+        off_t cut_from = e.lblk > first ? e.lblk : first;
+        off_t cut_to = e_end < end ? e_end : end;
+        if (e.lblk < cut_from) {
+            struct hfs_extent head = { .lblk = e.lblk, .len = cut_from - e.lblk, .pblk = e.pblk };
+            rc = extent_list_insert(kept, head);
+        }
+        if (rc == SUCCESS && cut_to < e_end) {
+            struct hfs_extent tail = { .lblk = cut_to, .len = e_end - cut_to, .pblk = e.pblk + (cut_to - e.lblk) };
+            rc = extent_list_insert(kept, tail);
+        }
+        if (rc == SUCCESS && cut) {
+            struct hfs_extent gone = { .lblk = cut_from, .len = cut_to - cut_from, .pblk = e.pblk + (cut_from - e.lblk) };
+            rc = extent_list_insert(cut, gone);
+        }
+    }
+    return rc;
+}
+
+/*
+  Unmap [first, first + count) and free the data blocks behind it. Extents
+  that straddle an edge are split. All or nothing, like extent_fill_holes:
+  blocks are only freed once the new mapping is stored. Bumps the inode's
+  map generation, since cached runs may point at the freed blocks.
+*/
+static int extent_punch(struct hfs_volume *vol, struct hfs_inode *inode, off_t first, off_t count) {
+    off_t end = first + count;
+    // Legacy files map a block at a time, too slowly to scan to the end of a file
+    bool mapped = !(inode->flags & HFS_INODE_EXTENTS);
+    for (off_t lblk = first; !mapped && lblk < end; ) {
+        off_t run;
+        if (extent_map(vol, inode, lblk, &run) >= 0) {
+            mapped = true;
+            break;
+        }
+        lblk += run;
+    }
+    if (!mapped) return SUCCESS;
+
+    struct extent_list list = {0};
+    struct block_list tree = {0};
+    struct extent_list kept = {0};
+    struct extent_list freed = {0};
+    int rc = extent_load(vol, inode, &list, &tree);
+    if (rc == SUCCESS) {
+        rc = extent_list_cut(&list, first, count, &kept, &freed);
+    }
+    if (rc == SUCCESS) {
+        rc = extent_store(vol, inode, &kept, &tree);
+    }
+    if (rc == SUCCESS) {
+        pthread_mutex_lock(&vol->alloc_lock);
+        for (int i = 0; i < freed.count; i++) {
+            release_data_blocks(vol, freed.ext[i].pblk, freed.ext[i].len);
+        }
+        pthread_mutex_unlock(&vol->alloc_lock);
+        vol->inode_map_gens[inode->num]++;
+    }
+
+    free(list.ext);
+    free(tree.blocks);
+    free(kept.ext);
+    free(freed.ext);
+    return rc;
+}
+
+/*
+  Give the file its own copy of every shared block in [first, first + count),
+  ahead of a write. The old contents are copied except where
+  skip_offset/skip_len (the bytes about to be written) cover them, and the
+  file's claim on the shared block is dropped. All or nothing, like
+  extent_fill_holes.
+*/
+static int extent_unshare(struct hfs_volume *vol, struct hfs_inode *inode, off_t first, off_t count, off_t skip_offset, size_t skip_len) {
+    if (!(inode->flags & HFS_INODE_SHARED)) return SUCCESS;
+
+    struct extent_list shared = {0};
+    int rc = SUCCESS;
+    off_t end = first + count;
+    pthread_mutex_lock(&vol->alloc_lock);
+    for (off_t lblk = first; rc == SUCCESS && lblk < end; ) {
+        off_t run;
+        off_t block_num = extent_map(vol, inode, lblk, &run);
+        if (run > end - lblk) run = end - lblk;
+        for (off_t i = 0; block_num >= 0 && rc == SUCCESS && i < run; i++) {
+            if (block_extra_refs(vol, block_num + i) == 0) continue;
+            struct hfs_extent e = { .lblk = lblk + i, .len = 1, .pblk = block_num + i };
+            rc = extent_list_insert(&shared, e);
+        }
+        lblk += run;
+    }
+    pthread_mutex_unlock(&vol->alloc_lock);
+    if (rc < 0 || shared.count == 0) {
+        free(shared.ext);
+        return rc;
+    }
+
+    struct extent_list list = {0};
+    struct block_list tree = {0};
+    struct extent_list added = {0};
+    off_t skip_end = skip_offset + skip_len;
+    char *buf = malloc(vol->block_size);
+    rc = buf ? extent_load(vol, inode, &list, &tree) : -ENOMEM;
+
+    for (int i = 0; rc == SUCCESS && i < shared.count; i++) {
+        struct hfs_extent old = shared.ext[i];
+        for (off_t done = 0; rc == SUCCESS && done < old.len; ) {
+            size_t got;
+            long block_num = allocate_data_blocks(vol, old.len - done, &got);
+            if (block_num < 0) {
+                rc = -ENOSPC;
+                break;
+            }
+            struct hfs_extent e = { .lblk = old.lblk + done, .len = got, .pblk = block_num };
+            rc = extent_list_insert(&added, e);
+
+            // Up to two pieces of each block lie outside the write
+            for (off_t b = 0; rc == SUCCESS && b < (off_t)got; b++) {
+                off_t start = (e.lblk + b) * vol->block_size;
+                off_t stop = start + vol->block_size;
+                off_t pieces[2][2] = {
+                    { start, skip_offset < stop ? skip_offset : stop },
+                    { skip_end > start ? skip_end : start, stop },
+                };
+                for (int p = 0; rc == SUCCESS && p < 2; p++) {
+                    size_t len = pieces[p][1] > pieces[p][0] ? pieces[p][1] - pieces[p][0] : 0;
+                    if (len == 0) continue;
+                    rc = data_read(vol, old.pblk + done + b, pieces[p][0] - start, buf, len);
+                    if (rc == SUCCESS) rc = data_write(vol, inode->num, block_num + b, pieces[p][0] - start, buf, len);
+                }
+            }
+
+            struct extent_list next = {0};
+            if (rc == SUCCESS) rc = extent_list_cut(&list, e.lblk, e.len, &next, NULL);
+            if (rc == SUCCESS) rc = extent_list_insert(&next, e);
+            free(list.ext);
+            list = next;
+            done += got;
+        }
+    }
+
+    if (rc == SUCCESS) {
+        rc = extent_store(vol, inode, &list, &tree);
+    }
+    pthread_mutex_lock(&vol->alloc_lock);
+    struct extent_list *dropped = rc == SUCCESS ? &shared : &added;
+    for (int i = 0; i < dropped->count; i++) {
+        release_data_blocks(vol, dropped->ext[i].pblk, dropped->ext[i].len);
+    }
+    pthread_mutex_unlock(&vol->alloc_lock);
+    if (rc == SUCCESS) vol->inode_map_gens[inode->num]++;
+
+    free(buf);
+    free(list.ext);
+    free(tree.blocks);
+    free(shared.ext);
+    free(added.ext);
+    return rc;
+}
+
+// Caller holds alloc_lock
+static void extent_release(struct hfs_volume *vol, struct hfs_extent *ext, int count, int depth) {
+    for (int i = 0; i < count; i++) {
+        if (depth == 0) {
+            release_data_blocks(vol, ext[i].pblk, ext[i].len);
+            continue;
+        }
+
+        struct hfs_extent_node *node = extent_node(vol, ext[i].pblk);
+        extent_release(vol, node_extents(node), node->count, node->depth);
+        release_data_block(vol, ext[i].pblk);
+    }
+}
+
+// Caller holds alloc_lock. Frees every block the inode owns: data, indirect or extent tree blocks, directory blocks.
+// Inline inodes own none.
+static void release_inode_blocks(struct hfs_volume *vol, struct hfs_inode *inode) {
+    vol->inode_map_gens[inode->num]++;
+    if (inode->flags & HFS_INODE_INLINE) return;
+    if (S_ISDIR(inode->mode) && (inode->flags & HFS_INODE_DIR_INDEX)) {
+        dir_index_release(vol, inode->blocks[0]);
+        return;
+    }
+    if (inode->flags & HFS_INODE_EXTENTS) {
+        extent_release(vol, inode->extents, inode->ext_count, inode->ext_depth);
+        return;
+    }
+
+    for (int block_idx = 0; block_idx < N_BLOCKS; block_idx++) {
+        if (inode->blocks[block_idx] == -1) continue;
+
+        if (block_idx == IND_BLOCK && S_ISREG(inode->mode)) {
+            struct hfs_ind_block *ind_block = legacy_ind_block(vol, inode);
+            for (int i = 0; i < LEGACY_IND_ENTRIES; i++) {
+                if (ind_block->blocks[i] != -1) {
+                    release_data_block(vol, ind_block->blocks[i]);
+                }
+            }
+        }
+        release_data_block(vol, inode->blocks[block_idx]);
+    }
+}
+
+// Count the owners of every block the marked files map (see block_refs). Runs at mount, before any other thread.
+static int block_refs_init(struct hfs_volume *vol) {
+    size_t num_groups = (vol->total_data_blocks + ALLOC_GROUP_BITS - 1) / ALLOC_GROUP_BITS;
+    vol->block_refs = calloc(num_groups ? num_groups : 1, sizeof(uint32_t *));
+    vol->shared_blocks = 0;
+    if (vol->block_refs == NULL) return FAIL;
+    atomic_store(&vol->volume_shared, get_inode(vol, 0)->flags & HFS_INODE_SHARED);
+    if (!atomic_load(&vol->volume_shared)) return SUCCESS;
+
+    for (size_t idx = 0; idx < vol->superblock->num_inodes; idx++) {
+        if (!((bitmap_word(vol, &vol->inode_alloc, idx / 64) >> (idx % 64)) & 1)) continue;
+        struct hfs_inode *inode = get_inode(vol, idx);
+        if (!S_ISREG(inode->mode) || (inode->flags & (HFS_INODE_SHARED | HFS_INODE_INLINE)) != HFS_INODE_SHARED) continue;
+
+        struct extent_list list = {0};
+        struct block_list tree = {0};
+        int rc = extent_load(vol, inode, &list, &tree);
+        for (int i = 0; rc == SUCCESS && i < list.count; i++) {
+            struct hfs_extent e = list.ext[i];
+            rc = block_refs_reserve(vol, e.pblk, e.len);
+            for (off_t b = e.pblk; rc == SUCCESS && b < (off_t)e.pblk + e.len; b++) {
+                vol->block_refs[b / ALLOC_GROUP_BITS][b % ALLOC_GROUP_BITS]++;
+            }
+        }
+        free(list.ext);
+        free(tree.blocks);
+        if (rc < 0) return FAIL;
+    }
+
+    // Owners to owners beyond the first
+    for (size_t g = 0; g < num_groups; g++) {
+        for (size_t i = 0; vol->block_refs[g] && i < ALLOC_GROUP_BITS; i++) {
+            if (vol->block_refs[g][i] > 0 && --vol->block_refs[g][i] > 0) vol->shared_blocks++;
+        }
+    }
+    return SUCCESS;
+}
+
+static void block_refs_free(struct hfs_volume *vol) {
+    size_t num_groups = (vol->total_data_blocks + ALLOC_GROUP_BITS - 1) / ALLOC_GROUP_BITS;
+    for (size_t g = 0; vol->block_refs && g < num_groups; g++) {
+        free(vol->block_refs[g]);
+    }
+    free(vol->block_refs);
+    vol->block_refs = NULL;
+    vol->shared_blocks = 0;
+}
+
+/*
+  Metadata journal
+
+  Images from mkfs have a journal region on every disk (journal_ptr,
+  journal_size). While it is in use, sync_mirrors() only logs the changed
+  range; disks[0] is the only copy that changes while operations run. RAID 0
+  directory and extent tree blocks have a single copy, so they are changed
+  in stage_maps instead: a MAP_PRIVATE mapping of each disk, whose pages are
+  copied on the first write and never reach the image (Linux shows pages not
+  yet written the image's current contents). Every JOURNAL_INTERVAL_MS, or
+  sooner once enough has piled up, the committer thread takes journal_lock
+  for write, so no operation is half done, and commits everything logged
+  since the last commit as one group:
+
+    0. blocks released since the last commit are freed now, so their bitmap
+       bits are in the group. Until it commits, the committed metadata may
+       still point at them, and holding journal_lock keeps anyone from
+       reusing them for new metadata or file data before then.
+    1. the ranges are sorted, merged and copied with a header holding a
+       sequence number and CRC32C into the journal on every disk, followed
+       by a single msync of each journal (the commit point)
+    2. the ranges are copied to the mirrors, or from stage_maps to their
+       disk, and flushed in place (checkpoint)
+
+  Mirrors and RAID 0 metadata blocks therefore only ever hold committed
+  state. At mount the newest group with a good CRC is replayed onto every
+  disk. If the volume was not unmounted cleanly, disks[0] may also hold
+  uncommitted changes, so its head and, in the mirrored modes, every
+  directory and extent tree block are then copied back from disks[1].
+
+  File data is not journaled. Operations commit the group themselves before
+  starting once it is half the journal's size, so a group only outgrows the
+  journal when one operation logs more than the other half. Such a group,
+  and a change that could not be logged for lack of memory, goes straight
+  in place: the journal header is cleared first so the previous group can't
+  be replayed over it, and the next sync fails with EIO since the change
+  was not atomic. They also commit first once the blocks held for step 0
+  outnumber the free ones, or a burst of rewrites on a nearly full volume
+  would fail with ENOSPC while half of it waits to be freed.
+*/
+#ifndef JOURNAL_INTERVAL_MS
+#define JOURNAL_INTERVAL_MS 5
+#endif
+
+struct journal_range {
+    int disk;
+    off_t offset;
+    size_t len;
+};
+
+struct journal_free {
+    off_t block_num;
+    size_t count;
+};
+
+
+static size_t journal_capacity(struct hfs_volume *vol) {
+    return vol->superblock->journal_size - vol->block_size;
+}
+
+static struct hfs_journal_header *journal_header(struct hfs_volume *vol, int disk) {
+    return (struct hfs_journal_header *)(vol->disks[disk] + vol->superblock->journal_ptr);
+}
+
+static char *journal_records(struct hfs_volume *vol, int disk) {
+    return vol->disks[disk] + vol->superblock->journal_ptr + vol->block_size;
+}
+
+// Write a disk range back to its image and wait for it
+static void flush_range(struct hfs_volume *vol, int disk, off_t offset, size_t len) {
+    long page = sysconf(_SC_PAGESIZE);
+    off_t start = offset & ~(off_t)(page - 1);
+    msync(vol->disks[disk] + start, len + (offset - start), MS_SYNC);
+}
+
+// Ranges in the data region of RAID 0 have one copy; everything else is on every disk
+static bool range_mirrored(struct hfs_volume *vol, off_t offset) {
+    return vol->superblock->mode != 0 || offset < vol->superblock->d_blocks_ptr;
+}
+
+// Disk whose image addr is in, or -1; *staged tells whether it is in the disk's stage map
+static int journal_locate(struct hfs_volume *vol, void *addr, bool *staged) {
+    for (int disk = 0; disk < vol->num_disks; disk++) {
+        if ((char *)addr >= vol->disks[disk] && (char *)addr < vol->disks[disk] + vol->diskSizes[disk]) {
+            *staged = false;
+            return disk;
+        }
+        if (vol->stage_maps[disk] != NULL && (char *)addr >= vol->stage_maps[disk] && (char *)addr < vol->stage_maps[disk] + vol->diskSizes[disk]) {
+            *staged = true;
+            return disk;
+        }
+    }
+    return -1;
+}
+
+// Where the current contents of a logged range are
+static char *journal_source(struct hfs_volume *vol, int disk, off_t offset) {
+    if (vol->stage_maps[disk] != NULL && !range_mirrored(vol, offset)) {
+        return vol->stage_maps[disk] + offset;
+    }
+    return vol->disks[disk] + offset;
+}
+
+// Forget the last group before changes go in place without one; replaying it would undo them
+static void journal_invalidate(struct hfs_volume *vol) {
+    for (int disk = 0; disk < vol->num_disks; disk++) {
+        journal_header(vol, disk)->seq = 0;
+        flush_range(vol, disk, vol->superblock->journal_ptr, sizeof(struct hfs_journal_header));
+    }
+    atomic_store(&vol->journal_error, -EIO);
+}
+
+// A change that could not be logged: copy a staged range to its disk now, returning where it went
+static char *stage_home(struct hfs_volume *vol, void *addr, size_t len) {
+    bool staged;
+    int disk = journal_locate(vol, addr, &staged);
+    if (disk < 0 || !staged) return addr;
+
+    char *home = vol->disks[disk] + ((char *)addr - vol->stage_maps[disk]);
+    memcpy(home, addr, len);
+    return home;
+}
+
+// Log a change for the next commit. Returns false when there is no journal to log it in.
+static bool journal_record(struct hfs_volume *vol, void *addr, size_t len) {
+    if (!vol->journal_enabled) return false;
+
+    bool staged;
+    int disk = journal_locate(vol, addr, &staged);
+    if (disk < 0) return false;
+    char *base = staged ? vol->stage_maps[disk] : vol->disks[disk];
+
+    pthread_mutex_lock(&vol->journal_mutex);
+    if (vol->journal_count == vol->journal_cap) {
+        size_t cap = vol->journal_cap ? vol->journal_cap * 2 : 256;
+        struct journal_range *ranges = realloc(vol->journal_ranges, cap * sizeof(struct journal_range));
+        if (ranges == NULL) {
+            fprintf(stderr, "journal: out of memory, writing a change through\n");
+            journal_invalidate(vol);
+            pthread_mutex_unlock(&vol->journal_mutex);
+            return false;
+        }
+        vol->journal_ranges = ranges;
+        vol->journal_cap = cap;
+    }
+    vol->journal_ranges[vol->journal_count++] = (struct journal_range){disk, (char *)addr - base, len};
+    vol->journal_pending += len + sizeof(struct hfs_journal_record);
+    if (vol->journal_pending > journal_capacity(vol) / 2) {
+        pthread_cond_signal(&vol->journal_cond);
+    }
+    pthread_mutex_unlock(&vol->journal_mutex);
+    return true;
+}
+
+// Caller holds alloc_lock. Hold released blocks until the next commit. Returns false when they can be freed now.
+static bool journal_defer_free(struct hfs_volume *vol, off_t block_num, size_t count) {
+    if (!vol->journal_enabled) return false;
+
+    pthread_mutex_lock(&vol->journal_mutex);
+    if (vol->journal_free_count == vol->journal_free_cap) {
+        size_t cap = vol->journal_free_cap ? vol->journal_free_cap * 2 : 64;
+        struct journal_free *frees = realloc(vol->journal_frees, cap * sizeof(struct journal_free));
+        if (frees == NULL) {
+            pthread_mutex_unlock(&vol->journal_mutex);
+            return false;
+        }
+        vol->journal_frees = frees;
+        vol->journal_free_cap = cap;
+    }
+    vol->journal_frees[vol->journal_free_count++] = (struct journal_free){block_num, count};
+    // Rewrites free as fast as they allocate, so the held blocks can starve the allocator between commits
+    vol->journal_free_blocks += count;
+    if (!vol->journal_free_short && vol->journal_free_blocks > vol->data_alloc.free) {
+        vol->journal_free_short = true;
+        pthread_cond_signal(&vol->journal_cond);
+    }
+    pthread_mutex_unlock(&vol->journal_mutex);
+    return true;
+}
+
+static void journal_commit(struct hfs_volume *vol);
+
+// Operations start with the group at most half the journal and the held blocks
+// at most the free ones, see the metadata journal
+static void txn_begin(struct hfs_volume *vol) {
+    pthread_mutex_lock(&vol->journal_mutex);
+    bool full = vol->journal_pending > journal_capacity(vol) / 2 || vol->journal_free_short;
+    pthread_mutex_unlock(&vol->journal_mutex);
+    if (full) {
+        journal_commit(vol);
+    }
+    pthread_rwlock_rdlock(&vol->journal_lock);
+}
+
+static void txn_end(struct hfs_volume *vol) {
+    pthread_rwlock_unlock(&vol->journal_lock);
+}
+
+static int cmp_journal_range(const void *a, const void *b) {
+    const struct journal_range *x = a, *y = b;
+    if (x->disk != y->disk) return x->disk - y->disk;
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+// Sort and merge overlapping or touching ranges; returns the new count
+static size_t journal_merge(struct journal_range *ranges, size_t count) {
+    if (count == 0) return 0;
+    qsort(ranges, count, sizeof(struct journal_range), cmp_journal_range);
+
+    size_t out = 0;
+    for (size_t i = 1; i < count; i++) {
+        struct journal_range *last = &ranges[out];
+        if (ranges[i].disk == last->disk && ranges[i].offset <= last->offset + (off_t)last->len) {
+            off_t end = ranges[i].offset + ranges[i].len;
+            if (end > last->offset + (off_t)last->len) {
+                last->len = end - last->offset;
+            }
+        } else {
+            ranges[++out] = ranges[i];
+        }
+    }
+    return out + 1;
+}
+
+// Copy a committed range to wherever it needs to live and flush it there
+static void journal_apply(struct hfs_volume *vol, int disk, off_t offset, const char *data, size_t len) {
+    if (range_mirrored(vol, offset)) {
+        for (int i = 0; i < vol->num_disks; i++) {
+            if (vol->disks[i] + offset != data) {
+                memcpy(vol->disks[i] + offset, data, len);
+            }
+            flush_range(vol, i, offset, len);
+        }
+    } else {
+        if (vol->disks[disk] + offset != data) {
+            memcpy(vol->disks[disk] + offset, data, len);
+        }
+        flush_range(vol, disk, offset, len);
+    }
+}
+
+// Caller holds journal_lock for write. Free the blocks released since the last commit, logging their bitmap bits.
+static void journal_release_frees(struct hfs_volume *vol) {
+    pthread_mutex_lock(&vol->journal_mutex);
+    struct journal_free *frees = vol->journal_frees;
+    size_t count = vol->journal_free_count;
+    vol->journal_frees = NULL;
+    vol->journal_free_count = vol->journal_free_cap = vol->journal_free_blocks = 0;
+    vol->journal_free_short = false;
+    pthread_mutex_unlock(&vol->journal_mutex);
+
+    if (count > 0) {
+        pthread_mutex_lock(&vol->alloc_lock);
+        for (size_t i = 0; i < count; i++) {
+            release_blocks_now(vol, frees[i].block_num, frees[i].count);
+        }
+        pthread_mutex_unlock(&vol->alloc_lock);
+    }
+    free(frees);
+}
+
+// Commit and checkpoint everything logged so far as one group
+static void journal_commit(struct hfs_volume *vol) {
+    pthread_rwlock_wrlock(&vol->journal_lock);
+    journal_release_frees(vol);
+    pthread_mutex_lock(&vol->journal_mutex);
+    struct journal_range *ranges = vol->journal_ranges;
+    size_t count = vol->journal_count;
+    vol->journal_ranges = NULL;
+    vol->journal_count = vol->journal_cap = vol->journal_pending = 0;
+    pthread_mutex_unlock(&vol->journal_mutex);
+
+    count = journal_merge(ranges, count);
+    if (count == 0) {
+        pthread_rwlock_unlock(&vol->journal_lock);
+        free(ranges);
+        return;
+    }
+    uint64_t start = stats_now();
+
+    size_t bytes = 0;
+    for (size_t i = 0; i < count; i++) {
+        bytes += sizeof(struct hfs_journal_record) + ((ranges[i].len + 7) & ~(size_t)7);
+    }
+
+    if (bytes > journal_capacity(vol)) {
+        fprintf(stderr, "journal: group of %zu bytes does not fit, writing it through\n", bytes);
+        journal_invalidate(vol);
+    } else {
+        // Build the group in disks[0]'s journal, then copy it to the others
+        char *records = journal_records(vol, 0);
+        size_t pos = 0;
+        for (size_t i = 0; i < count; i++) {
+            struct hfs_journal_record rec = {ranges[i].disk, ranges[i].len, ranges[i].offset};
+            memcpy(records + pos, &rec, sizeof(rec));
+            memcpy(records + pos + sizeof(rec), journal_source(vol, ranges[i].disk, ranges[i].offset), ranges[i].len);
+            pos += sizeof(rec) + ((ranges[i].len + 7) & ~(size_t)7);
+        }
+
+        struct hfs_journal_header header = {
+            .magic = HFS_JOURNAL_MAGIC,
+            .state = HFS_JOURNAL_DIRTY,
+            .seq = ++vol->journal_seq,
+            .bytes = bytes,
+            .count = count,
+            .crc = crc32c(records, bytes),
+        };
+        for (int disk = 0; disk < vol->num_disks; disk++) {
+            if (disk > 0) {
+                memcpy(journal_records(vol, disk), records, bytes);
+            }
+            memcpy(journal_header(vol, disk), &header, sizeof(header));
+            flush_range(vol, disk, vol->superblock->journal_ptr, vol->block_size + bytes);
+        }
+    }
+
+    // Checkpoint: the group is durable, now put it in place on every disk
+    for (size_t i = 0; i < count; i++) {
+        journal_apply(vol, ranges[i].disk, ranges[i].offset, journal_source(vol, ranges[i].disk, ranges[i].offset), ranges[i].len);
+    }
+    vol->journal_commits++;
+    stats_end(STAT_JOURNAL_COMMIT, start);
+    pthread_rwlock_unlock(&vol->journal_lock);
+    free(ranges);
+}
+
+static void *journal_main(void *arg) {
+    struct hfs_volume *vol = arg;
+    pthread_mutex_lock(&vol->journal_mutex);
+    while (!vol->journal_stop) {
+        if (vol->journal_pending <= journal_capacity(vol) / 2 && !vol->journal_free_short) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += JOURNAL_INTERVAL_MS * 1000000L;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+            deadline.tv_nsec %= 1000000000L;
+            pthread_cond_timedwait(&vol->journal_cond, &vol->journal_mutex, &deadline);
+        }
+        // Don't stall operations on journal_lock when there is nothing to commit
+        if (vol->journal_count > 0) {
+            pthread_mutex_unlock(&vol->journal_mutex);
+            journal_commit(vol);
+            pthread_mutex_lock(&vol->journal_mutex);
+        }
+    }
+    pthread_mutex_unlock(&vol->journal_mutex);
+    return NULL;
+}
+
+static void journal_set_state(struct hfs_volume *vol, uint32_t state) {
+    for (int disk = 0; disk < vol->num_disks; disk++) {
+        journal_header(vol, disk)->state = state;
+        flush_range(vol, disk, vol->superblock->journal_ptr, sizeof(struct hfs_journal_header));
+    }
+}
+
+// Copy a metadata block from disks[1] over disks[0]'s copy (mirrored modes)
+static char *recover_block(struct hfs_volume *vol, off_t block_num) {
+    if (block_num < 0 || (size_t)block_num >= vol->total_data_blocks) return NULL;
+    memcpy(block_addr(vol, 0, block_num), block_addr(vol, 1, block_num), vol->block_size);
+    return block_addr(vol, 0, block_num);
+}
+
+static void recover_dir_node(struct hfs_volume *vol, off_t block_num, int depth) {
+    struct hfs_dir_node *node = (struct hfs_dir_node *)recover_block(vol, block_num);
+    if (node == NULL || node->magic != HFS_DIR_MAGIC || node->depth == 0 || depth >= DIR_MAX_DEPTH) return;
+
+    for (int i = 0; i < node->count && i < DIR_NODE_CAP; i++) {
+        recover_dir_node(vol, node_links(node)[i].block, depth + 1);
+    }
+}
+
+static void recover_extent_node(struct hfs_volume *vol, off_t block_num, int depth) {
+    struct hfs_extent_node *node = (struct hfs_extent_node *)recover_block(vol, block_num);
+    if (node == NULL || depth >= DIR_MAX_DEPTH) return;
+    if (node->magic != HFS_EXTENT_MAGIC || node->depth == 0) return;
+
+    for (int i = 0; i < node->count && i < EXTENT_NODE_CAP; i++) {
+        recover_extent_node(vol, node_extents(node)[i].pblk, depth + 1);
+    }
+}
+
+// disks[0] may hold changes that never committed: take back the committed head and metadata blocks from disks[1]
+static void journal_recover_primary(struct hfs_volume *vol) {
+    size_t head = vol->superblock->journal_ptr - sizeof(struct hfs_sb);
+    memcpy(vol->disks[0] + sizeof(struct hfs_sb), vol->disks[1] + sizeof(struct hfs_sb), head);
+    if (vol->superblock->mode == 0) return;
+
+    for (size_t idx = 0; idx < vol->superblock->num_inodes; idx++) {
+        if (!(vol->disks[0][vol->superblock->i_bitmap_ptr + idx / 8] & (1 << (idx % 8)))) continue;
+
+        struct hfs_inode *inode = get_inode(vol, idx);
+        if (inode->flags & HFS_INODE_INLINE) continue;
+        if (S_ISDIR(inode->mode) && (inode->flags & HFS_INODE_DIR_INDEX)) {
+            recover_dir_node(vol, inode->blocks[0], 0);
+        } else if (S_ISDIR(inode->mode)) {
+            for (int i = 0; i < N_BLOCKS; i++) {
+                if (inode->blocks[i] != -1) recover_block(vol, inode->blocks[i]);
+            }
+        } else if (inode->flags & HFS_INODE_EXTENTS) {
+            for (int i = 0; inode->ext_depth > 0 && i < inode->ext_count && i < HFS_ROOT_EXTENTS; i++) {
+                recover_extent_node(vol, inode->extents[i].pblk, 0);
+            }
+        } else if (inode->blocks[IND_BLOCK] != -1) {
+            recover_block(vol, inode->blocks[IND_BLOCK]);
+        }
+    }
+}
+
+// Called once nothing is left staged
+static void stage_unmap(struct hfs_volume *vol) {
+    for (int disk = 0; disk < vol->num_disks; disk++) {
+        if (vol->stage_maps[disk] != NULL) {
+            munmap(vol->stage_maps[disk], vol->diskSizes[disk]);
+            vol->stage_maps[disk] = NULL;
+        }
+    }
+}
+
+// Stage RAID 0 metadata blocks from here on. Without the mappings they are changed in place.
+static void stage_map(struct hfs_volume *vol) {
+    for (int disk = 0; disk < vol->num_disks; disk++) {
+        char *map = mmap(NULL, vol->diskSizes[disk], PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_NORESERVE, vol->fileDescs[disk], 0);
+        if (map == MAP_FAILED) {
+            fprintf(stderr, "journal: could not map disk %d privately, changing metadata blocks in place\n", disk);
+            stage_unmap(vol);
+            return;
+        }
+        vol->stage_maps[disk] = map;
+    }
+}
+
+// Replay the last committed group and repair an unclean shutdown. Called at mount.
+static void journal_mount(struct hfs_volume *vol) {
+    if (vol->superblock->journal_ptr == 0 || vol->superblock->journal_size <= vol->block_size) return;
+
+    int best = -1;
+    bool dirty = false;
+    for (int disk = 0; disk < vol->num_disks; disk++) {
+        struct hfs_journal_header *header = journal_header(vol, disk);
+        if (header->magic != HFS_JOURNAL_MAGIC) continue;
+        if (header->state == HFS_JOURNAL_DIRTY) dirty = true;
+        if (header->seq == 0 || header->bytes > journal_capacity(vol)) continue;
+        if (crc32c(journal_records(vol, disk), header->bytes) != header->crc) continue;
+        if (best < 0 || header->seq > journal_header(vol, best)->seq) best = disk;
+    }
+
+    if (best >= 0) {
+        struct hfs_journal_header *header = journal_header(vol, best);
+        vol->journal_seq = header->seq;
+        char *records = journal_records(vol, best);
+        size_t pos = 0;
+        for (uint32_t i = 0; i < header->count && pos + sizeof(struct hfs_journal_record) <= header->bytes; i++) {
+            struct hfs_journal_record rec;
+            memcpy(&rec, records + pos, sizeof(rec));
+            pos += sizeof(rec);
+            if (rec.disk >= (uint32_t)vol->num_disks || rec.offset + rec.len > vol->diskSizes[rec.disk] || pos + rec.len > header->bytes) break;
+            if (dirty) {
+                journal_apply(vol, rec.disk, rec.offset, records + pos, rec.len);
+            }
+            pos += (rec.len + 7) & ~(size_t)7;
+        }
+        if (dirty) {
+            fprintf(stderr, "journal: replayed group %lu (%u records)\n", (unsigned long)header->seq, header->count);
+        }
+    }
+
+    if (dirty && vol->num_disks > 1) {
+        fprintf(stderr, "journal: volume was not unmounted cleanly, restoring disk 0 metadata from disk 1\n");
+        journal_recover_primary(vol);
+        flush_range(vol, 0, 0, vol->superblock->d_blocks_ptr);
+        msync(vol->disks[0] + vol->superblock->d_blocks_ptr, vol->diskSizes[0] - vol->superblock->d_blocks_ptr, MS_SYNC);
+    }
+
+    if (vol->superblock->mode == 0) {
+        stage_map(vol);
+    }
+    journal_set_state(vol, HFS_JOURNAL_DIRTY);
+    vol->journal_enabled = true;
+}
+
+// Start group commits. Called from hfs_volume_start(), after hfs has daemonized.
+static void journal_start(struct hfs_volume *vol) {
+    if (!vol->journal_enabled) return;
+    vol->journal_stop = false;
+    vol->journal_running = pthread_create(&vol->journal_thread, NULL, journal_main, vol) == 0;
+    if (!vol->journal_running) {
+        fprintf(stderr, "journal: could not start the committer, committing on every change\n");
+        journal_commit(vol);
+        vol->journal_enabled = false;
+        stage_unmap(vol);
+    }
+}
+
+// Commit what is left and mark the volume clean
+static void journal_shutdown(struct hfs_volume *vol) {
+    if (!vol->journal_enabled) return;
+    if (vol->journal_running) {
+        pthread_mutex_lock(&vol->journal_mutex);
+        vol->journal_stop = true;
+        pthread_cond_signal(&vol->journal_cond);
+        pthread_mutex_unlock(&vol->journal_mutex);
+        pthread_join(vol->journal_thread, NULL);
+        vol->journal_running = false;
+    }
+    journal_commit(vol);
+    vol->journal_enabled = false;
+    stage_unmap(vol);
+    journal_set_state(vol, HFS_JOURNAL_CLEAN);
+}
+
+/*
+  Writeback
+
+  Nothing hfs writes is durable until the page cache is written back. Every
+  range written outside the journal is recorded per disk: file data tagged
+  with its inode, and metadata written straight through (checksums, and all
+  metadata on images without a journal) tagged DIRTY_SHARED. fsync flushes
+  the file's ranges and the shared ones, then commits the journal so the
+  inode, bitmaps and extent blocks are durable too. The flusher thread
+  writes back every range dirty for longer than DIRTY_EXPIRE_MS, so dirty
+  age is bounded whatever the kernel's writeback settings are.
+*/
+#ifndef WRITEBACK_INTERVAL_MS
+#define WRITEBACK_INTERVAL_MS 1000
+#endif
+#ifndef DIRTY_EXPIRE_MS
+#define DIRTY_EXPIRE_MS 5000
+#endif
+#define DIRTY_ALL (-2)        // matches every range when taking them off a list
+#define DIRTY_MERGE_SCAN (16) // recent ranges checked for one to extend
+
+static long now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000L + now.tv_nsec / 1000000L;
+}
+
+static void dirty_add(struct hfs_volume *vol, int disk, off_t offset, size_t len, int owner) {
+    struct dirty_list *list = &vol->dirty_lists[disk];
+    pthread_mutex_lock(&list->lock);
+
+    // Writes mostly extend something written just before
+    size_t scan = list->count < DIRTY_MERGE_SCAN ? list->count : DIRTY_MERGE_SCAN;
+    for (size_t i = list->count - scan; i < list->count; i++) {
+        struct dirty_range *r = &list->ranges[i];
+        if (r->owner != owner || offset > r->offset + (off_t)r->len || offset + (off_t)len < r->offset) continue;
+
+        off_t end = offset + len > r->offset + r->len ? offset + len : r->offset + r->len;
+        r->offset = offset < r->offset ? offset : r->offset;
+        r->len = end - r->offset;
+        pthread_mutex_unlock(&list->lock);
+        return;
+    }
+
+    if (list->count == list->cap) {
+        size_t cap = list->cap ? list->cap * 2 : 64;
+        struct dirty_range *ranges = realloc(list->ranges, cap * sizeof(struct dirty_range));
+        if (ranges == NULL) {
+            pthread_mutex_unlock(&list->lock);
+            // Can't track it, so make it durable now
+            flush_range(vol, disk, offset, len);
+            return;
+        }
+        list->ranges = ranges;
+        list->cap = cap;
+    }
+    list->ranges[list->count++] = (struct dirty_range){offset, len, owner, now_ms()};
+    pthread_mutex_unlock(&list->lock);
+}
+
+// Record a range just written through a mapping, on every disk that holds a copy of it
+static void dirty_mark_range(struct hfs_volume *vol, int owner, void *addr, size_t len) {
+    for (int disk = 0; disk < vol->num_disks; disk++) {
+        if ((char *)addr < vol->disks[disk] || (char *)addr >= vol->disks[disk] + vol->diskSizes[disk]) continue;
+
+        off_t offset = (char *)addr - vol->disks[disk];
+        if (!range_mirrored(vol, offset)) {
+            dirty_add(vol, disk, offset, len, owner);
+            return;
+        }
+        for (int i = 0; i < vol->num_disks; i++) {
+            dirty_add(vol, i, offset, len, owner);
+        }
+        return;
+    }
+}
+
+// Record len bytes of owner's data written starting offset bytes into block_num
+static void dirty_mark_data(struct hfs_volume *vol, int owner, off_t block_num, size_t offset, size_t len) {
+    size_t pos = 0;
+    while (pos < len) {
+        size_t byte = offset + pos;
+        off_t b = block_num + byte / vol->block_size;
+        size_t chunk = len - pos;
+        if (vol->superblock->mode == 0) {
+            size_t unit_offset = (b % vol->stripe_unit) * vol->block_size + byte % vol->block_size;
+            if (chunk > vol->stripe_unit * vol->block_size - unit_offset) {
+                chunk = vol->stripe_unit * vol->block_size - unit_offset;
+            }
+        }
+        off_t local;
+        int disk = block_locate(vol, b, &local);
+        dirty_mark_range(vol, owner, block_addr(vol, disk, local) + byte % vol->block_size, chunk);
+        pos += chunk;
+    }
+}
+
+// Take owner's ranges (and the shared ones) dirtied before cutoff off a disk's list and flush them
+static size_t dirty_flush_disk(struct hfs_volume *vol, int disk, int owner, long cutoff) {
+    struct dirty_list *list = &vol->dirty_lists[disk];
+    pthread_mutex_lock(&list->flush_lock);
+    pthread_mutex_lock(&list->lock);
+    struct journal_range *taken = malloc((list->count ? list->count : 1) * sizeof(struct journal_range));
+    size_t count = 0;
+    size_t kept = 0;
+    for (size_t i = 0; i < list->count; i++) {
+        struct dirty_range *r = &list->ranges[i];
+        bool match = owner == DIRTY_ALL || r->owner == owner || r->owner == DIRTY_SHARED;
+        if (taken != NULL && match && r->dirtied_ms <= cutoff) {
+            taken[count++] = (struct journal_range){disk, r->offset, r->len};
+        } else {
+            list->ranges[kept++] = *r;
+        }
+    }
+    list->count = kept;
+    pthread_mutex_unlock(&list->lock);
+
+    count = journal_merge(taken, count);
+    for (size_t i = 0; i < count; i++) {
+        flush_range(vol, disk, taken[i].offset, taken[i].len);
+    }
+    pthread_mutex_unlock(&list->flush_lock);
+    free(taken);
+    return count;
+}
+
+static size_t dirty_flush(struct hfs_volume *vol, int owner, long cutoff) {
+    size_t flushed = 0;
+    for (int disk = 0; disk < vol->num_disks; disk++) {
+        flushed += dirty_flush_disk(vol, disk, owner, cutoff);
+    }
+    return flushed;
+}
+
+// Make owner's data durable, then the metadata that goes with it
+// Returns -EIO when metadata went in place without a commit since the last sync
+static int writeback_sync(struct hfs_volume *vol, int owner) {
+    atomic_fetch_add(&vol->fsync_flushes, dirty_flush(vol, owner, LONG_MAX));
+    if (vol->journal_enabled) {
+        journal_commit(vol);
+    }
+    return atomic_exchange(&vol->journal_error, 0);
+}
+
+// Start writing owner's ranges back without waiting; they stay listed until flushed
+static void writeback_start(struct hfs_volume *vol, int owner) {
+    for (int disk = 0; disk < vol->num_disks; disk++) {
+        struct dirty_list *list = &vol->dirty_lists[disk];
+        pthread_mutex_lock(&list->lock);
+        for (size_t i = 0; i < list->count; i++) {
+            if (list->ranges[i].owner == owner) {
+                sync_file_range(vol->fileDescs[disk], list->ranges[i].offset, list->ranges[i].len, SYNC_FILE_RANGE_WRITE);
+            }
+        }
+        pthread_mutex_unlock(&list->lock);
+    }
+}
+
+static void *writeback_main(void *arg) {
+    struct hfs_volume *vol = arg;
+    pthread_mutex_lock(&vol->writeback_mutex);
+    while (!vol->writeback_stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += WRITEBACK_INTERVAL_MS % 1000 * 1000000L;
+        deadline.tv_sec += WRITEBACK_INTERVAL_MS / 1000 + deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&vol->writeback_cond, &vol->writeback_mutex, &deadline);
+        if (vol->writeback_stop) break;
+
+        pthread_mutex_unlock(&vol->writeback_mutex);
+        atomic_fetch_add(&vol->expired_flushes, dirty_flush(vol, DIRTY_ALL, now_ms() - DIRTY_EXPIRE_MS));
+        pthread_mutex_lock(&vol->writeback_mutex);
+    }
+    pthread_mutex_unlock(&vol->writeback_mutex);
+    return NULL;
+}
+
+static void writeback_init(struct hfs_volume *vol) {
+    for (int i = 0; i < MAX_DISKS; i++) {
+        pthread_mutex_init(&vol->dirty_lists[i].lock, NULL);
+        pthread_mutex_init(&vol->dirty_lists[i].flush_lock, NULL);
+    }
+    pthread_mutex_init(&vol->writeback_mutex, NULL);
+    pthread_cond_init(&vol->writeback_cond, NULL);
+}
+
+// Undo writeback_init(); the lists are empty once writeback_shutdown() ran
+static void writeback_free(struct hfs_volume *vol) {
+    for (int i = 0; i < MAX_DISKS; i++) {
+        free(vol->dirty_lists[i].ranges);
+        pthread_mutex_destroy(&vol->dirty_lists[i].lock);
+        pthread_mutex_destroy(&vol->dirty_lists[i].flush_lock);
+    }
+    pthread_mutex_destroy(&vol->writeback_mutex);
+    pthread_cond_destroy(&vol->writeback_cond);
+}
+
+// Start the flusher. Called from hfs_volume_start(), after hfs has daemonized.
+static void writeback_start_flusher(struct hfs_volume *vol) {
+    vol->writeback_stop = false;
+    vol->writeback_running = pthread_create(&vol->writeback_thread, NULL, writeback_main, vol) == 0;
+    if (!vol->writeback_running) {
+        fprintf(stderr, "writeback: could not start the flusher, dirty data waits for fsync or unmount\n");
+    }
+}
+
+// Stop the flusher and write back everything still dirty
+static void writeback_shutdown(struct hfs_volume *vol) {
+    if (vol->writeback_running) {
+        pthread_mutex_lock(&vol->writeback_mutex);
+        vol->writeback_stop = true;
+        pthread_cond_signal(&vol->writeback_cond);
+        pthread_mutex_unlock(&vol->writeback_mutex);
+        pthread_join(vol->writeback_thread, NULL);
+        vol->writeback_running = false;
+    }
+    atomic_fetch_add(&vol->expired_flushes, dirty_flush(vol, DIRTY_ALL, LONG_MAX));
+}
+
+// Dentry cache: direct-mapped table of (parent inode, name) -> child inode.
+// Negative entries store -ENOENT. Every namespace change runs under tree_lock
+// for write and updates the cache, so lookups under the read lock never see stale entries.
+#ifndef DCACHE_SLOTS
+#define DCACHE_SLOTS 4096
+#endif
+#define DCACHE_STRIPES 64
+
+
+static unsigned int dcache_hash(int parent, const char *name) {
+    return (name_hash(name) ^ ((unsigned int)parent * 2654435761u)) % DCACHE_SLOTS;
+}
+
+// Returns true and fills *child on a hit
+static bool dcache_lookup(struct hfs_volume *vol, int parent, const char *name, int *child) {
+    if (strlen(name) >= MAX_NAME) return false;
+
+    unsigned int slot = dcache_hash(parent, name);
+    pthread_mutex_t *lock = &vol->dcache_locks[slot % DCACHE_STRIPES];
+    bool hit = false;
+
+    pthread_mutex_lock(lock);
+    struct dcache_entry *entry = &vol->dcache[slot];
+    if (entry->valid && entry->parent == parent && strcmp(entry->name, name) == 0) {
+        *child = entry->child;
+        hit = true;
+    }
+    pthread_mutex_unlock(lock);
+
+    __atomic_fetch_add(hit ? &vol->dcache_hits : &vol->dcache_misses, 1, __ATOMIC_RELAXED);
+    return hit;
+}
+
+// child < 0 records a negative entry
+static void dcache_insert(struct hfs_volume *vol, int parent, const char *name, int child) {
+    if (strlen(name) >= MAX_NAME) return;
+
+    unsigned int slot = dcache_hash(parent, name);
+    pthread_mutex_t *lock = &vol->dcache_locks[slot % DCACHE_STRIPES];
+
+    pthread_mutex_lock(lock);
+    struct dcache_entry *entry = &vol->dcache[slot];
+    entry->parent = parent;
+    entry->child = child;
+    strcpy(entry->name, name);
+    entry->valid = true;
+    pthread_mutex_unlock(lock);
+}
+
+// Look up name in directory parent_idx, going through the dentry cache
+static int lookup_child(struct hfs_volume *vol, int parent_idx, const char *name) {
+    struct hfs_inode *dir_inode = get_inode(vol, parent_idx);
+
+    if (!(dir_inode->mode & S_IFDIR)) {
+        TRACE(DEBUG, NOT_DIR, name, parent_idx);
+        return -ENOTDIR;
+    }
+
+    int child;
+    if (dcache_lookup(vol, parent_idx, name, &child)) {
+        return child;
+    }
+
+    child = dir_lookup(vol, dir_inode, name);
+    dcache_insert(vol, parent_idx, name, child);
+    return child;
+}
+
+static off_t resolve_path(struct hfs_volume *vol, const char *path) {
+    TRACE(DEBUG, FIND_INODE, path);
+    if (strcmp(path, "/") == 0) {
+        return 0;
+    }
+
+    char temp_path[MAX_PATH_NAME];
+    strncpy(temp_path, path, MAX_PATH_NAME-1);
+    temp_path[MAX_PATH_NAME-1] = '\0';
+    char *component = temp_path[0] == '/' ? temp_path + 1 : temp_path;
+    char *saveptr = NULL;
+    char *token = strtok_r(component, "/", &saveptr);
+    int current_inode = 0;
+
+    while (token != NULL) {
+        current_inode = lookup_child(vol, current_inode, token);
+        if (current_inode < 0) {
+            TRACE(DEBUG, FIND_INODE_MISS, path, current_inode);
+            return current_inode;
+        }
+
+        token = strtok_r(NULL, "/", &saveptr);
+    }
+    TRACE(DEBUG, FIND_INODE_HIT, path, current_inode);
+    return current_inode;
+}
+
+static off_t find_inode(struct hfs_volume *vol, const char *path) {
+    uint64_t start = stats_now();
+    off_t inode_idx = resolve_path(vol, path);
+    stats_end(STAT_FIND_INODE, start);
+    return inode_idx;
+}
+
+/*
+  Handles given out by the inode API are (generation << 32) | inode index.
+  Freeing an inode bumps its generation, so a handle to a removed file goes
+  stale instead of reaching whichever file reuses the number.
+*/
+#define HANDLE_GEN_MASK (0x7fffffff) // keeps handles positive
+
+static hfs_ino_t make_handle(struct hfs_volume *vol, int inode_idx) {
+    return ((hfs_ino_t)(vol->inode_gens[inode_idx] & HANDLE_GEN_MASK) << 32) | inode_idx;
+}
+
+// Inode index of a handle whose file still exists. The caller holds tree_lock
+// or the inode's lock, either of which keeps unlink from freeing it meanwhile.
+static int handle_index(struct hfs_volume *vol, hfs_ino_t handle) {
+    if (handle < 0 || (handle & 0xffffffff) >= (hfs_ino_t)vol->superblock->num_inodes) return -EBADF;
+    int inode_idx = handle & 0xffffffff;
+    if (!((bitmap_word(vol, &vol->inode_alloc, inode_idx / 64) >> (inode_idx % 64)) & 1)) return -ESTALE;
+    return make_handle(vol, inode_idx) == handle ? inode_idx : -ESTALE;
+}
+
+// Fill stbuf from an inode the caller has locked
+static void stat_inode(struct hfs_volume *vol, int inode_idx, struct stat *stbuf) {
+    struct hfs_inode *inode = get_inode(vol, inode_idx);
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_ino = make_handle(vol, inode_idx);
+    stbuf->st_mode = inode->mode;
+    stbuf->st_nlink = inode->nlinks;
+    stbuf->st_size = inode->size;
+    stbuf->st_uid = inode->uid;
+    stbuf->st_gid = inode->gid;
+    stbuf->st_atime = inode->atim;
+    stbuf->st_mtime = inode->mtim;
+    stbuf->st_ctime = inode->ctim;
+}
+
+static int do_getattr(struct hfs_volume *vol, const char *path, struct stat *stbuf) {
+    TRACE(DEBUG, GETATTR, path);
+    pthread_rwlock_rdlock(&vol->tree_lock);
+    int inode_idx = find_inode(vol, path);
+    if (inode_idx < 0) {
+        pthread_rwlock_unlock(&vol->tree_lock);
+        TRACE(DEBUG, GETATTR_FAIL, path, inode_idx);
+        return inode_idx;
+    }
+    struct hfs_inode *inode = get_inode(vol, inode_idx);
+    if (!inode) {
+        pthread_rwlock_unlock(&vol->tree_lock);
+        TRACE(ERROR, GETATTR_FAIL, path, -ENOENT);
+        return -ENOENT;
+    }
+    lock_inode(vol, inode_idx, false);
+    pthread_rwlock_unlock(&vol->tree_lock);
+    stat_inode(vol, inode_idx, stbuf);
+    unlock_inode(vol, inode_idx);
+    return SUCCESS;
+}
+
+// Create file childPath in directory parentInodeIdx; returns the new inode
+static int mknod_at(struct hfs_volume *vol, int parentInodeIdx, const char *childPath, mode_t mode, dev_t dev) {
+    int existing = lookup_child(vol, parentInodeIdx, childPath);
+    if (existing >= 0) return -EEXIST;
+    if (existing != -ENOENT) return existing;
+
+    int childInodeIdx = allocate_inode(vol);
+    if (childInodeIdx < 0) {
+        TRACE(INFO, CREATE_FAIL, childPath, -ENOSPC);
+        return -ENOSPC;
+    }
+
+    struct hfs_inode childInode = {0};
+    childInode.mode = mode | S_IFREG;
+    childInode.num = childInodeIdx;
+    childInode.nlinks = 1;
+    childInode.uid = getuid();
+    childInode.gid = getgid();
+    childInode.atim = childInode.mtim = childInode.ctim = time(NULL);
+    childInode.size = 0;
+    childInode.flags = INLINE_CAP > 0 ? HFS_INODE_INLINE : HFS_INODE_EXTENTS;
+
+    struct hfs_inode *childPtr = get_inode(vol, childInodeIdx);
+    memcpy(childPtr, &childInode, sizeof(struct hfs_inode));
+    sync_mirrors(vol, childPtr, sizeof(struct hfs_inode));
+
+    int rc = dir_add_entry(vol, parentInodeIdx, childPath, childInodeIdx);
+    if (rc < 0) {
+        pthread_mutex_lock(&vol->alloc_lock);
+        release_inode(vol, childInodeIdx);
+        pthread_mutex_unlock(&vol->alloc_lock);
+        return rc;
+    }
+
+    dcache_insert(vol, parentInodeIdx, childPath, childInodeIdx);
+    TRACE(DEBUG, MKNOD, childPath, childInodeIdx, parentInodeIdx);
+    return childInodeIdx;
+}
+
+static int do_mknod(struct hfs_volume *vol, const char *path, mode_t mode, dev_t dev) {
+    char parentPath[MAX_PATH_NAME];
+    char origPath[MAX_PATH_NAME];
+    char childPath[MAX_PATH_NAME];
+    strcpy(origPath, path);
+    split_path(origPath, parentPath, childPath);
+    int parentInodeIdx = find_inode(vol, parentPath);
+
+    if (parentInodeIdx < 0) {
+        TRACE(DEBUG, CREATE_FAIL, path, -ENOENT);
+        return -ENOENT;
+    }
+
+    int rc = mknod_at(vol, parentInodeIdx, childPath, mode, dev);
+    return rc < 0 ? rc : SUCCESS;
+}
+
+// Create directory childPath in directory parentInodeIdx; returns the new inode
+static int mkdir_at(struct hfs_volume *vol, int parentInodeIdx, const char *childPath, mode_t mode) {
+    int existing = lookup_child(vol, parentInodeIdx, childPath);
+    if (existing >= 0) return -EEXIST;
+    if (existing != -ENOENT) return existing;
+
+    int childInodeIdx = allocate_inode(vol);
+    if (childInodeIdx < 0) {
+        TRACE(INFO, CREATE_FAIL, childPath, -ENOSPC);
+        return -ENOSPC;
+    }
+
+    struct hfs_inode childInode = {0};
+    childInode.mode = (mode & 0777) | S_IFDIR;
+    childInode.num = childInodeIdx;
+    childInode.nlinks = 2;
+    childInode.uid = getuid();
+    childInode.gid = getgid();
+    childInode.atim = childInode.mtim = childInode.ctim = time(NULL);
+    childInode.size = 0;
+    for (int i = 0; i < N_BLOCKS; i++) {
+        childInode.blocks[i] = -1;
+    }
+    if (INLINE_DENTRIES > 0) {
+        childInode.flags = HFS_INODE_INLINE;
+    }
+
+    struct hfs_inode *childPtr = get_inode(vol, childInodeIdx);
+    memcpy(childPtr, &childInode, sizeof(struct hfs_inode));
+    sync_mirrors(vol, childPtr, sizeof(struct hfs_inode));
+
+    int rc = dir_add_entry(vol, parentInodeIdx, childPath, childInodeIdx);
+    if (rc < 0) {
+        pthread_mutex_lock(&vol->alloc_lock);
+        release_inode(vol, childInodeIdx);
+        pthread_mutex_unlock(&vol->alloc_lock);
+        return rc;
+    }
+
+    dcache_insert(vol, parentInodeIdx, childPath, childInodeIdx);
+    TRACE(DEBUG, MKDIR, childPath, childInodeIdx, parentInodeIdx);
+    return childInodeIdx;
+}
+
+static int do_mkdir(struct hfs_volume *vol, const char *path, mode_t mode) {
+    char parentPath[MAX_PATH_NAME];
+    char origPath[MAX_PATH_NAME];
+    char childPath[MAX_PATH_NAME];
+    strcpy(origPath, path);
+    split_path(origPath, parentPath, childPath);
+    int parentInodeIdx = find_inode(vol, parentPath);
+
+    if (parentInodeIdx < 0) {
+        TRACE(DEBUG, CREATE_FAIL, path, -ENOENT);
+        return -ENOENT;
+    }
+
+    int rc = mkdir_at(vol, parentInodeIdx, childPath, mode);
+    return rc < 0 ? rc : SUCCESS;
+}
+
+static int unlink_at(struct hfs_volume *vol, int parentInodeIdx, const char *fileName);
+
+static int do_unlink(struct hfs_volume *vol, const char *path) {
+    char parentPath[MAX_PATH_NAME];
+    char origPath[MAX_PATH_NAME];
+    char fileName[MAX_PATH_NAME];
+    strcpy(origPath, path);
+    split_path(origPath, parentPath, fileName);
+
+    int parentInodeIdx = find_inode(vol, parentPath);
+    if (parentInodeIdx < 0) {
+        TRACE(DEBUG, UNLINK_FAIL, path, parentInodeIdx);
+        return parentInodeIdx;
+    }
+    struct hfs_inode *parentInode = get_inode(vol, parentInodeIdx);
+    if (!parentInode) {
+        TRACE(ERROR, UNLINK_FAIL, path, -ENOENT);
+        return -ENOENT;
+    }
+    return unlink_at(vol, parentInodeIdx, fileName);
+}
+
+// Remove file fileName from directory parentInodeIdx
+static int unlink_at(struct hfs_volume *vol, int parentInodeIdx, const char *fileName) {
+    int inode_idx = lookup_child(vol, parentInodeIdx, fileName);
+    if (inode_idx < 0) {
+        TRACE(DEBUG, UNLINK_FAIL, fileName, inode_idx);
+        return inode_idx;
+    }
+    struct hfs_inode *inode = get_inode(vol, inode_idx);
+    if (!inode) {
+        TRACE(ERROR, UNLINK_FAIL, fileName, -ENOENT);
+        return -ENOENT;
+    }
+
+    if (S_ISDIR(inode->mode)) {
+        TRACE(DEBUG, UNLINK_FAIL, fileName, -EISDIR);
+        return -EISDIR;
+    }
+
+    int rc = dir_remove_entry(vol, parentInodeIdx, fileName);
+    if (rc < 0) {
+        TRACE(ERROR, UNLINK_FAIL, fileName, rc);
+        return rc;
+    }
+
+    // wait out readers/writers that resolved this inode before we took tree_lock
+    lock_inode(vol, inode_idx, true);
+    inode->nlinks--;
+
+    // no more links, free inode and data blocks
+    if (inode->nlinks == 0) {
+        pthread_mutex_lock(&vol->alloc_lock);
+        release_inode_blocks(vol, inode);
+        release_inode(vol, inode_idx);
+        pthread_mutex_unlock(&vol->alloc_lock);
+    } else {
+        sync_mirrors(vol, inode, sizeof(struct hfs_inode));
+    }
+    unlock_inode(vol, inode_idx);
+
+    dcache_insert(vol, parentInodeIdx, fileName, -ENOENT);
+    TRACE(DEBUG, UNLINK, fileName, inode_idx);
+    return SUCCESS;
+}
+
+// Remove empty directory dirName from directory parentInodeIdx
+static int rmdir_at(struct hfs_volume *vol, int parentInodeIdx, const char *dirName) {
+    int inode_idx = lookup_child(vol, parentInodeIdx, dirName);
+    if (inode_idx < 0) {
+        TRACE(DEBUG, RMDIR_FAIL, dirName, inode_idx);
+        return inode_idx;
+    }
+    struct hfs_inode *inode = get_inode(vol, inode_idx);
+    if (!inode) {
+        TRACE(ERROR, RMDIR_FAIL, dirName, -ENOENT);
+        return -ENOENT;
+    }
+
+    if (!S_ISDIR(inode->mode)) {
+        TRACE(DEBUG, RMDIR_FAIL, dirName, -ENOTDIR);
+        return -ENOTDIR;
+    }
+
+    int is_empty = dir_is_empty(vol, inode);
+    if (!is_empty) {
+        TRACE(DEBUG, RMDIR_FAIL, dirName, -ENOTEMPTY);
+        return -ENOTEMPTY;
+    }
+
+    int rc = dir_remove_entry(vol, parentInodeIdx, dirName);
+    if (rc < 0) {
+        TRACE(ERROR, RMDIR_FAIL, dirName, rc);
+        return rc;
+    }
+
+    lock_inode(vol, inode_idx, true);
+    pthread_mutex_lock(&vol->alloc_lock);
+    release_inode_blocks(vol, inode);
+    release_inode(vol, inode_idx);
+    pthread_mutex_unlock(&vol->alloc_lock);
+    unlock_inode(vol, inode_idx);
+
+    dcache_insert(vol, parentInodeIdx, dirName, -ENOENT);
+    TRACE(DEBUG, RMDIR, dirName, inode_idx);
+    return SUCCESS;
+}
+
+static int do_rmdir(struct hfs_volume *vol, const char *path) {
+    if (strcmp(path, "/") == 0) return -EBUSY;
+
+    char parentPath[MAX_PATH_NAME];
+    char origPath[MAX_PATH_NAME];
+    char dirName[MAX_PATH_NAME];
+    strcpy(origPath, path);
+    split_path(origPath, parentPath, dirName);
+
+    int parentInodeIdx = find_inode(vol, parentPath);
+    if (parentInodeIdx < 0) {
+        TRACE(DEBUG, RMDIR_FAIL, path, parentInodeIdx);
+        return parentInodeIdx;
+    }
+    return rmdir_at(vol, parentInodeIdx, dirName);
+}
+
+/*
+  An open file from hfs_file_open(). Besides the handle it remembers the
+  last run of blocks it mapped, so a sequential reader or writer looks up
+  an extent once per run instead of once per call. Mapped blocks stay put
+  until something takes blocks away from the file, which bumps the inode's
+  map generation and so retires every cached run; removing the file retires
+  the handle itself.
+*/
+struct hfs_file {
+    hfs_ino_t handle;
+    pthread_mutex_t lock;  /* Guards the cached run; calls on one file can run in parallel */
+    uint32_t map_gen;      /* inode_map_gens when the run was cached */
+    off_t run_lblk;        /* First file block of the run */
+    off_t run_len;         /* 0 when nothing is cached */
+    off_t run_pblk;
+};
+
+// Data block for file block lblk of inode_idx, through f's cached run when it covers lblk.
+// Caller holds inode_locks[inode_idx]. f may be NULL.
+static off_t file_map(struct hfs_volume *vol, int inode_idx, struct hfs_file *f, off_t lblk, off_t *run) {
+    struct hfs_inode *inode = get_inode(vol, inode_idx);
+    if (f == NULL) return extent_map(vol, inode, lblk, run);
+
+    // Another call on the same file is using the cache; don't wait for it
+    if (pthread_mutex_trylock(&f->lock) != 0) return extent_map(vol, inode, lblk, run);
+    off_t block_num;
+    if (f->map_gen == vol->inode_map_gens[inode_idx] && lblk >= f->run_lblk && lblk < f->run_lblk + f->run_len) {
+        *run = f->run_lblk + f->run_len - lblk;
+        block_num = f->run_pblk + (lblk - f->run_lblk);
+    } else {
+        block_num = extent_map(vol, inode, lblk, run);
+        if (block_num >= 0) {
+            f->map_gen = vol->inode_map_gens[inode_idx];
+            f->run_lblk = lblk;
+            f->run_len = *run;
+            f->run_pblk = block_num;
+        }
+    }
+    pthread_mutex_unlock(&f->lock);
+    return block_num;
+}
+
+/*
+  Access times follow relatime, as Linux mounts do by default: a read moves
+  atime only when it is no later than the last change or is a day old. Reads
+  hold the inode lock for read, so the update is its own small transaction
+  afterwards, and most reads find nothing to do.
+*/
+#define ATIME_INTERVAL (24 * 60 * 60)
+
+static bool atime_stale(const struct hfs_inode *inode, time_t now) {
+    if (inode->atim == now) return false;
+    return inode->atim <= inode->mtim || inode->atim <= inode->ctim || now - inode->atim >= ATIME_INTERVAL;
+}
+
+// Caller holds inode_locks[inode_idx] (read). f (may be NULL) caches the block map.
+static int read_inode_data(struct hfs_volume *vol, int inode_idx, struct hfs_file *f, char *buf, size_t size, off_t offset) {
+    struct hfs_inode *inode = get_inode(vol, inode_idx);
+    if (!inode) return -ENOENT;
+
+    if (offset >= inode->size) return 0;
+
+    if (offset + size > inode->size) {
+        size = inode->size - offset;
+    }
+
+    if (inode->flags & HFS_INODE_INLINE) {
+        memcpy(buf, inline_data(inode) + offset, size);
+        return size;
+    }
+
+    // One copy per extent rather than per block
+    size_t bytes_read = 0;
+    while (bytes_read < size) {
+        off_t current_offset = offset + bytes_read;
+        off_t run;
+        off_t block_num = file_map(vol, inode_idx, f, current_offset / vol->block_size, &run);
+
+        size_t block_offset = current_offset % vol->block_size;
+        size_t run_bytes = run * vol->block_size - block_offset;
+        if (run_bytes > size - bytes_read) {
+            run_bytes = size - bytes_read;
+        }
+
+        // Holes read as zeroes
+        if (block_num == -1) {
+            memset(buf + bytes_read, 0, run_bytes);
+            bytes_read += run_bytes;
+            continue;
+        }
+
+        int rc = data_read(vol, block_num, block_offset, buf + bytes_read, run_bytes);
+        if (rc < 0) return bytes_read > 0 ? bytes_read : rc;
+        bytes_read += run_bytes;
+    }
+    return bytes_read;
+}
+
+static int write_inode_data(struct hfs_volume *vol, int inode_idx, struct hfs_file *f, const char *buf, size_t size, off_t offset);
+
+// Caller holds inode_locks[inode_idx] (write). Move an inline file's bytes into data blocks.
+static int promote_inline(struct hfs_volume *vol, int inode_idx) {
+    struct hfs_inode *inode = get_inode(vol, inode_idx);
+    char saved[INODE_SIZE];
+    size_t saved_size = inode->size;
+    memcpy(saved, inline_data(inode), saved_size);
+
+    memset(inline_data(inode), 0, INLINE_CAP);
+    memset(inode->extents, 0, sizeof(inode->extents));
+    inode->flags = (inode->flags & ~HFS_INODE_INLINE) | HFS_INODE_EXTENTS;
+    inode->ext_count = 0;
+    inode->ext_depth = 0;
+    inode->size = 0;
+
+    int rc = saved_size > 0 ? write_inode_data(vol, inode_idx, NULL, saved, saved_size, 0) : 0;
+    if (rc < 0) {
+        // Out of space: put the bytes back inline
+        memset(inode->extents, 0, sizeof(inode->extents));
+        inode->flags = (inode->flags & ~HFS_INODE_EXTENTS) | HFS_INODE_INLINE;
+        memcpy(inline_data(inode), saved, saved_size);
+        inode->size = saved_size;
+        sync_mirrors(vol, inode, vol->inode_size);
+        return rc;
+    }
+    sync_mirrors(vol, inode, vol->inode_size);
+    return SUCCESS;
+}
+
+// Caller holds inode_locks[inode_idx] (write). f (may be NULL) caches the block map.
+static int write_inode_data(struct hfs_volume *vol, int inode_idx, struct hfs_file *f, const char *buf, size_t size, off_t offset) {
+    struct hfs_inode *inode = get_inode(vol, inode_idx);
+    if (!inode) return -ENOENT;
+    if (size == 0) return 0;
+
+    if (inode->flags & HFS_INODE_INLINE) {
+        if (offset + size <= INLINE_CAP) {
+            memcpy(inline_data(inode) + offset, buf, size);
+            if (offset + size > inode->size) {
+                inode->size = offset + size;
+            }
+            inode->mtim = time(NULL);
+            sync_mirrors(vol, inode, vol->inode_size);
+            return size;
+        }
+
+        int rc = promote_inline(vol, inode_idx);
+        if (rc < 0) return rc;
+    }
+
+    off_t first = offset / vol->block_size;
+    off_t last = (offset + size - 1) / vol->block_size;
+    if (last >= MAX_FILE_BLOCKS) return -EFBIG;
+
+    // Nothing to allocate if the blocks are already mapped
+    off_t run;
+    int rc = SUCCESS;
+    if (file_map(vol, inode_idx, f, first, &run) < 0 || run < last - first + 1) {
+        rc = extent_fill_holes(vol, inode, first, last - first + 1, offset, size);
+        if (rc < 0) return rc;
+    }
+    // Blocks shared with another file are copied first
+    rc = extent_unshare(vol, inode, first, last - first + 1, offset, size);
+    if (rc < 0) return rc;
+
+    size_t bytes_written = 0;
+    while (bytes_written < size) {
+        off_t current_offset = offset + bytes_written;
+        off_t block_num = file_map(vol, inode_idx, f, current_offset / vol->block_size, &run);
+
+        size_t block_offset = current_offset % vol->block_size;
+        size_t run_bytes = run * vol->block_size - block_offset;
+        if (run_bytes > size - bytes_written) {
+            run_bytes = size - bytes_written;
+        }
+
+        rc = data_write(vol, inode_idx, block_num, block_offset, buf + bytes_written, run_bytes);
+        if (rc < 0) break;
+        bytes_written += run_bytes;
+    }
+    if (bytes_written == 0) return rc;
+
+    // Update inode
+    if (offset + bytes_written > inode->size) {
+        inode->size = offset + bytes_written;
+    }
+    inode->mtim = time(NULL);
+    sync_mirrors(vol, inode, sizeof(struct hfs_inode));
+
+    return bytes_written;
+}
+
+// Caller holds inode_locks[inode_idx] (write). Blocks past the new end are freed, and the
+// tail of the last block zeroed so that growing the file again reads zeroes.
+static int truncate_inode_data(struct hfs_volume *vol, int inode_idx, off_t size) {
+    struct hfs_inode *inode = get_inode(vol, inode_idx);
+    if (S_ISDIR(inode->mode)) return -EISDIR;
+    if (size < 0) return -EINVAL;
+    if ((size + vol->block_size - 1) / vol->block_size > MAX_FILE_BLOCKS) return -EFBIG;
+
+    if (inode->flags & HFS_INODE_INLINE) {
+        if ((size_t)size <= INLINE_CAP) {
+            if (size < inode->size) {
+                memset(inline_data(inode) + size, 0, inode->size - size);
+            }
+            inode->size = size;
+            inode->mtim = inode->ctim = time(NULL);
+            sync_mirrors(vol, inode, vol->inode_size);
+            return SUCCESS;
+        }
+        int rc = promote_inline(vol, inode_idx);
+        if (rc < 0) return rc;
+    }
+
+    off_t keep = (size + vol->block_size - 1) / vol->block_size;
+    int rc = extent_punch(vol, inode, keep, MAX_FILE_BLOCKS - keep);
+    if (rc < 0) return rc;
+
+    off_t run;
+    rc = size % vol->block_size ? extent_unshare(vol, inode, size / vol->block_size, 1, 0, 0) : SUCCESS;
+    if (rc < 0) return rc;
+    off_t last = size % vol->block_size ? extent_map(vol, inode, size / vol->block_size, &run) : -1;
+    if (last >= 0) {
+        rc = data_write(vol, inode_idx, last, size % vol->block_size, NULL, vol->block_size - size % vol->block_size);
+        if (rc < 0) return rc;
+    }
+
+    inode->size = size;
+    inode->mtim = inode->ctim = time(NULL);
+    sync_mirrors(vol, inode, sizeof(struct hfs_inode));
+    return SUCCESS;
+}
+
+/*
+  Caller holds inode_locks[inode_idx] (write). mode 0 maps every block of
+  [offset, offset + len), each hole from a single free run when there is
+  one that long near the hint (see extent_fill_holes), so a writer can lay
+  out a file before writing it. FALLOC_FL_PUNCH_HOLE
+  (with FALLOC_FL_KEEP_SIZE, as Linux requires) zeroes the range and gives
+  back the whole blocks in it.
+*/
+static int fallocate_inode_data(struct hfs_volume *vol, int inode_idx, int mode, off_t offset, off_t len) {
+    struct hfs_inode *inode = get_inode(vol, inode_idx);
+    if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE)) return -EOPNOTSUPP;
+    if ((mode & FALLOC_FL_PUNCH_HOLE) && !(mode & FALLOC_FL_KEEP_SIZE)) return -EOPNOTSUPP;
+    if (offset < 0 || len <= 0) return -EINVAL;
+    if (!S_ISREG(inode->mode)) return -ENODEV;
+    off_t end = offset + len;
+    if ((end + vol->block_size - 1) / vol->block_size > MAX_FILE_BLOCKS) return -EFBIG;
+
+    if (mode & FALLOC_FL_PUNCH_HOLE) {
+        if (inode->flags & HFS_INODE_INLINE) {
+            off_t to = end < inode->size ? end : inode->size;
+            if (offset < to) memset(inline_data(inode) + offset, 0, to - offset);
+            inode->mtim = inode->ctim = time(NULL);
+            sync_mirrors(vol, inode, vol->inode_size);
+            return SUCCESS;
+        }
+
+        // Zero the partial blocks at either edge, free the whole ones between
+        off_t first = (offset + vol->block_size - 1) / vol->block_size;
+        off_t past = end / vol->block_size;
+        off_t run, block_num;
+        int rc = SUCCESS;
+        if (offset % vol->block_size) rc = extent_unshare(vol, inode, offset / vol->block_size, 1, 0, 0);
+        if (rc == SUCCESS && end % vol->block_size) rc = extent_unshare(vol, inode, end / vol->block_size, 1, 0, 0);
+        if (rc == SUCCESS && offset % vol->block_size && (block_num = extent_map(vol, inode, offset / vol->block_size, &run)) >= 0) {
+            off_t to = first * vol->block_size < end ? first * vol->block_size : end;
+            rc = data_write(vol, inode_idx, block_num, offset % vol->block_size, NULL, to - offset);
+        }
+        if (rc == SUCCESS && end % vol->block_size && past >= first && (block_num = extent_map(vol, inode, past, &run)) >= 0) {
+            rc = data_write(vol, inode_idx, block_num, 0, NULL, end % vol->block_size);
+        }
+        if (rc == SUCCESS && past > first) {
+            rc = extent_punch(vol, inode, first, past - first);
+        }
+        if (rc < 0) return rc;
+        inode->mtim = inode->ctim = time(NULL);
+        sync_mirrors(vol, inode, sizeof(struct hfs_inode));
+        return SUCCESS;
+    }
+
+    if (inode->flags & HFS_INODE_INLINE) {
+        if ((size_t)end <= INLINE_CAP) {
+            if (!(mode & FALLOC_FL_KEEP_SIZE) && end > inode->size) {
+                inode->size = end;
+                inode->ctim = time(NULL);
+                sync_mirrors(vol, inode, vol->inode_size);
+            }
+            return SUCCESS;
+        }
+        int rc = promote_inline(vol, inode_idx);
+        if (rc < 0) return rc;
+    }
+
+    // New blocks are zeroed: nothing is about to overwrite them
+    off_t first = offset / vol->block_size;
+    off_t last = (end - 1) / vol->block_size;
+    int rc = extent_fill_holes(vol, inode, first, last - first + 1, offset, 0);
+    if (rc < 0) return rc;
+
+    if (!(mode & FALLOC_FL_KEEP_SIZE) && end > inode->size) {
+        inode->size = end;
+    }
+    inode->ctim = time(NULL);
+    sync_mirrors(vol, inode, sizeof(struct hfs_inode));
+    return SUCCESS;
+}
+
+/*
+  Caller holds inode_locks[inode_idx] (read). SEEK_DATA finds the first
+  mapped byte at or after offset, SEEK_HOLE the first unmapped one, where
+  the end of the file counts as a hole. Each step skips a whole extent or
+  gap, so this costs one extent lookup per run rather than per block.
+  Preallocated blocks count as data.
+*/
+static off_t seek_inode_data(struct hfs_volume *vol, int inode_idx, off_t offset, int whence) {
+    struct hfs_inode *inode = get_inode(vol, inode_idx);
+    if (whence != SEEK_DATA && whence != SEEK_HOLE) return -EINVAL;
+    if (S_ISDIR(inode->mode)) return -EINVAL;
+    if (offset < 0 || offset >= inode->size) return -ENXIO;
+
+    // Inline files are all data
+    if (inode->flags & HFS_INODE_INLINE) {
+        return whence == SEEK_DATA ? offset : inode->size;
+    }
+
+    off_t end = (inode->size + vol->block_size - 1) / vol->block_size;
+    off_t lblk = offset / vol->block_size;
+    while (lblk < end) {
+        off_t run;
+        bool mapped = extent_map(vol, inode, lblk, &run) >= 0;
+        if (mapped == (whence == SEEK_DATA)) break;
+        lblk += run;
+    }
+
+    off_t found = lblk * vol->block_size > offset ? lblk * vol->block_size : offset;
+    if (found < inode->size) return found;
+    return whence == SEEK_DATA ? -ENXIO : inode->size;
+}
+
+/*
+  Caller holds inode_locks[src_idx] and inode_locks[dst_idx] (write). Map
+  count blocks of dst from dst_first on to the blocks src maps from
+  src_first on, as one more owner of each; holes in src become holes in dst,
+  and whatever dst mapped there before is released. Nothing is copied: the
+  first write to a shared block, from either file, moves it to a new one.
+*/
+static int share_inode_blocks(struct hfs_volume *vol, int src_idx, off_t src_first, int dst_idx, off_t dst_first, off_t count) {
+    struct hfs_inode *src = get_inode(vol, src_idx);
+    struct hfs_inode *dst = get_inode(vol, dst_idx);
+    if (dst->flags & HFS_INODE_INLINE) {
+        int rc = promote_inline(vol, dst_idx);
+        if (rc < 0) return rc;
+    }
+    // Shared blocks never change, so src's data must be durable before dst's fsync counts on it
+    dirty_flush(vol, src_idx, LONG_MAX);
+
+    struct extent_list list = {0};
+    struct block_list tree = {0};
+    struct extent_list shared = {0};
+    int rc = extent_punch(vol, dst, dst_first, count);
+    if (rc == SUCCESS) {
+        rc = extent_load(vol, dst, &list, &tree);
+    }
+    for (off_t lblk = src_first; rc == SUCCESS && lblk < src_first + count; ) {
+        off_t run;
+        off_t block_num = extent_map(vol, src, lblk, &run);
+        if (run > src_first + count - lblk) run = src_first + count - lblk;
+        if (block_num >= 0) {
+            struct hfs_extent e = { .lblk = dst_first + (lblk - src_first), .len = run, .pblk = block_num };
+            rc = extent_list_insert(&shared, e);
+            if (rc == SUCCESS) rc = extent_list_insert(&list, e);
+        }
+        lblk += run;
+    }
+
+    // Counts for every group first, so a failure leaves them as they were
+    pthread_mutex_lock(&vol->alloc_lock);
+    for (int i = 0; rc == SUCCESS && i < shared.count; i++) {
+        rc = block_refs_reserve(vol, shared.ext[i].pblk, shared.ext[i].len);
+    }
+    for (int i = 0; rc == SUCCESS && i < shared.count; i++) {
+        share_data_blocks(vol, shared.ext[i].pblk, shared.ext[i].len);
+    }
+    pthread_mutex_unlock(&vol->alloc_lock);
+
+    if (rc == SUCCESS) {
+        rc = extent_store(vol, dst, &list, &tree);
+        if (rc < 0) {
+            // src still maps them, so this only drops the counts again
+            pthread_mutex_lock(&vol->alloc_lock);
+            for (int i = 0; i < shared.count; i++) {
+                release_data_blocks(vol, shared.ext[i].pblk, shared.ext[i].len);
+            }
+            pthread_mutex_unlock(&vol->alloc_lock);
+        }
+    }
+    if (rc == SUCCESS && shared.count > 0) {
+        src->flags |= HFS_INODE_SHARED;
+        dst->flags |= HFS_INODE_SHARED;
+        sync_mirrors(vol, src, sizeof(struct hfs_inode));
+        vol->inode_map_gens[dst_idx]++;
+    }
+    sync_mirrors(vol, dst, sizeof(struct hfs_inode));
+
+    free(list.ext);
+    free(tree.blocks);
+    free(shared.ext);
+    return rc;
+}
+
+#define COPY_CHUNK (1 << 20)
+
+// Caller holds inode_locks[src_idx] and inode_locks[dst_idx] (write). Copy through a buffer, for what can't be shared.
+static ssize_t copy_inode_bytes(struct hfs_volume *vol, int src_idx, off_t off_in, int dst_idx, off_t off_out, size_t len) {
+    char *buf = malloc(len < COPY_CHUNK ? len : COPY_CHUNK);
+    if (buf == NULL) return -ENOMEM;
+
+    size_t copied = 0;
+    int rc = SUCCESS;
+    while (copied < len) {
+        size_t n = len - copied < COPY_CHUNK ? len - copied : COPY_CHUNK;
+        rc = read_inode_data(vol, src_idx, NULL, buf, n, off_in + copied);
+        if (rc <= 0) break;
+        rc = write_inode_data(vol, dst_idx, NULL, buf, rc, off_out + copied);
+        if (rc <= 0) break;
+        copied += rc;
+    }
+    free(buf);
+    return copied > 0 ? (ssize_t)copied : rc;
+}
+
+/*
+  Caller holds inode_locks[src_idx] and inode_locks[dst_idx] (write). Copy
+  len bytes at off_in in src to off_out in dst, as copy_file_range(2) does.
+  When both offsets sit at the same place in a block, the whole blocks
+  between the partial ones at either end are shared rather than copied, and
+  so is src's last block when the copy ends there and dst has nothing after
+  it: both read as zeroes past the end.
+*/
+static ssize_t copy_inode_data(struct hfs_volume *vol, int src_idx, off_t off_in, int dst_idx, off_t off_out, size_t len) {
+    struct hfs_inode *src = get_inode(vol, src_idx);
+    struct hfs_inode *dst = get_inode(vol, dst_idx);
+    if (S_ISDIR(src->mode) || S_ISDIR(dst->mode)) return -EISDIR;
+    if (!S_ISREG(src->mode) || !S_ISREG(dst->mode)) return -EINVAL;
+    if (off_in < 0 || off_out < 0) return -EINVAL;
+    if (off_in >= src->size || len == 0) return 0;
+    if (len > (size_t)(src->size - off_in)) len = src->size - off_in;
+    if (src_idx == dst_idx && off_in < off_out + (off_t)len && off_out < off_in + (off_t)len) return -EINVAL;
+    if ((off_out + (off_t)len + vol->block_size - 1) / vol->block_size > MAX_FILE_BLOCKS) return -EFBIG;
+
+    size_t head = len;
+    size_t whole = 0;
+    if (off_in % vol->block_size == off_out % vol->block_size && !(src->flags & HFS_INODE_INLINE)) {
+        head = (vol->block_size - off_in % vol->block_size) % vol->block_size;
+        if (head > len) head = len;
+        whole = (len - head) / vol->block_size * vol->block_size;
+        if (off_in + (off_t)len == src->size && off_out + (off_t)len >= dst->size) whole = len - head;
+    }
+    size_t tail = len - head - whole;
+
+    ssize_t rc = head ? copy_inode_bytes(vol, src_idx, off_in, dst_idx, off_out, head) : 0;
+    if (rc < (ssize_t)head) return rc;
+    if (whole) {
+        rc = share_inode_blocks(vol, src_idx, (off_in + head) / vol->block_size, dst_idx, (off_out + head) / vol->block_size,
+                                (whole + vol->block_size - 1) / vol->block_size);
+        if (rc < 0) return head > 0 ? (ssize_t)head : rc;
+        if (off_out + (off_t)(head + whole) > dst->size) dst->size = off_out + head + whole;
+    }
+    rc = tail ? copy_inode_bytes(vol, src_idx, off_in + head + whole, dst_idx, off_out + head + whole, tail) : 0;
+    if (rc < 0 && head + whole == 0) return rc;
+    size_t copied = head + whole + (rc > 0 ? rc : 0);
+
+    time_t now = time(NULL);
+    if (atime_stale(src, now)) {
+        src->atim = now;
+        sync_mirrors(vol, src, sizeof(struct hfs_inode));
+    }
+    dst->mtim = dst->ctim = now;
+    sync_mirrors(vol, dst, sizeof(struct hfs_inode));
+    return copied;
+}
+
+// Resolve path under tree_lock and return with the inode locked, so unlink can't free it underneath us
+static int lookup_and_lock(struct hfs_volume *vol, const char *path, bool write) {
+    pthread_rwlock_rdlock(&vol->tree_lock);
+    int inode_idx = find_inode(vol, path);
+    if (inode_idx >= 0) {
+        lock_inode(vol, inode_idx, write);
+    }
+    pthread_rwlock_unlock(&vol->tree_lock);
+    return inode_idx;
+}
+
+// Lock the inode behind a handle and return its index, failing if the file has been removed.
+// unlink frees inodes under the inode lock, so the handle stays good while it is held.
+static int lock_handle(struct hfs_volume *vol, hfs_ino_t handle, bool write) {
+    if (handle < 0 || (handle & 0xffffffff) >= (hfs_ino_t)vol->superblock->num_inodes) return -EBADF;
+    int inode_idx = handle & 0xffffffff;
+    lock_inode(vol, inode_idx, write);
+    int rc = handle_index(vol, handle);
+    if (rc < 0) unlock_inode(vol, inode_idx);
+    return rc;
+}
+
+// After a read (see atime_stale). Caller holds no locks; the file may have gone meanwhile
+static void update_atime(struct hfs_volume *vol, hfs_ino_t handle) {
+    txn_begin(vol);
+    int ino = lock_handle(vol, handle, true);
+    if (ino >= 0) {
+        struct hfs_inode *inode = get_inode(vol, ino);
+        time_t now = time(NULL);
+        if (atime_stale(inode, now)) {
+            inode->atim = now;
+            sync_mirrors(vol, inode, sizeof(struct hfs_inode));
+        }
+        unlock_inode(vol, ino);
+    }
+    txn_end(vol);
+}
+
+int hfs_read(struct hfs_volume *vol, const char *path, char *buf, size_t size, off_t offset) {
+    TRACE(DEBUG, READ, path, size, offset);
+    uint64_t start = stats_now();
+    int inode_idx = lookup_and_lock(vol, path, false);
+    if (inode_idx < 0) return -ENOENT;
+
+    int rc = read_inode_data(vol, inode_idx, NULL, buf, size, offset);
+    bool stale = atime_stale(get_inode(vol, inode_idx), time(NULL));
+    hfs_ino_t handle = make_handle(vol, inode_idx);
+    unlock_inode(vol, inode_idx);
+    if (stale) update_atime(vol, handle);
+    stats_end(STAT_READ, start);
+    return rc;
+}
+
+int hfs_pread(struct hfs_volume *vol, hfs_ino_t handle, char *buf, size_t size, off_t offset) {
+    TRACE(DEBUG, READ, NULL, size, offset);
+    uint64_t start = stats_now();
+    int ino = lock_handle(vol, handle, false);
+    if (ino < 0) return ino;
+
+    int rc = read_inode_data(vol, ino, NULL, buf, size, offset);
+    bool stale = atime_stale(get_inode(vol, ino), time(NULL));
+    unlock_inode(vol, ino);
+    if (stale) update_atime(vol, handle);
+    stats_end(STAT_READ, start);
+    return rc;
+}
+
+int hfs_write(struct hfs_volume *vol, const char *path, const char *buf, size_t size, off_t offset) {
+    TRACE(DEBUG, WRITE, path, size, offset);
+    uint64_t start = stats_now();
+    txn_begin(vol);
+    int inode_idx = lookup_and_lock(vol, path, true);
+    if (inode_idx < 0) {
+        txn_end(vol);
+        return -ENOENT;
+    }
+
+    int rc = write_inode_data(vol, inode_idx, NULL, buf, size, offset);
+    unlock_inode(vol, inode_idx);
+    txn_end(vol);
+    stats_end(STAT_WRITE, start);
+    return rc;
+}
+
+int hfs_pwrite(struct hfs_volume *vol, hfs_ino_t handle, const char *buf, size_t size, off_t offset) {
+    TRACE(DEBUG, WRITE, NULL, size, offset);
+    uint64_t start = stats_now();
+    txn_begin(vol);
+    int ino = lock_handle(vol, handle, true);
+    if (ino < 0) {
+        txn_end(vol);
+        return ino;
+    }
+
+    int rc = write_inode_data(vol, ino, NULL, buf, size, offset);
+    unlock_inode(vol, ino);
+    txn_end(vol);
+    stats_end(STAT_WRITE, start);
+    return rc;
+}
+
+// Flush the file's ranges, or for a directory only the shared ones, and commit.
+// fdatasync gets the same treatment: the journal doesn't know if only timestamps changed.
+static int fsync_locked(struct hfs_volume *vol, int inode_idx) {
+    bool dir = S_ISDIR(get_inode(vol, inode_idx)->mode);
+    unlock_inode(vol, inode_idx);
+    return writeback_sync(vol, dir ? DIRTY_SHARED : inode_idx);
+}
+
+int hfs_fsync(struct hfs_volume *vol, const char *path) {
+    uint64_t start = stats_now();
+    int inode_idx = lookup_and_lock(vol, path, false);
+    if (inode_idx < 0) return -ENOENT;
+
+    int rc = fsync_locked(vol, inode_idx);
+    stats_end(STAT_FSYNC, start);
+    return rc;
+}
+
+int hfs_fsync_ino(struct hfs_volume *vol, hfs_ino_t handle) {
+    uint64_t start = stats_now();
+    int ino = lock_handle(vol, handle, false);
+    if (ino < 0) return ino;
+
+    int rc = fsync_locked(vol, ino);
+    stats_end(STAT_FSYNC, start);
+    return rc;
+}
+
+// Everything written so far, on every disk
+int hfs_sync(struct hfs_volume *vol) {
+    return writeback_sync(vol, DIRTY_ALL);
+}
+
+hfs_ino_t hfs_open(struct hfs_volume *vol, const char *path) {
+    pthread_rwlock_rdlock(&vol->tree_lock);
+    int inode_idx = find_inode(vol, path);
+    hfs_ino_t handle = inode_idx < 0 ? inode_idx : make_handle(vol, inode_idx);
+    pthread_rwlock_unlock(&vol->tree_lock);
+    return handle;
+}
+
+int hfs_fstat(struct hfs_volume *vol, hfs_ino_t handle, struct stat *st) {
+    uint64_t start = stats_now();
+    int ino = lock_handle(vol, handle, false);
+    if (ino < 0) return ino;
+
+    stat_inode(vol, ino, st);
+    unlock_inode(vol, ino);
+    stats_end(STAT_GETATTR, start);
+    return SUCCESS;
+}
+
+// Get the file's data moving to disk so a later fsync has less to wait for
+int hfs_close(struct hfs_volume *vol, hfs_ino_t handle) {
+    int ino = lock_handle(vol, handle, false);
+    if (ino < 0) return ino;
+    unlock_inode(vol, ino);
+
+    writeback_start(vol, ino);
+    return SUCCESS;
+}
+
+int hfs_file_open(struct hfs_volume *vol, hfs_ino_t handle, struct hfs_file **fp) {
+    int ino = lock_handle(vol, handle, false);
+    if (ino < 0) return ino;
+    bool dir = S_ISDIR(get_inode(vol, ino)->mode);
+    unlock_inode(vol, ino);
+    if (dir) return -EISDIR;
+
+    struct hfs_file *f = calloc(1, sizeof(struct hfs_file));
+    if (f == NULL) return -ENOMEM;
+    f->handle = handle;
+    pthread_mutex_init(&f->lock, NULL);
+    *fp = f;
+    return SUCCESS;
+}
+
+int hfs_file_read(struct hfs_volume *vol, struct hfs_file *f, char *buf, size_t size, off_t offset) {
+    TRACE(DEBUG, READ, NULL, size, offset);
+    uint64_t start = stats_now();
+    int ino = lock_handle(vol, f->handle, false);
+    if (ino < 0) return ino;
+
+    int rc = read_inode_data(vol, ino, f, buf, size, offset);
+    bool stale = atime_stale(get_inode(vol, ino), time(NULL));
+    unlock_inode(vol, ino);
+    if (stale) update_atime(vol, f->handle);
+    stats_end(STAT_READ, start);
+    return rc;
+}
+
+int hfs_file_write(struct hfs_volume *vol, struct hfs_file *f, const char *buf, size_t size, off_t offset) {
+    TRACE(DEBUG, WRITE, NULL, size, offset);
+    uint64_t start = stats_now();
+    txn_begin(vol);
+    int ino = lock_handle(vol, f->handle, true);
+    if (ino < 0) {
+        txn_end(vol);
+        return ino;
+    }
+
+    int rc = write_inode_data(vol, ino, f, buf, size, offset);
+    unlock_inode(vol, ino);
+    txn_end(vol);
+    stats_end(STAT_WRITE, start);
+    return rc;
+}
+
+int hfs_truncate(struct hfs_volume *vol, const char *path, off_t size) {
+    TRACE(DEBUG, TRUNCATE, path, size);
+    uint64_t start = stats_now();
+    txn_begin(vol);
+    int inode_idx = lookup_and_lock(vol, path, true);
+    if (inode_idx < 0) {
+        txn_end(vol);
+        return -ENOENT;
+    }
+
+    int rc = truncate_inode_data(vol, inode_idx, size);
+    unlock_inode(vol, inode_idx);
+    txn_end(vol);
+    stats_end(STAT_TRUNCATE, start);
+    return rc;
+}
+
+int hfs_truncate_ino(struct hfs_volume *vol, hfs_ino_t handle, off_t size) {
+    TRACE(DEBUG, TRUNCATE, NULL, size);
+    uint64_t start = stats_now();
+    txn_begin(vol);
+    int ino = lock_handle(vol, handle, true);
+    if (ino < 0) {
+        txn_end(vol);
+        return ino;
+    }
+
+    int rc = truncate_inode_data(vol, ino, size);
+    unlock_inode(vol, ino);
+    txn_end(vol);
+    stats_end(STAT_TRUNCATE, start);
+    return rc;
+}
+
+off_t hfs_lseek_ino(struct hfs_volume *vol, hfs_ino_t handle, off_t offset, int whence) {
+    TRACE(DEBUG, LSEEK, NULL, whence, offset);
+    int ino = lock_handle(vol, handle, false);
+    if (ino < 0) return ino;
+
+    off_t rc = seek_inode_data(vol, ino, offset, whence);
+    unlock_inode(vol, ino);
+    return rc;
+}
+
+off_t hfs_file_lseek(struct hfs_volume *vol, struct hfs_file *f, off_t offset, int whence) {
+    return hfs_lseek_ino(vol, f->handle, offset, whence);
+}
+
+int hfs_file_truncate(struct hfs_volume *vol, struct hfs_file *f, off_t size) {
+    return hfs_truncate_ino(vol, f->handle, size);
+}
+
+int hfs_file_fallocate(struct hfs_volume *vol, struct hfs_file *f, int mode, off_t offset, off_t len) {
+    TRACE(DEBUG, FALLOCATE, NULL, mode, len, offset);
+    uint64_t start = stats_now();
+    txn_begin(vol);
+    int ino = lock_handle(vol, f->handle, true);
+    if (ino < 0) {
+        txn_end(vol);
+        return ino;
+    }
+
+    int rc = fallocate_inode_data(vol, ino, mode, offset, len);
+    unlock_inode(vol, ino);
+    txn_end(vol);
+    stats_end(STAT_FALLOCATE, start);
+    return rc;
+}
+
+// Tell the next mount to count shared blocks (see block_refs). Caller is in a transaction and holds no inode lock.
+static void mark_volume_shared(struct hfs_volume *vol) {
+    if (atomic_load(&vol->volume_shared)) return;
+    struct hfs_inode *root = get_inode(vol, 0);
+    pthread_rwlock_wrlock(&vol->tree_lock);
+    if (!(root->flags & HFS_INODE_SHARED)) {
+        root->flags |= HFS_INODE_SHARED;
+        sync_mirrors(vol, root, sizeof(struct hfs_inode));
+    }
+    atomic_store(&vol->volume_shared, true);
+    pthread_rwlock_unlock(&vol->tree_lock);
+}
+
+// Lock two files for write, the lower inode first so opposite copies between them can't deadlock
+static int lock_handle_pair(struct hfs_volume *vol, hfs_ino_t a, hfs_ino_t b, int *a_idx, int *b_idx) {
+    if ((a & 0xffffffff) == (b & 0xffffffff)) {
+        int rc = lock_handle(vol, a, true);
+        if (rc < 0) return rc;
+        if (a != b) {
+            unlock_inode(vol, rc);
+            return -ESTALE;
+        }
+        *a_idx = *b_idx = rc;
+        return SUCCESS;
+    }
+
+    bool swap = (a & 0xffffffff) > (b & 0xffffffff);
+    int lo = lock_handle(vol, swap ? b : a, true);
+    if (lo < 0) return lo;
+    int hi = lock_handle(vol, swap ? a : b, true);
+    if (hi < 0) {
+        unlock_inode(vol, lo);
+        return hi;
+    }
+    *a_idx = swap ? hi : lo;
+    *b_idx = swap ? lo : hi;
+    return SUCCESS;
+}
+
+ssize_t hfs_file_copy_range(struct hfs_volume *vol, struct hfs_file *src, off_t off_in, struct hfs_file *dst, off_t off_out, size_t len) {
+    TRACE(DEBUG, COPY_RANGE, NULL, len, off_in, off_out);
+    uint64_t start = stats_now();
+    txn_begin(vol);
+    mark_volume_shared(vol);
+    int src_idx, dst_idx;
+    int rc = lock_handle_pair(vol, src->handle, dst->handle, &src_idx, &dst_idx);
+    if (rc < 0) {
+        txn_end(vol);
+        return rc;
+    }
+
+    ssize_t copied = copy_inode_data(vol, src_idx, off_in, dst_idx, off_out, len);
+    unlock_inode(vol, src_idx);
+    if (dst_idx != src_idx) unlock_inode(vol, dst_idx);
+    txn_end(vol);
+    stats_end(STAT_COPY_RANGE, start);
+    return copied;
+}
+
+int hfs_file_fsync(struct hfs_volume *vol, struct hfs_file *f) {
+    return hfs_fsync_ino(vol, f->handle);
+}
+
+// Frees f even if the file is gone
+int hfs_file_close(struct hfs_volume *vol, struct hfs_file *f) {
+    int rc = hfs_close(vol, f->handle);
+    pthread_mutex_destroy(&f->lock);
+    free(f);
+    return rc;
+}
+
+int hfs_stat(struct hfs_volume *vol, const char *path, struct stat *st) {
+    uint64_t start = stats_now();
+    int rc = do_getattr(vol, path, st);
+    stats_end(STAT_GETATTR, start);
+    return rc;
+}
+
+int hfs_mknod(struct hfs_volume *vol, const char *path, mode_t mode, dev_t dev) {
+    uint64_t start = stats_now();
+    txn_begin(vol);
+    pthread_rwlock_wrlock(&vol->tree_lock);
+    int rc = do_mknod(vol, path, mode, dev);
+    pthread_rwlock_unlock(&vol->tree_lock);
+    txn_end(vol);
+    stats_end(STAT_MKNOD, start);
+    return rc;
+}
+
+int hfs_mkdir(struct hfs_volume *vol, const char *path, mode_t mode) {
+    uint64_t start = stats_now();
+    txn_begin(vol);
+    pthread_rwlock_wrlock(&vol->tree_lock);
+    int rc = do_mkdir(vol, path, mode);
+    pthread_rwlock_unlock(&vol->tree_lock);
+    txn_end(vol);
+    stats_end(STAT_MKDIR, start);
+    return rc;
+}
+
+int hfs_unlink(struct hfs_volume *vol, const char *path) {
+    uint64_t start = stats_now();
+    txn_begin(vol);
+    pthread_rwlock_wrlock(&vol->tree_lock);
+    int rc = do_unlink(vol, path);
+    pthread_rwlock_unlock(&vol->tree_lock);
+    txn_end(vol);
+    stats_end(STAT_UNLINK, start);
+    return rc;
+}
+
+int hfs_rmdir(struct hfs_volume *vol, const char *path) {
+    uint64_t start = stats_now();
+    txn_begin(vol);
+    pthread_rwlock_wrlock(&vol->tree_lock);
+    int rc = do_rmdir(vol, path);
+    pthread_rwlock_unlock(&vol->tree_lock);
+    txn_end(vol);
+    stats_end(STAT_RMDIR, start);
+    return rc;
+}
+
+/*
+  The same operations on (directory handle, name), for front ends that keep
+  handles themselves (hfs_ll) and so never resolve a whole path.
+*/
+
+// Handle of dir's child name, with its attributes in st if st isn't NULL
+hfs_ino_t hfs_lookup(struct hfs_volume *vol, hfs_ino_t dir, const char *name, struct stat *st) {
+    TRACE(DEBUG, LOOKUP, name);
+    uint64_t start = stats_now();
+    pthread_rwlock_rdlock(&vol->tree_lock);
+    int rc = handle_index(vol, dir);
+    if (rc >= 0) rc = lookup_child(vol, rc, name);
+    if (rc >= 0 && st) {
+        lock_inode(vol, rc, false);
+        stat_inode(vol, rc, st);
+        unlock_inode(vol, rc);
+    }
+    hfs_ino_t handle = rc < 0 ? rc : make_handle(vol, rc);
+    pthread_rwlock_unlock(&vol->tree_lock);
+    stats_end(STAT_LOOKUP, start);
+    return handle;
+}
+
+hfs_ino_t hfs_mknodat(struct hfs_volume *vol, hfs_ino_t dir, const char *name, mode_t mode, dev_t dev, struct stat *st) {
+    uint64_t start = stats_now();
+    txn_begin(vol);
+    pthread_rwlock_wrlock(&vol->tree_lock);
+    int rc = handle_index(vol, dir);
+    if (rc >= 0) rc = mknod_at(vol, rc, name, mode, dev);
+    if (rc >= 0 && st) stat_inode(vol, rc, st);
+    hfs_ino_t handle = rc < 0 ? rc : make_handle(vol, rc);
+    pthread_rwlock_unlock(&vol->tree_lock);
+    txn_end(vol);
+    stats_end(STAT_MKNOD, start);
+    return handle;
+}
+
+hfs_ino_t hfs_mkdirat(struct hfs_volume *vol, hfs_ino_t dir, const char *name, mode_t mode, struct stat *st) {
+    uint64_t start = stats_now();
+    txn_begin(vol);
+    pthread_rwlock_wrlock(&vol->tree_lock);
+    int rc = handle_index(vol, dir);
+    if (rc >= 0) rc = mkdir_at(vol, rc, name, mode);
+    if (rc >= 0 && st) stat_inode(vol, rc, st);
+    hfs_ino_t handle = rc < 0 ? rc : make_handle(vol, rc);
+    pthread_rwlock_unlock(&vol->tree_lock);
+    txn_end(vol);
+    stats_end(STAT_MKDIR, start);
+    return handle;
+}
+
+int hfs_unlinkat(struct hfs_volume *vol, hfs_ino_t dir, const char *name) {
+    uint64_t start = stats_now();
+    txn_begin(vol);
+    pthread_rwlock_wrlock(&vol->tree_lock);
+    int rc = handle_index(vol, dir);
+    if (rc >= 0) rc = unlink_at(vol, rc, name);
+    pthread_rwlock_unlock(&vol->tree_lock);
+    txn_end(vol);
+    stats_end(STAT_UNLINK, start);
+    return rc;
+}
+
+int hfs_rmdirat(struct hfs_volume *vol, hfs_ino_t dir, const char *name) {
+    uint64_t start = stats_now();
+    txn_begin(vol);
+    pthread_rwlock_wrlock(&vol->tree_lock);
+    int rc = handle_index(vol, dir);
+    if (rc >= 0) rc = rmdir_at(vol, rc, name);
+    pthread_rwlock_unlock(&vol->tree_lock);
+    txn_end(vol);
+    stats_end(STAT_RMDIR, start);
+    return rc;
+}
+
+
+struct readdir_ctx {
+    void *buf;
+    hfs_fill_t filler;
+};
+
+// Entries carry only st_ino, the entry's handle
+static int visit_readdir(struct hfs_volume *vol, void *ctx, struct hfs_dentry *entry) {
+    struct readdir_ctx *rd = ctx;
+    struct stat st = { .st_ino = make_handle(vol, entry->num) };
+    return rd->filler(rd->buf, entry->name, &st, 0);
+}
+
+static int readdir_inode(struct hfs_volume *vol, int inode_idx, void *buf, hfs_fill_t filler) {
+    struct hfs_inode *inode = get_inode(vol, inode_idx);
+    if (!(inode->mode & S_IFDIR)) return -ENOTDIR;
+
+    struct stat self = { .st_ino = make_handle(vol, inode_idx) };
+    filler(buf, ".", &self, 0);
+    filler(buf, "..", NULL, 0);
+    struct readdir_ctx ctx = { .buf = buf, .filler = filler };
+    dir_iterate(vol, inode, visit_readdir, &ctx);
+    return 0;
+}
+
+static int do_readdir(struct hfs_volume *vol, const char* path, void* buf, hfs_fill_t filler) {
+    TRACE(DEBUG, READDIR, path);
+    int inode_idx = find_inode(vol, path);
+    if (inode_idx < 0) {
+        TRACE(DEBUG, READDIR_FAIL, path, inode_idx);
+        return -ENOENT;
+    }
+    struct hfs_inode *inode = get_inode(vol, inode_idx);
+    if (!inode) {
+        TRACE(ERROR, READDIR_FAIL, path, -ENOENT);
+        return -ENOENT;
+    }
+    return readdir_inode(vol, inode_idx, buf, filler);
+}
+
+int hfs_readdir(struct hfs_volume *vol, const char *path, hfs_fill_t fill, void *ctx) {
+    uint64_t start = stats_now();
+    pthread_rwlock_rdlock(&vol->tree_lock);
+    int rc = do_readdir(vol, path, ctx, fill);
+    pthread_rwlock_unlock(&vol->tree_lock);
+    stats_end(STAT_READDIR, start);
+    return rc;
+}
+
+int hfs_readdir_ino(struct hfs_volume *vol, hfs_ino_t dir, hfs_fill_t fill, void *ctx) {
+    TRACE(DEBUG, READDIR, NULL);
+    uint64_t start = stats_now();
+    pthread_rwlock_rdlock(&vol->tree_lock);
+    int rc = handle_index(vol, dir);
+    if (rc >= 0) rc = readdir_inode(vol, rc, ctx, fill);
+    pthread_rwlock_unlock(&vol->tree_lock);
+    stats_end(STAT_READDIR, start);
+    return rc;
+}
+
+// Setup done once per process, however many volumes it opens
+static pthread_once_t process_once = PTHREAD_ONCE_INIT;
+
+static void process_init(void) {
+    stats_init();
+    crc32c_init();
+    verify_init();
+#if defined(HAVE_IO_URING)
+    uring_key_ok = pthread_key_create(&uring_key, uring_free) == 0;
+#endif
+}
+
+// Locks and condition variables of a zeroed struct hfs_volume
+static void volume_init_locks(struct hfs_volume *vol) {
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    // A waiting commit goes ahead of new readers, see journal_lock
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&vol->journal_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    pthread_rwlock_init(&vol->tree_lock, NULL);
+    pthread_mutex_init(&vol->alloc_lock, NULL);
+    pthread_mutex_init(&vol->journal_mutex, NULL);
+    pthread_cond_init(&vol->journal_cond, NULL);
+    for (int i = 0; i < DCACHE_STRIPES; i++) {
+        pthread_mutex_init(&vol->dcache_locks[i], NULL);
+    }
+    writeback_init(vol);
+}
+
+static void volume_destroy_locks(struct hfs_volume *vol) {
+    pthread_rwlock_destroy(&vol->journal_lock);
+    pthread_rwlock_destroy(&vol->tree_lock);
+    pthread_mutex_destroy(&vol->alloc_lock);
+    pthread_mutex_destroy(&vol->journal_mutex);
+    pthread_cond_destroy(&vol->journal_cond);
+    for (int i = 0; i < DCACHE_STRIPES; i++) {
+        pthread_mutex_destroy(&vol->dcache_locks[i]);
+    }
+    writeback_free(vol);
+}
+
+// Map the count disk images in paths and get the volume ready for operations.
+// hfs_volume_start() still has to start the background threads.
+static int volume_open(struct hfs_volume *vol, char *paths[], int count) {
+    volume_init_locks(vol);
+    pthread_once(&process_once, process_init);
+    vol->num_disks = count;
+    vol->disks = calloc(vol->num_disks, sizeof(void *));
+    if (vol->disks == NULL) {
+        fprintf(stderr, "Memory allocation failed for disks\n");
+        return FAIL;
+    }
+
+    vol->fileDescs = malloc(sizeof(int) * vol->num_disks);
+    vol->diskSizes = malloc(sizeof(size_t) * vol->num_disks);
+    if (vol->fileDescs == NULL || vol->diskSizes == NULL) {
+        fprintf(stderr, "Memory allocation failed for fileDescs\n");
+        return FAIL;
+    }
+    for (int i = 0; i < vol->num_disks; i++) {
+        vol->fileDescs[i] = -1;
+    }
+
+    for (int i = 0; i < vol->num_disks; i++) {
+        vol->fileDescs[i] = open(paths[i], O_RDWR);
+        if (vol->fileDescs[i] == -1) {
+            fprintf(stderr, "Failed to open disk %s\n", paths[i]);
+            return FAIL;
+        }
+
+        struct stat st;
+        if (fstat(vol->fileDescs[i], &st) != 0) {
+            fprintf(stderr, "Failed to get disk size for %s\n", paths[i]);
+            return FAIL;
+        }
+        vol->diskSizes[i] = st.st_size;
+
+        vol->disks[i] = mmap(NULL, vol->diskSizes[i], PROT_READ | PROT_WRITE, MAP_SHARED, vol->fileDescs[i], 0);
+        if (vol->disks[i] == MAP_FAILED) {
+            vol->disks[i] = NULL;
+            fprintf(stderr, "Failed to mmap disk %s\n", paths[i]);
+            return FAIL;
+        }
+    }
+
+    vol->superblock = (struct hfs_sb *)vol->disks[0];
+
+    if (vol->superblock == NULL) {
+        fprintf(stderr, "Failed to access superblock\n");
+        return FAIL;
+    }
+
+    if (vol->superblock->num_disks > vol->num_disks || vol->superblock->num_disks > MAX_DISKS) {
+        fprintf(stderr, "Volume has %d disks, %d given (at most %d supported)\n", vol->superblock->num_disks, vol->num_disks, MAX_DISKS);
+        return FAIL;
+    }
+    // Images past the volume's own aren't used
+    for (int i = vol->superblock->num_disks; i < vol->num_disks; i++) {
+        munmap(vol->disks[i], vol->diskSizes[i]);
+        close(vol->fileDescs[i]);
+    }
+    vol->num_disks = vol->superblock->num_disks;
+    // Images made by older versions of mkfs leave these zero
+    vol->block_size = vol->superblock->block_size ? vol->superblock->block_size : BLOCK_SIZE;
+    vol->inode_size = vol->superblock->inode_size ? vol->superblock->inode_size : INODE_SIZE;
+    // RAID 0 images without a stripe unit striped single blocks and have a bitmap covering one disk's worth
+    vol->stripe_unit = vol->superblock->stripe_unit ? vol->superblock->stripe_unit : 1;
+    if (vol->superblock->mode != 0 && !vol->superblock->stripe_unit) {
+        // Only the locality read policy uses it here
+        vol->stripe_unit = STRIPE_UNIT > vol->block_size ? STRIPE_UNIT / vol->block_size : 1;
+    }
+    vol->total_data_blocks = vol->superblock->num_data_blocks;
+    if (vol->superblock->mode == 0 && vol->superblock->stripe_unit) {
+        vol->total_data_blocks = (vol->superblock->num_data_blocks / vol->stripe_unit) * vol->stripe_unit * vol->num_disks;
+    }
+
+    vol->inode_locks = malloc(sizeof(pthread_rwlock_t) * vol->superblock->num_inodes);
+    if (vol->inode_locks == NULL) {
+        fprintf(stderr, "Memory allocation failed for inode_locks\n");
+        return FAIL;
+    }
+    for (int i = 0; i < vol->superblock->num_inodes; i++) {
+        pthread_rwlock_init(&vol->inode_locks[i], NULL);
+    }
+    vol->inode_gens = calloc(vol->superblock->num_inodes, sizeof(uint32_t));
+    vol->inode_map_gens = calloc(vol->superblock->num_inodes, sizeof(uint32_t));
+    if (vol->inode_gens == NULL || vol->inode_map_gens == NULL) {
+        fprintf(stderr, "Memory allocation failed for inode_gens\n");
+        return FAIL;
+    }
+
+    csum_init(vol);
+    journal_mount(vol);
+
+    if (bitmap_init(vol, &vol->inode_alloc, vol->superblock->i_bitmap_ptr, vol->superblock->num_inodes) != SUCCESS ||
+        bitmap_init(vol, &vol->data_alloc, vol->superblock->d_bitmap_ptr, vol->total_data_blocks) != SUCCESS) {
+        fprintf(stderr, "Memory allocation failed for bitmap counters\n");
+        return FAIL;
+    }
+    if (block_refs_init(vol) != SUCCESS) {
+        fprintf(stderr, "Memory allocation failed for block reference counts\n");
+        return FAIL;
+    }
+    return SUCCESS;
+}
+
+// Undo volume_open(), or as much of it as got done. The background threads must be stopped.
+static void volume_close(struct hfs_volume *vol) {
+    if (vol->inode_locks != NULL) {
+        for (size_t i = 0; i < vol->superblock->num_inodes; i++) {
+            pthread_rwlock_destroy(&vol->inode_locks[i]);
+        }
+        free(vol->inode_locks);
+        vol->inode_locks = NULL;
+    }
+    free(vol->inode_gens);
+    free(vol->inode_map_gens);
+    vol->inode_gens = vol->inode_map_gens = NULL;
+    free(vol->inode_alloc.group_free);
+    free(vol->data_alloc.group_free);
+    vol->inode_alloc.group_free = vol->data_alloc.group_free = NULL;
+    block_refs_free(vol);
+    stage_unmap(vol);
+
+    for (int i = 0; vol->disks != NULL && vol->fileDescs != NULL && i < vol->num_disks; i++) {
+        if (vol->disks[i] != NULL && munmap(vol->disks[i], vol->diskSizes[i]) != 0) {
+            fprintf(stderr, "Failed to unmap disk %d\n", i);
+        }
+        if (vol->fileDescs[i] >= 0) close(vol->fileDescs[i]);
+    }
+
+    free(vol->disks);
+    free(vol->fileDescs);
+    free(vol->diskSizes);
+    vol->disks = NULL;
+    vol->fileDescs = NULL;
+    vol->diskSizes = NULL;
+    vol->superblock = NULL;
+    volume_destroy_locks(vol);
+}
+
+// Apply opts to the backend, read policy and tracer before the volume is opened
+static int apply_options(struct hfs_volume *vol, const struct hfs_options *opts) {
+    parse_io_backend(vol, "mmap");
+    parse_read_policy(vol, "lor");
+    vol->queue_depth = QUEUE_DEPTH;
+    if (opts == NULL) return SUCCESS;
+
+    if (opts->io && parse_io_backend(vol, opts->io) != SUCCESS) {
+        fprintf(stderr, "Unknown I/O backend %s (mmap, pread or uring)\n", opts->io);
+        return FAIL;
+    }
+    if (opts->queue_depth) {
+        if (opts->queue_depth < 1 || opts->queue_depth > MAX_QUEUE_DEPTH) {
+            fprintf(stderr, "Queue depth must be from 1 to %d\n", MAX_QUEUE_DEPTH);
+            return FAIL;
+        }
+        vol->queue_depth = opts->queue_depth;
+    }
+    if (opts->read_policy && parse_read_policy(vol, opts->read_policy) != SUCCESS) {
+        fprintf(stderr, "Unknown read policy %s (rr, lor or locality)\n", opts->read_policy);
+        return FAIL;
+    }
+#ifdef HFS_TRACE
+    if ((opts->trace && parse_trace_level(opts->trace) != SUCCESS) ||
+        (opts->trace_file && set_trace_path(opts->trace_file) != SUCCESS)) {
+        fprintf(stderr, "Bad trace option (trace=off|error|info|debug, trace file=path)\n");
+        return FAIL;
+    }
+#else
+    if (opts->trace || opts->trace_file) {
+        fprintf(stderr, "Tracing was compiled out, ignoring the trace options\n");
+    }
+#endif
+    return SUCCESS;
+}
+
+// Take the --options above out of argv[1..], leaving the rest (e.g. FUSE's) in order
+int hfs_options_parse(int *argc, char *argv[], struct hfs_options *opts) {
+    int kept = 1;
+    for (int i = 1; i < *argc; i++) {
+        if (strncmp(argv[i], "--read-policy=", 14) == 0) {
+            opts->read_policy = argv[i] + 14;
+        } else if (strncmp(argv[i], "--trace=", 8) == 0) {
+            opts->trace = argv[i] + 8;
+        } else if (strncmp(argv[i], "--trace-file=", 13) == 0) {
+            opts->trace_file = argv[i] + 13;
+        } else if (strncmp(argv[i], "--io=", 5) == 0) {
+            opts->io = argv[i] + 5;
+        } else if (strncmp(argv[i], "--queue-depth=", 14) == 0) {
+            opts->queue_depth = atoi(argv[i] + 14);
+            if (opts->queue_depth < 1) {
+                fprintf(stderr, "Bad queue depth %s\n", argv[i] + 14);
+                return FAIL;
+            }
+        } else {
+            argv[kept++] = argv[i];
+        }
+    }
+    *argc = kept;
+    return SUCCESS;
+}
+
+int hfs_volume_open(char *const paths[], int count, const struct hfs_options *opts, struct hfs_volume **volp) {
+    if (count < 1 || count > MAX_DISKS) return -EINVAL;
+
+    struct hfs_volume *vol = calloc(1, sizeof(struct hfs_volume));
+    if (vol == NULL) return -ENOMEM;
+    if (apply_options(vol, opts) != SUCCESS) {
+        free(vol);
+        return -EINVAL;
+    }
+    if (volume_open(vol, (char **)paths, count) != SUCCESS) {
+        volume_close(vol);
+        free(vol);
+        return -EIO;
+    }
+
+#ifdef HFS_TRACE
+    if (trace_init() != SUCCESS) {
+        fprintf(stderr, "Could not set up tracing to %s\n", trace_path);
+        volume_close(vol);
+        free(vol);
+        return -EINVAL;
+    }
+    atomic_fetch_add(&trace_volumes, 1);
+#endif
+    if (vol->io_backend->init(vol) != SUCCESS) {
+        fprintf(stderr, "I/O backend %s is not available here, using pread\n", vol->io_backend->name);
+        parse_io_backend(vol, "pread");
+    }
+
+    *volp = vol;
+    if (!(opts && opts->defer_start)) {
+        hfs_volume_start(vol);
+    }
+    return SUCCESS;
+}
+
+void hfs_volume_start(struct hfs_volume *vol) {
+    if (vol->started) return;
+    journal_start(vol);
+    writeback_start_flusher(vol);
+    vol->started = true;
+}
+
+// Also safe when the threads never started
+void hfs_volume_stop(struct hfs_volume *vol) {
+    writeback_shutdown(vol);
+    journal_shutdown(vol);
+    vol->started = false;
+}
+
+void hfs_volume_close(struct hfs_volume *vol) {
+    hfs_volume_stop(vol);
+#ifdef HFS_TRACE
+    if (atomic_fetch_sub(&trace_volumes, 1) == 1) trace_dump();
+#endif
+    volume_close(vol);
+    free(vol);
+}
+
+void hfs_volume_info(struct hfs_volume *vol, struct hfs_volume_info *info) {
+    info->mode = vol->superblock->mode;
+    info->num_disks = vol->num_disks;
+    info->block_size = vol->block_size;
+    info->total_blocks = vol->total_data_blocks;
+    info->total_inodes = vol->superblock->num_inodes;
+    pthread_mutex_lock(&vol->alloc_lock);
+    info->free_blocks = vol->data_alloc.free;
+    info->free_inodes = vol->inode_alloc.free;
+    info->shared_blocks = vol->shared_blocks;
+    pthread_mutex_unlock(&vol->alloc_lock);
+    info->io = vol->io_backend->name;
+}
+
+void hfs_volume_report(struct hfs_volume *vol, FILE *out) {
+    if (vol->superblock->journal_ptr) fprintf(out, "journal: %lu group commits\n", vol->journal_commits);
+    fprintf(out, "writeback: %lu ranges flushed for fsync, %lu expired or at unmount\n", atomic_load(&vol->fsync_flushes), atomic_load(&vol->expired_flushes));
+    fprintf(out, "dcache: %lu hits, %lu misses (%d slots)\n", vol->dcache_hits, vol->dcache_misses, DCACHE_SLOTS);
+    for (int i = 0; i < vol->num_disks; i++) {
+        fprintf(out, "disk %d: %lu reads, %lu bytes read\n", i, atomic_load(&vol->disk_stats[i].reads), atomic_load(&vol->disk_stats[i].read_bytes));
+    }
+    if (vol->superblock->mode == 2 || vol->csum_table) {
+        fprintf(out, "verify: %lu repaired, %lu unrecoverable\n", atomic_load(&vol->verify_repairs), atomic_load(&vol->verify_failures));
+    }
+}
+
+size_t hfs_stats_render(char **text) {
+    return stats_render(text);
+}
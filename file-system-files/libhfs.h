@@ -0,0 +1,121 @@
+#ifndef LIBHFS_H
+#define LIBHFS_H
+
+#include "stdio.h"
+#include "stdbool.h"
+#include "sys/types.h"
+#include "sys/stat.h"
+
+/*
+  libhfs: the file system without FUSE. Programs link libhfs.a and work on
+  disk images made by mkfs in-process; hfs itself is a FUSE front end over
+  the same calls.
+
+  Calls return 0 (reads and writes: the byte count) on success and a
+  negative errno on failure, like FUSE callbacks. Paths are absolute within
+  the volume ("/dir/file"). Every call is safe from several threads at once.
+  Each volume keeps its own state, so a process can have several open. Only
+  tracing and the latency statistics are process-wide: the trace options
+  of the latest open apply to every volume, the trace file is written when
+  the last volume closes, and hfs_stats_render() sums over all volumes.
+*/
+struct hfs_volume;
+
+// Zero (or a NULL pointer to these) picks the default for every field
+struct hfs_options {
+    const char *io;          /* File data I/O: "mmap" (default), "pread" or "uring" */
+    int queue_depth;         /* Requests each io_uring keeps in flight, 64 by default */
+    const char *read_policy; /* RAID 1/1v mirror choice: "rr", "lor" (default) or "locality" */
+    const char *trace;       /* "off" (default), "error", "info" or "debug"; needs a build with HFS_TRACE */
+    const char *trace_file;  /* Written at close, hfs.trace in the current directory by default */
+    bool defer_start;        /* Leave starting the background threads to hfs_volume_start() */
+};
+
+struct hfs_volume_info {
+    int mode;            /* RAID 0, 1 or 2 for 1v */
+    int num_disks;
+    size_t block_size;
+    size_t total_blocks;
+    size_t free_blocks;
+    size_t total_inodes;
+    size_t free_inodes;
+    size_t shared_blocks; /* Data blocks mapped by more than one file */
+    const char *io;      /* I/O backend in use */
+};
+
+// Called by hfs_readdir() for each entry, "." and ".." first; nonzero stops the listing
+typedef int (*hfs_fill_t)(void *ctx, const char *name, const struct stat *st, off_t offset);
+
+// Volume
+int hfs_options_parse(int *argc, char *argv[], struct hfs_options *opts); /* --io=, --read-policy= etc. out of a command line */
+int hfs_volume_open(char *const paths[], int count, const struct hfs_options *opts, struct hfs_volume **volp);
+void hfs_volume_start(struct hfs_volume *vol);  /* Journal committer and writeback flusher, e.g. after a fork */
+void hfs_volume_stop(struct hfs_volume *vol);   /* Stop them and write everything back; later changes go straight through */
+void hfs_volume_close(struct hfs_volume *vol);
+void hfs_volume_info(struct hfs_volume *vol, struct hfs_volume_info *info);
+void hfs_volume_report(struct hfs_volume *vol, FILE *out); /* Cache, disk and repair counters */
+size_t hfs_stats_render(char **text); /* Latency statistics of every open volume as malloc'd text */
+int hfs_sync(struct hfs_volume *vol);
+
+// By path
+int hfs_stat(struct hfs_volume *vol, const char *path, struct stat *st);
+int hfs_mknod(struct hfs_volume *vol, const char *path, mode_t mode, dev_t dev);
+int hfs_mkdir(struct hfs_volume *vol, const char *path, mode_t mode);
+int hfs_unlink(struct hfs_volume *vol, const char *path);
+int hfs_rmdir(struct hfs_volume *vol, const char *path);
+int hfs_readdir(struct hfs_volume *vol, const char *path, hfs_fill_t fill, void *ctx);
+int hfs_read(struct hfs_volume *vol, const char *path, char *buf, size_t size, off_t offset);
+int hfs_write(struct hfs_volume *vol, const char *path, const char *buf, size_t size, off_t offset);
+int hfs_fsync(struct hfs_volume *vol, const char *path); /* A directory's fsync covers metadata only */
+int hfs_truncate(struct hfs_volume *vol, const char *path, off_t size);
+
+/*
+  By handle: hfs_open() resolves the path once and the others skip the lookup.
+  A handle names one file for as long as it exists; once the file is removed
+  the calls fail with ESTALE, even after its inode is reused. Handles are
+  non-negative, and the root directory's is HFS_ROOT_INO. st_ino in the stat
+  calls and hfs_readdir() entries is the file's handle.
+*/
+typedef long long hfs_ino_t;
+#define HFS_ROOT_INO ((hfs_ino_t)0)
+
+hfs_ino_t hfs_open(struct hfs_volume *vol, const char *path);
+int hfs_fstat(struct hfs_volume *vol, hfs_ino_t ino, struct stat *st);
+int hfs_pread(struct hfs_volume *vol, hfs_ino_t ino, char *buf, size_t size, off_t offset);
+int hfs_pwrite(struct hfs_volume *vol, hfs_ino_t ino, const char *buf, size_t size, off_t offset);
+int hfs_fsync_ino(struct hfs_volume *vol, hfs_ino_t ino);
+int hfs_truncate_ino(struct hfs_volume *vol, hfs_ino_t ino, off_t size);
+off_t hfs_lseek_ino(struct hfs_volume *vol, hfs_ino_t ino, off_t offset, int whence); /* SEEK_DATA or SEEK_HOLE */
+int hfs_close(struct hfs_volume *vol, hfs_ino_t ino); /* Starts writing the file's data back */
+
+/*
+  Open files: the handle plus the last run of blocks the file mapped, so
+  sequential reads and writes skip both the path and the extent lookup.
+  Calls on one hfs_file may run in parallel. Once the file is removed they
+  fail with ESTALE; hfs_file_close() frees the hfs_file either way.
+*/
+struct hfs_file;
+
+int hfs_file_open(struct hfs_volume *vol, hfs_ino_t ino, struct hfs_file **fp); /* EISDIR for a directory */
+int hfs_file_read(struct hfs_volume *vol, struct hfs_file *f, char *buf, size_t size, off_t offset);
+int hfs_file_write(struct hfs_volume *vol, struct hfs_file *f, const char *buf, size_t size, off_t offset);
+int hfs_file_truncate(struct hfs_volume *vol, struct hfs_file *f, off_t size);
+// mode 0 allocates the range (FALLOC_FL_KEEP_SIZE: without growing the file);
+// FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE frees it. Other modes fail with EOPNOTSUPP.
+int hfs_file_fallocate(struct hfs_volume *vol, struct hfs_file *f, int mode, off_t offset, off_t len);
+off_t hfs_file_lseek(struct hfs_volume *vol, struct hfs_file *f, off_t offset, int whence);
+// copy_file_range(2): len bytes at off_in in src to off_out in dst. Returns the bytes copied, short at
+// the end of src. Whole blocks are shared copy-on-write rather than copied when the offsets line up in a block.
+ssize_t hfs_file_copy_range(struct hfs_volume *vol, struct hfs_file *src, off_t off_in, struct hfs_file *dst, off_t off_out, size_t len);
+int hfs_file_fsync(struct hfs_volume *vol, struct hfs_file *f);
+int hfs_file_close(struct hfs_volume *vol, struct hfs_file *f); /* Like hfs_close() */
+
+// Entries of directory dir by name; st (may be NULL) gets the entry's attributes
+hfs_ino_t hfs_lookup(struct hfs_volume *vol, hfs_ino_t dir, const char *name, struct stat *st);
+hfs_ino_t hfs_mknodat(struct hfs_volume *vol, hfs_ino_t dir, const char *name, mode_t mode, dev_t dev, struct stat *st);
+hfs_ino_t hfs_mkdirat(struct hfs_volume *vol, hfs_ino_t dir, const char *name, mode_t mode, struct stat *st);
+int hfs_unlinkat(struct hfs_volume *vol, hfs_ino_t dir, const char *name);
+int hfs_rmdirat(struct hfs_volume *vol, hfs_ino_t dir, const char *name);
+int hfs_readdir_ino(struct hfs_volume *vol, hfs_ino_t dir, hfs_fill_t fill, void *ctx);
+
+#endif
@@ -5,36 +5,65 @@
 #include "fcntl.h"
 #include "sys/stat.h"
 #include "sys/types.h"
-#include "sys/mman.h"
 #include "time.h"
 #include "getopt.h"
-#include "wfs.h"
+#include "hfs.h"
 
-int num_blocks;
+long num_blocks;
 int num_inodes;
 int disks;
 int raid_mode;
+int block_size;
+int inode_size;
+int stripe_size;
+long journal_size;
 char* diskNames[256] = {NULL};
 
+#define MKFS_ZERO_CHUNK (1 << 20)
+
+
+// Write len bytes at offset, retrying short writes
+static int write_at(int fd, const void *buf, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, offset);
+        if (n <= 0) return -1;
+        buf = (const char *)buf + n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
 
 void init_filesystem(){
    // printf("started init");
     int* fileDescs = malloc(sizeof(int) * disks);
     //size_t total_blocks = num_blocks + num_inodes / BLOCK_SIZE + 1;
 
-    void **diskMaps = malloc(disks * sizeof(void *));
-    if (!diskMaps) {
-        fprintf(stderr, "malloc for diskMaps");
+    // Only the head is written, a chunk of zeroes at a time, so big images don't need mapping or zeroing in full
+    char *zeroes = calloc(1, MKFS_ZERO_CHUNK);
+    if (!fileDescs || !zeroes) {
+        fprintf(stderr, "malloc for fileDescs");
         exit(-1);
     }
     
-    off_t i_bitmap_offset = sizeof(struct wfs_sb);
+    // RAID 0 stripes num_blocks per disk across every disk, so its data bitmap covers all of them
+    size_t stripe_unit = stripe_size / block_size;
+    if (raid_mode == 0) {
+        num_blocks = ((num_blocks + stripe_unit - 1) / stripe_unit) * stripe_unit;
+    }
+    size_t total_blocks = raid_mode == 0 ? (size_t)num_blocks * disks : (size_t)num_blocks;
+
+    off_t i_bitmap_offset = sizeof(struct hfs_sb);
     off_t d_bitmap_offset = i_bitmap_offset + (num_inodes + 7) / 8; 
 
-    off_t i_blocks_start = (((d_bitmap_offset + (num_blocks + 7) / 8) + BLOCK_SIZE-1 ) / BLOCK_SIZE) * BLOCK_SIZE; 
-    off_t d_blocks_start = i_blocks_start + (num_inodes * BLOCK_SIZE);
+    off_t i_blocks_start = (((d_bitmap_offset + (total_blocks + 7) / 8) + block_size-1 ) / block_size) * block_size; 
+    // One CRC32C per data block, then the data region, each aligned to the block size
+    off_t csum_start = ((i_blocks_start + ((off_t)num_inodes * inode_size) + block_size-1) / block_size) * block_size;
+    off_t journal_start = ((csum_start + (off_t)total_blocks * sizeof(uint32_t) + block_size-1) / block_size) * block_size;
+    journal_size = ((journal_size + block_size - 1) / block_size) * block_size;
+    off_t d_blocks_start = journal_start + journal_size;
     
-    struct wfs_sb superblock = {
+    struct hfs_sb superblock = {
         .num_data_blocks = num_blocks,
         .num_inodes = num_inodes,
         .d_bitmap_ptr = d_bitmap_offset,
@@ -42,10 +71,34 @@ void init_filesystem(){
         .d_blocks_ptr = d_blocks_start,
         .i_blocks_ptr = i_blocks_start,
         .mode = raid_mode,
-        .num_disks = disks
+        .num_disks = disks,
+        .block_size = block_size,
+        .inode_size = inode_size,
+        .stripe_unit = stripe_unit,
+        .csum_ptr = csum_start,
+        .journal_ptr = journal_size ? journal_start : 0,
+        .journal_size = journal_size
+    };
+
+    off_t diskSize = d_blocks_start + ((off_t)num_blocks * block_size);
+
+    struct hfs_journal_header journal = {
+        .magic = HFS_JOURNAL_MAGIC,
+        .state = HFS_JOURNAL_CLEAN
     };
 
-    int diskSize = i_blocks_start + (num_inodes * BLOCK_SIZE) + (num_blocks * BLOCK_SIZE);
+    struct hfs_inode root_inode = {0};
+    root_inode.mode = S_IFDIR | 0777; 
+    root_inode.uid = getuid();
+    root_inode.gid = getgid();
+    root_inode.num = 0;
+    root_inode.nlinks = 2; 
+    root_inode.atim = root_inode.mtim = root_inode.ctim = time(NULL);
+    for (int i = 0; i < N_BLOCKS; i++) {
+        root_inode.blocks[i] = -1;
+    }
+
+    char root_used = 1;
     
     for (int i = 0; i < disks; i++) {
         // Update disk index
@@ -56,77 +109,56 @@ void init_filesystem(){
         if (fileDescs[i] < 0) {
             fprintf(stderr, "could not open file");
             for(int k = 0; k < i; k++){
-                munmap(diskMaps[k], diskSize);
                 close(fileDescs[k]);
             }
             free(fileDescs);
-            free(diskMaps);
+            free(zeroes);
             exit(-1);
         }
 
         if (fstat(fileDescs[i], &fStat) < 0 || fStat.st_size < diskSize) {
-            for (int j = 0; j < i; j++) {
-                munmap(diskMaps[j], diskSize);
+            for (int j = 0; j <= i; j++) {
                 close(fileDescs[j]);
             }
-            close(fileDescs[i]);
-            free(diskMaps);
             free(fileDescs);
+            free(zeroes);
             
             exit(-1);  // Runtime error - file too small or stat failed
         }
 
-        diskMaps[i] = mmap(NULL, diskSize, PROT_READ | PROT_WRITE, MAP_SHARED, fileDescs[i], 0);
-        if (diskMaps[i] == MAP_FAILED) {
-            fprintf(stderr, "mmap");
-            for(int k = 0; k < i; k++){
-                munmap(diskMaps[k], diskSize);
-                close(fileDescs[k]);
+        // Bitmaps, inodes, checksums and journal all start out zero
+        int rc = 0;
+        for (off_t pos = 0; rc == 0 && pos < d_blocks_start; pos += MKFS_ZERO_CHUNK) {
+            size_t len = d_blocks_start - pos < MKFS_ZERO_CHUNK ? d_blocks_start - pos : MKFS_ZERO_CHUNK;
+            rc = write_at(fileDescs[i], zeroes, len, pos);
+        }
+        if (rc == 0) rc = write_at(fileDescs[i], &superblock, sizeof(superblock), 0);
+        if (rc == 0) rc = write_at(fileDescs[i], &root_used, 1, i_bitmap_offset);
+        if (rc == 0 && journal_size) rc = write_at(fileDescs[i], &journal, sizeof(journal), journal_start);
+        if (rc == 0) rc = write_at(fileDescs[i], &root_inode, sizeof(root_inode), i_blocks_start);
+        if (rc == 0) rc = fsync(fileDescs[i]);
+        if (rc != 0) {
+            fprintf(stderr, "write to %s failed\n", diskNames[i]);
+            for (int j = 0; j <= i; j++) {
+                close(fileDescs[j]);
             }
-            close(fileDescs[i]);
-            free(diskMaps);
             free(fileDescs);
-            
+            free(zeroes);
             exit(-1);
         }
-
-        memset(diskMaps[i], 0, diskSize);
-        memcpy(diskMaps[i], &superblock, sizeof(superblock));
-
-        char *i_bitmap =(char *)diskMaps[i] + i_bitmap_offset;
-        memset(i_bitmap, 0, (num_inodes + 7) / 8);
-        i_bitmap[0] = 1;
-
-        char *d_bitmap = (char *)diskMaps[i] + d_bitmap_offset;
-        memset(d_bitmap, 0, (num_blocks + 7) / 8);
-
-        struct wfs_inode root_inode = {0};
-        root_inode.mode = S_IFDIR | 0777; 
-        root_inode.uid = getuid();
-        root_inode.gid = getgid();
-        root_inode.num = 0;
-        root_inode.nlinks = 2; 
-        root_inode.atim = root_inode.mtim = root_inode.ctim = time(NULL);
-        for (int i = 0; i < N_BLOCKS; i++) {
-            root_inode.blocks[i] = -1;
-        }
-
-        memcpy((char*)diskMaps[i] + i_blocks_start, &root_inode, sizeof(root_inode));
-        msync(diskMaps[i], diskSize, MS_SYNC);
     }
 
 
     for (int i = 0; i < disks; i++) {
-        munmap(diskMaps[i], diskSize);
         close(fileDescs[i]);
     }
-    free(diskMaps);
     free(fileDescs);
+    free(zeroes);
     return;
 }
 void parse(int argc, char* argv[]){
     int opt;
-    while((opt = getopt(argc, argv, "r:d:i:b:")) != -1){
+    while((opt = getopt(argc, argv, "r:d:i:b:B:I:s:J:")) != -1){
         switch(opt){
             case 'r':
                 if(strcmp(optarg, "0") == 0){
@@ -159,9 +191,37 @@ void parse(int argc, char* argv[]){
                     fprintf(stdout, "Missing argument for -b.\n");
                     exit(1);
                 }
-                num_blocks = atoi(optarg);
+                num_blocks = atol(optarg);
                 num_blocks = ((num_blocks + 31) / 32) * 32;
                 break;
+            case 'B':
+                if (!optarg) {
+                    fprintf(stdout, "Missing argument for -B.\n");
+                    exit(1);
+                }
+                block_size = atoi(optarg);
+                break;
+            case 'I':
+                if (!optarg) {
+                    fprintf(stdout, "Missing argument for -I.\n");
+                    exit(1);
+                }
+                inode_size = atoi(optarg);
+                break;
+            case 's':
+                if (!optarg) {
+                    fprintf(stdout, "Missing argument for -s.\n");
+                    exit(1);
+                }
+                stripe_size = atoi(optarg);
+                break;
+            case 'J':
+                if (!optarg) {
+                    fprintf(stdout, "Missing argument for -J.\n");
+                    exit(1);
+                }
+                journal_size = atol(optarg);
+                break;
         }
     }
     if(disks < 2){
@@ -176,6 +236,31 @@ void parse(int argc, char* argv[]){
         fprintf(stderr, "no data blocks\n");
         exit(1);
     }
+    // Power of two so block offsets stay shifts and masks
+    if(block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE || (block_size & (block_size - 1)) != 0){
+        fprintf(stderr, "block size must be a power of two from %d to %d\n", MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+        exit(1);
+    }
+    // Slots below 512 bytes pack several inodes per block
+    if(inode_size < MIN_INODE_SIZE || inode_size > INODE_SIZE || (inode_size & (inode_size - 1)) != 0){
+        fprintf(stderr, "inode size must be a power of two from %d to %d\n", MIN_INODE_SIZE, INODE_SIZE);
+        exit(1);
+    }
+    if(stripe_size == 0){
+        stripe_size = STRIPE_UNIT > block_size ? STRIPE_UNIT : block_size;
+    }
+    if(stripe_size < block_size || (stripe_size & (stripe_size - 1)) != 0){
+        fprintf(stderr, "stripe unit must be a power of two no smaller than the block size\n");
+        exit(1);
+    }
+    // 0 makes an image without a journal; otherwise it needs a header block and room for records
+    if(journal_size < 0){
+        journal_size = JOURNAL_SIZE;
+    }
+    if(journal_size != 0 && journal_size < 2 * block_size){
+        fprintf(stderr, "journal must be at least two blocks\n");
+        exit(1);
+    }
 
    // printf("%i, %i, %i", num_inodes, num_blocks, disks);
 }
@@ -184,6 +269,10 @@ int main(int argc, char* argv[]){
     raid_mode = -1;
     num_blocks = -1;
     num_inodes = -1;
+    block_size = BLOCK_SIZE;
+    inode_size = INODE_SIZE;
+    stripe_size = 0;
+    journal_size = -1;
     disks = 0;
 
     parse(argc, argv);
@@ -0,0 +1,68 @@
+#include <stdint.h>
+
+/*
+  Trace format, shared by hfs (built with -DHFS_TRACE) and tracedump.
+
+  hfs appends fixed-size binary records to a ring per thread and writes every
+  ring to the trace file at unmount: a struct hfs_trace_header followed by
+  count records, each ring oldest first. A record holds an event number
+  instead of text; tracedump formats it with the event's format string, in
+  which %s is the record's string and each %ld the next argument.
+*/
+#define HFS_TRACE_MAGIC   (0x48545243) /* "HTRC" */
+#define HFS_TRACE_VERSION (1)
+
+// Levels, from --trace=error|info|debug; 0 is off
+#define HFS_TRACE_ERROR (1)
+#define HFS_TRACE_INFO  (2)
+#define HFS_TRACE_DEBUG (3)
+
+#define HFS_TRACE_STR (24) /* Bytes of the string kept, including the NUL */
+
+#define HFS_TRACE_EVENTS(X) \
+    X(GET_INODE_RANGE,   "get_inode: index %ld out of range") \
+    X(FIND_INODE,        "find_inode %s") \
+    X(FIND_INODE_MISS,   "find_inode %s: error %ld") \
+    X(FIND_INODE_HIT,    "find_inode %s: inode %ld") \
+    X(NOT_DIR,           "lookup %s: inode %ld is not a directory") \
+    X(GETATTR,           "getattr %s") \
+    X(GETATTR_FAIL,      "getattr %s: error %ld") \
+    X(MKNOD,             "mknod %s: inode %ld in directory %ld") \
+    X(MKDIR,             "mkdir %s: inode %ld in directory %ld") \
+    X(CREATE_FAIL,       "create %s: error %ld") \
+    X(UNLINK,            "unlink %s: inode %ld") \
+    X(UNLINK_FAIL,       "unlink %s: error %ld") \
+    X(RMDIR,             "rmdir %s: inode %ld") \
+    X(RMDIR_FAIL,        "rmdir %s: error %ld") \
+    X(READ,              "read %s: %ld bytes at %ld") \
+    X(WRITE,             "write %s: %ld bytes at %ld") \
+    X(READDIR,           "readdir %s") \
+    X(READDIR_FAIL,      "readdir %s: error %ld") \
+    X(DIR_TO_INDEX,      "directory inode %ld converted to an index tree") \
+    X(LOOKUP,            "lookup %s") \
+    X(TRUNCATE,          "truncate %s: to %ld") \
+    X(FALLOCATE,         "fallocate %s: mode %ld, %ld bytes at %ld") \
+    X(LSEEK,             "lseek %s: whence %ld from %ld") \
+    X(COPY_RANGE,        "copy_file_range %s: %ld bytes from %ld to %ld")
+
+#define HFS_TRACE_ENUM(name, format) TRACE_EV_##name,
+enum hfs_trace_event { HFS_TRACE_EVENTS(HFS_TRACE_ENUM) TRACE_EV_COUNT };
+#undef HFS_TRACE_ENUM
+
+struct hfs_trace_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size; /* sizeof(struct hfs_trace_record) */
+    uint32_t events;      /* TRACE_EV_COUNT of the writer */
+    uint64_t count;       /* Records that follow */
+};
+
+struct hfs_trace_record {
+    uint64_t ns;          /* CLOCK_MONOTONIC */
+    uint32_t tid;
+    uint16_t event;
+    uint8_t  level;
+    uint8_t  unused;
+    int64_t  args[3];
+    char     str[HFS_TRACE_STR];
+};
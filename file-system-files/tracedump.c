@@ -0,0 +1,82 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "inttypes.h"
+#include "trace.h"
+
+// Print a trace file written by hfs --trace=..., in time order.
+// usage: ./tracedump [trace file]   (hfs.trace if not given)
+
+#define HFS_TRACE_FORMAT(name, format) format,
+static const char *formats[] = { HFS_TRACE_EVENTS(HFS_TRACE_FORMAT) };
+#undef HFS_TRACE_FORMAT
+
+static const char *levels[] = {"off", "error", "info", "debug"};
+
+static int cmp_record(const void *a, const void *b) {
+    const struct hfs_trace_record *x = a, *y = b;
+    return (x->ns > y->ns) - (x->ns < y->ns);
+}
+
+// %s is the record's string and each %ld the next argument; nothing else is used in formats
+static void print_message(const struct hfs_trace_record *rec) {
+    if (rec->event >= TRACE_EV_COUNT) {
+        printf("unknown event %u", rec->event);
+        return;
+    }
+    int arg = 0;
+    for (const char *p = formats[rec->event]; *p; p++) {
+        if (strncmp(p, "%s", 2) == 0) {
+            printf("%.*s", HFS_TRACE_STR, rec->str);
+            p++;
+        } else if (strncmp(p, "%ld", 3) == 0 && arg < 3) {
+            printf("%" PRId64, rec->args[arg++]);
+            p += 2;
+        } else {
+            putchar(*p);
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const char *path = argc > 1 ? argv[1] : "hfs.trace";
+    FILE *in = fopen(path, "rb");
+    if (in == NULL) {
+        fprintf(stderr, "cannot open %s\n", path);
+        return 1;
+    }
+
+    struct hfs_trace_header header;
+    if (fread(&header, sizeof(header), 1, in) != 1 || header.magic != HFS_TRACE_MAGIC) {
+        fprintf(stderr, "%s is not an hfs trace\n", path);
+        return 1;
+    }
+    if (header.version != HFS_TRACE_VERSION || header.record_size != sizeof(struct hfs_trace_record)) {
+        fprintf(stderr, "%s was written by a different version of hfs\n", path);
+        return 1;
+    }
+
+    struct hfs_trace_record *records = malloc((header.count ? header.count : 1) * sizeof(struct hfs_trace_record));
+    if (records == NULL) {
+        fprintf(stderr, "out of memory for %" PRIu64 " records\n", header.count);
+        return 1;
+    }
+    size_t count = fread(records, sizeof(struct hfs_trace_record), header.count, in);
+    fclose(in);
+    if (count < header.count) {
+        fprintf(stderr, "%s is truncated, showing %zu of %" PRIu64 " records\n", path, count, header.count);
+    }
+
+    // Rings are written one after another; interleave them by time
+    qsort(records, count, sizeof(struct hfs_trace_record), cmp_record);
+    uint64_t start = count ? records[0].ns : 0;
+    for (size_t i = 0; i < count; i++) {
+        uint64_t ns = records[i].ns - start;
+        printf("%6" PRIu64 ".%06" PRIu64 " %7u %-5s ", ns / 1000000000, ns / 1000 % 1000000, records[i].tid,
+               records[i].level <= HFS_TRACE_DEBUG ? levels[records[i].level] : "?");
+        print_message(&records[i]);
+        putchar('\n');
+    }
+    free(records);
+    return 0;
+}